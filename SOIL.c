@@ -31,7 +31,12 @@
 //#endif
 
 #include "SOIL.h"
+#include "image_thread.h"
+#include "image_checksum.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBIW_PARALLEL image_thread_run
+#define STBIW_CRC32 image_crc32
+#define STBIW_ADLER32 image_adler32
 #include "stb_image_write.h"
 #define STBI_NO_WRITE
 #include "stb_image_aug.h"
@@ -41,8 +46,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-/*	error reporting	*/
-char *result_string_pointer = "SOIL initialized";
+/*	error reporting, per thread like stbi's failure reason	*/
+IMAGE_THREAD_LOCAL char *result_string_pointer = "SOIL initialized";
 
 ///*	for loading cube maps	*/
 //enum{
@@ -1519,6 +1524,119 @@ int
 	return save_result;
 }
 
+int
+	SOIL_save_image_to_func
+	(
+		SOIL_write_func func, void *context,
+		int image_type,
+		int width, int height, int channels,
+		const unsigned char *const data
+	)
+{
+	int save_result;
+
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(channels < 1) || (channels > 4) ||
+		(data == NULL) ||
+		(func == NULL) )
+	{
+		return 0;
+	}
+	if( image_type == SOIL_SAVE_TYPE_PNG )
+	{
+		save_result = stbi_write_png_to_func( func, context,
+				width, height, channels, (const unsigned char *const)data, 0 );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_BMP )
+	{
+		save_result = stbi_write_bmp_to_func( func, context,
+				width, height, channels, (const unsigned char *const)data );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_TGA )
+	{
+		save_result = stbi_write_tga_to_func( func, context,
+				width, height, channels, (const unsigned char *const)data );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_DDS )
+	{
+		DDS_memory_rows rows;
+		rows.data = data;
+		rows.row_bytes = width * channels;
+		save_result = save_image_as_DDS_to_func( func, context,
+				width, height, channels, DDS_read_memory_row, &rows, 0 );
+	} else
+	{
+		save_result = 0;
+	}
+	if( save_result == 0 )
+	{
+		result_string_pointer = "Saving the image failed";
+	} else
+	{
+		result_string_pointer = "Image saved";
+	}
+	return save_result;
+}
+
+int
+	SOIL_save_image_rows_to_func
+	(
+		SOIL_write_func func, void *context,
+		int image_type,
+		int width, int height, int channels,
+		SOIL_row_func get_row, void *row_context,
+		const SOIL_save_options *options
+	)
+{
+	SOIL_save_options defaults = { -1, 0, 0 };
+	int save_result;
+
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(channels < 1) || (channels > 4) ||
+		(get_row == NULL) ||
+		(func == NULL) )
+	{
+		return 0;
+	}
+	if( options == NULL )
+	{
+		options = &defaults;
+	}
+	if( image_type == SOIL_SAVE_TYPE_PNG )
+	{
+		save_result = stbi_write_png_rows_to_func( func, context,
+				width, height, channels, get_row, row_context, options->png_level );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_BMP )
+	{
+		save_result = stbi_write_bmp_rows_to_func( func, context,
+				width, height, channels, get_row, row_context );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_TGA )
+	{
+		save_result = stbi_write_tga_rows_to_func( func, context,
+				width, height, channels, get_row, row_context, options->tga_rle != 0 );
+	} else
+	if( image_type == SOIL_SAVE_TYPE_DDS )
+	{
+		save_result = save_image_as_DDS_to_func( func, context,
+				width, height, channels, get_row, row_context, options->dds_mipmaps );
+	} else
+	{
+		save_result = 0;
+	}
+	if( save_result == 0 )
+	{
+		result_string_pointer = "Saving the image failed";
+	} else
+	{
+		result_string_pointer = "Image saved";
+	}
+	return save_result;
+}
+
 void
 	SOIL_free_image_data
 	(
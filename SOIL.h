@@ -405,6 +405,65 @@ int
 		const unsigned char *const data
 	);
 
+/**
+	Receives an image being saved a piece at a time, in file order.
+**/
+typedef void (*SOIL_write_func)( void *context, void *data, int size );
+
+/**
+	Saves an image from an array of unsigned chars (RGBA) through a
+	callback instead of to disk.  The image is encoded a few rows at a
+	time and each piece is handed to func as soon as it is ready, so
+	the whole file is never held in memory.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_save_image_to_func
+	(
+		SOIL_write_func func, void *context,
+		int image_type,
+		int width, int height, int channels,
+		const unsigned char *const data
+	);
+
+/**
+	Supplies row y of an image being saved (width * channels bytes).
+	Rows are asked for in the order the file stores them.
+	\return 0 to abandon the save, otherwise 1
+**/
+typedef int (*SOIL_row_func)( void *context, int y, unsigned char *row );
+
+/**
+	Per-save encoder settings.
+**/
+typedef struct
+{
+	/*	PNG: zlib level 0 (fastest) to 9 (smallest), -1 for the default	*/
+	int png_level;
+	/*	DDS: non-zero writes the full MIPmap chain after the image	*/
+	int dds_mipmaps;
+	/*	TGA: non-zero writes run-length encoded pixels	*/
+	int tga_rle;
+}
+SOIL_save_options;
+
+/**
+	Saves an image whose rows come from get_row through a callback,
+	using the given options (NULL for the defaults).  No copy of the
+	whole image is ever made, except that DDS MIPmaps keep a quarter
+	size one.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_save_image_rows_to_func
+	(
+		SOIL_write_func func, void *context,
+		int image_type,
+		int width, int height, int channels,
+		SOIL_row_func get_row, void *row_context,
+		const SOIL_save_options *options
+	);
+
 /**
 	Frees the image data (note, this is just C's "free()"...this function is
 	present mostly so C++ programmers don't forget to use "free()" and call
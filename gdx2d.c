@@ -1,43 +1,263 @@
 
 #include "gdx2d.h"
 #include <stdlib.h>
+#include <string.h>
 #define STBI_HEADER_FILE_ONLY
-#define STBI_NO_FAILURE_STRINGS
 #include "SOIL.h"
+#include "stb_image_aug.h"
+#include "stbi_DDS_aug.h"
 #include "image_helper.h"
+#include "image_thread.h"
+#include <stdio.h>
+
+/* the float formats use SSE2 where the compiler targets it,
+   PIXMAP_NO_SSE2 builds the plain C paths only */
+#if !defined(PIXMAP_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PIXMAP_SSE2
+#include <emmintrin.h>
+#endif
 
 static int pixmap_blend = pixmap_BLEND_NONE;
 static int pixmap_scale = pixmap_SCALE_NEAREST;
 
-static int* lu4 = 0;
-static int* lu5 = 0;
-static int* lu6 = 0;
+/* the outcome of the last load or save on each thread */
+static IMAGE_THREAD_LOCAL int failure_code = pixmap_ERROR_NONE;
+static IMAGE_THREAD_LOCAL const char* failure_reason = 0;
 
-typedef void(*set_pixel_func)(unsigned char* pixel_addr, int color);
-typedef int(*get_pixel_func)(unsigned char* pixel_addr);
+static inline int set_failure(int code, const char* reason) {
+	failure_code = code;
+	failure_reason = reason;
+	return code == pixmap_ERROR_NONE;
+}
+
+/* passes on why stbi couldn't load the image */
+static inline Pixmap* load_failed() {
+	set_failure(stbi_failure_code(), stbi_failure_reason());
+	return NULL;
+}
+
+static Pixmap* wrap_pixels(const unsigned char* pixels, int width, int height, int format) {
+	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
+	if(!pixmap) {
+		free((void*)pixels);
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	pixmap->width = width;
+	pixmap->height = height;
+	pixmap->format = format;
+	pixmap->pixels = pixels;
+	set_failure(pixmap_ERROR_NONE, 0);
+	return pixmap;
+}
+
+static Pixmap* alloc_pixmap(int width, int height, int format) {
+	unsigned char* pixels = (unsigned char*)malloc((size_t)width * height * pixmap_bytes_per_pixel(format));
+	if(!pixels) {
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	return wrap_pixels(pixels, width, height, format);
+}
+
+/* i / 15.0f * 255 etc., built at compile time so any thread can use them */
+static const int lu4[16] = {
+	0, 17, 34, 51, 68, 85, 102, 119, 136, 153, 170, 187, 204, 221, 238, 255
+};
+static const int lu5[32] = {
+	0, 8, 16, 24, 32, 41, 49, 57, 65, 74, 82, 90, 98, 106, 115, 123,
+	131, 139, 148, 156, 164, 172, 180, 189, 197, 205, 213, 222, 230, 238, 246, 255
+};
+static const int lu6[64] = {
+	0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60,
+	64, 68, 72, 76, 80, 85, 89, 93, 97, 101, 105, 109, 113, 117, 121, 125,
+	129, 133, 137, 141, 145, 149, 153, 157, 161, 165, 170, 174, 178, 182, 186, 190,
+	194, 198, 202, 206, 210, 214, 218, 222, 226, 230, 234, 238, 242, 246, 250, 255
+};
+
+static inline int is_float_format(int format) {
+	return format == pixmap_FORMAT_RGBA32F || format == pixmap_FORMAT_RGBA16F;
+}
+
+/* pixels the float paths convert at a time, through buffers on the stack */
+#define FLOAT_CHUNK 256
+
+typedef union {
+	float f;
+	unsigned int u;
+} float_bits;
+
+/* rounded to nearest even, what doesn't fit becomes infinity */
+static inline unsigned short float_to_half(float value) {
+	float_bits v;
+	unsigned int sign, abs;
+	v.f = value;
+	sign = (v.u >> 16) & 0x8000;
+	abs = v.u & 0x7fffffff;
+	if(abs >= 0x47800000)
+		return (unsigned short)(sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00));
+	if(abs < 0x38800000) {
+		/* denormal: adding 0.5 lines the mantissa up and rounds it */
+		v.u = abs;
+		v.f += 0.5f;
+		return (unsigned short)(sign | (v.u - 0x3f000000));
+	}
+	return (unsigned short)(sign | ((abs + 0xc8000fff + ((abs >> 13) & 1)) >> 13));
+}
+
+/* the exponent is rebiased by multiplying with 2^112, which normalizes denormals too */
+static inline float half_to_float(unsigned short half) {
+	float_bits v, magic;
+	magic.u = 0x77800000;
+	v.u = (unsigned int)(half & 0x7fff) << 13;
+	v.f *= magic.f;
+	if(v.u >= 0x47800000)
+		v.u |= 0x7f800000;
+	v.u |= (unsigned int)(half & 0x8000) << 16;
+	return v.f;
+}
+
+#ifdef PIXMAP_SSE2
+/* half_to_float on four halves, one to a 32-bit lane */
+static inline __m128 half_to_float4(__m128i half) {
+	__m128i expmant = _mm_and_si128(half, _mm_set1_epi32(0x7fff));
+	__m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expmant, 13)), _mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+	__m128i infnan = _mm_and_si128(_mm_cmpgt_epi32(expmant, _mm_set1_epi32(0x7bff)), _mm_set1_epi32(0x7f800000));
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(half, _mm_set1_epi32(0x8000)), 16);
+	return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(infnan, sign)));
+}
 
-static inline void generate_look_ups() {
+/* float_to_half on four floats, sign extended so _mm_packs_epi32 keeps them */
+static inline __m128i float_to_half4(__m128 value) {
+	__m128 sign = _mm_and_ps(value, _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000)));
+	__m128 abs = _mm_xor_ps(value, sign);
+	__m128i bits = _mm_castps_si128(abs);
+	__m128i regular = _mm_cmpgt_epi32(_mm_set1_epi32(0x47800000), bits);
+	__m128i nan = _mm_and_si128(_mm_castps_si128(_mm_cmpunord_ps(abs, abs)), _mm_set1_epi32(0x200));
+	__m128i denormal = _mm_cmpgt_epi32(_mm_set1_epi32(0x38800000), bits);
+	__m128i small = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(abs, _mm_set1_ps(0.5f))), _mm_set1_epi32(0x3f000000));
+	__m128i odd = _mm_srai_epi32(_mm_slli_epi32(bits, 18), 31);
+	__m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits, _mm_set1_epi32((int)0xc8000fff)), odd), 13);
+	__m128i finite = _mm_or_si128(_mm_and_si128(denormal, small), _mm_andnot_si128(denormal, normal));
+	__m128i half = _mm_or_si128(_mm_and_si128(regular, finite), _mm_andnot_si128(regular, _mm_or_si128(nan, _mm_set1_epi32(0x7c00))));
+	return _mm_or_si128(half, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+}
+
+/* four floats to 0-255, as quantize() does them */
+static inline __m128i quantize4(const float* src) {
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(255.0f));
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+	return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+}
+#endif
+
+/* count RGBA pixels, so 4 * count values, from halves to floats */
+static void half_to_float_row(float* dest, const unsigned short* src, int count) {
 	int i = 0;
-	lu4 = malloc(sizeof(int) * 16);
-	lu5 = malloc(sizeof(int) * 32);
-	lu6 = malloc(sizeof(int) * 64);
+#ifdef PIXMAP_SSE2
+	__m128i zero = _mm_setzero_si128();
+	for(; i + 2 <= count; i += 2) {
+		__m128i half = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		_mm_storeu_ps(dest + i * 4, half_to_float4(_mm_unpacklo_epi16(half, zero)));
+		_mm_storeu_ps(dest + i * 4 + 4, half_to_float4(_mm_unpackhi_epi16(half, zero)));
+	}
+#endif
+	for(i *= 4, count *= 4; i < count; i++)
+		dest[i] = half_to_float(src[i]);
+}
 
-	for(i = 0; i < 16; i++) {
-		lu4[i] = (int) i / 15.0f * 255;
-		lu5[i] = (int) i / 31.0f * 255;
-		lu6[i] = (int) i / 63.0f * 255;
+/* and back; dest may be src itself */
+static void float_to_half_row(unsigned short* dest, const float* src, int count) {
+	int i = 0;
+#ifdef PIXMAP_SSE2
+	for(; i + 2 <= count; i += 2) {
+		__m128i lo = float_to_half4(_mm_loadu_ps(src + i * 4));
+		__m128i hi = float_to_half4(_mm_loadu_ps(src + i * 4 + 4));
+		_mm_storeu_si128((__m128i*)(dest + i * 4), _mm_packs_epi32(lo, hi));
 	}
+#endif
+	for(i *= 4, count *= 4; i < count; i++)
+		dest[i] = float_to_half(src[i]);
+}
+
+static inline int quantize(float value) {
+	value *= 255.0f;
+	if(!(value > 0)) value = 0;
+	if(value > 255) value = 255;
+	return (int)(value + 0.5f);
+}
 
-	for(i = 16; i < 32; i++) {
-		lu5[i] = (int) i / 31.0f * 255;
-		lu6[i] = (int) i / 63.0f * 255;
+/* count RGBA8888 pixels to floats, 0-255 becoming 0-1 */
+static void bytes_to_float_row(float* dest, const unsigned char* src, int count) {
+	int i = 0;
+#ifdef PIXMAP_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128 scale = _mm_set1_ps(1.0f / 255);
+	for(; i + 4 <= count; i += 4) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+		__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+		_mm_storeu_ps(dest + i * 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+		_mm_storeu_ps(dest + i * 4 + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+		_mm_storeu_ps(dest + i * 4 + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+		_mm_storeu_ps(dest + i * 4 + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
 	}
+#endif
+	for(i *= 4, count *= 4; i < count; i++)
+		dest[i] = src[i] * (1.0f / 255);
+}
+
+/* and back, clamped to 0-1 */
+static void float_to_bytes_row(unsigned char* dest, const float* src, int count) {
+	int i = 0;
+#ifdef PIXMAP_SSE2
+	for(; i + 4 <= count; i += 4) {
+		__m128i lo = _mm_packs_epi32(quantize4(src + i * 4), quantize4(src + i * 4 + 4));
+		__m128i hi = _mm_packs_epi32(quantize4(src + i * 4 + 8), quantize4(src + i * 4 + 12));
+		_mm_storeu_si128((__m128i*)(dest + i * 4), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for(i *= 4, count *= 4; i < count; i++)
+		dest[i] = (unsigned char)quantize(src[i]);
+}
+
+static inline void color_to_float(int color, float* rgba) {
+	rgba[0] = ((color >> 24) & 0xff) * (1.0f / 255);
+	rgba[1] = ((color >> 16) & 0xff) * (1.0f / 255);
+	rgba[2] = ((color >> 8) & 0xff) * (1.0f / 255);
+	rgba[3] = (color & 0xff) * (1.0f / 255);
+}
+
+static inline int float_to_color(const float* rgba) {
+	return (int)(((unsigned int)quantize(rgba[0]) << 24) | (quantize(rgba[1]) << 16) | (quantize(rgba[2]) << 8) | quantize(rgba[3]));
+}
 
-	for(i = 32; i < 64; i++) {
-		lu6[i] = (int) i / 63.0f * 255;
+/* src over dst as blend() does it, with a = src alpha: dst * (1 - a) + src * a, alpha + dst alpha * (1 - a) */
+static void blend_float_row(float* dst, const float* src, int count) {
+	int i;
+#ifdef PIXMAP_SSE2
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	for(i = 0; i < count * 4; i += 4) {
+		__m128 s = _mm_loadu_ps(src + i);
+		__m128 a = _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3));
+		__m128 weight = _mm_or_ps(_mm_andnot_ps(alpha, a), _mm_and_ps(alpha, one));
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(s, weight), _mm_mul_ps(_mm_loadu_ps(dst + i), _mm_sub_ps(one, a))));
 	}
+#else
+	for(i = 0; i < count * 4; i += 4) {
+		float a = src[i + 3];
+		dst[i] = src[i] * a + dst[i] * (1 - a);
+		dst[i + 1] = src[i + 1] * a + dst[i + 1] * (1 - a);
+		dst[i + 2] = src[i + 2] * a + dst[i + 2] * (1 - a);
+		dst[i + 3] = a + dst[i + 3] * (1 - a);
+	}
+#endif
 }
 
+typedef void(*set_pixel_func)(unsigned char* pixel_addr, int color);
+typedef int(*get_pixel_func)(unsigned char* pixel_addr);
+
 static inline int to_format(int format, int color) {
 	int r, g, b, a, l;
 
@@ -66,6 +286,9 @@ static inline int to_format(int format, int color) {
 			b = (((color & 0xff00) >> 12) << 4) & 0xf0;
 			a = ((color & 0xff) >> 4) & 0xf;
 			return r | g | b | a;
+		case pixmap_FORMAT_RGBA32F:
+		case pixmap_FORMAT_RGBA16F:
+			return color;
 		default:
 			return 0;
 	}
@@ -86,8 +309,6 @@ static inline int weight_RGBA8888(int color, float weight) {
 static inline int to_RGBA8888(int format, int color) {
 	int r, g, b, a;
 
-	if(!lu5) generate_look_ups();
-
 	switch(format) {
 		case pixmap_FORMAT_ALPHA:
 			return (color & 0xff) | 0xffffff00;
@@ -108,6 +329,9 @@ static inline int to_RGBA8888(int format, int color) {
 			b = lu4[(color & 0xf0) >> 4] << 8;
 			a = lu4[(color & 0xf)];
 			return r | g | b | a;
+		case pixmap_FORMAT_RGBA32F:
+		case pixmap_FORMAT_RGBA16F:
+			return color;
 		default:
 			return 0;
 	}
@@ -136,11 +360,21 @@ static inline void set_pixel_RGBA8888(unsigned char *pixel_addr, int color) {
 }
 
 static inline void set_pixel_RGB565(unsigned char *pixel_addr, int color) {
-	*(int*)pixel_addr = (int)(color);
+	*(unsigned short*)pixel_addr = (unsigned short)(color);
 }
 
 static inline void set_pixel_RGBA4444(unsigned char *pixel_addr, int color) {
-	*(int*)pixel_addr = (int)(color);
+	*(unsigned short*)pixel_addr = (unsigned short)(color);
+}
+
+static inline void set_pixel_RGBA32F(unsigned char *pixel_addr, int color) {
+	color_to_float(color, (float*)pixel_addr);
+}
+
+static inline void set_pixel_RGBA16F(unsigned char *pixel_addr, int color) {
+	float rgba[4];
+	color_to_float(color, rgba);
+	float_to_half_row((unsigned short*)pixel_addr, rgba, 1);
 }
 
 static inline set_pixel_func set_pixel_func_ptr(int format) {
@@ -151,6 +385,8 @@ static inline set_pixel_func set_pixel_func_ptr(int format) {
 		case pixmap_FORMAT_RGBA8888:			return &set_pixel_RGBA8888;
 		case pixmap_FORMAT_RGB565:			return &set_pixel_RGB565;
 		case pixmap_FORMAT_RGBA4444:			return &set_pixel_RGBA4444;
+		case pixmap_FORMAT_RGBA32F:			return &set_pixel_RGBA32F;
+		case pixmap_FORMAT_RGBA16F:			return &set_pixel_RGBA16F;
 		default: return &set_pixel_alpha; // better idea for a default?
 	}
 }
@@ -190,11 +426,21 @@ static inline int get_pixel_RGBA8888(unsigned char *pixel_addr) {
 }
 
 static inline int get_pixel_RGB565(unsigned char *pixel_addr) {
-	return *(int*)pixel_addr;
+	return *(unsigned short*)pixel_addr;
 }
 
 static inline int get_pixel_RGBA4444(unsigned char *pixel_addr) {
-	return *(int*)pixel_addr;
+	return *(unsigned short*)pixel_addr;
+}
+
+static inline int get_pixel_RGBA32F(unsigned char *pixel_addr) {
+	return float_to_color((float*)pixel_addr);
+}
+
+static inline int get_pixel_RGBA16F(unsigned char *pixel_addr) {
+	float rgba[4];
+	half_to_float_row(rgba, (unsigned short*)pixel_addr, 1);
+	return float_to_color(rgba);
 }
 
 static inline get_pixel_func get_pixel_func_ptr(int format) {
@@ -205,45 +451,418 @@ static inline get_pixel_func get_pixel_func_ptr(int format) {
 		case pixmap_FORMAT_RGBA8888:			return &get_pixel_RGBA8888;
 		case pixmap_FORMAT_RGB565:			return &get_pixel_RGB565;
 		case pixmap_FORMAT_RGBA4444:			return &get_pixel_RGBA4444;
+		case pixmap_FORMAT_RGBA32F:			return &get_pixel_RGBA32F;
+		case pixmap_FORMAT_RGBA16F:			return &get_pixel_RGBA16F;
 		default: return &get_pixel_alpha; // better idea for a default?
 	}
 }
 
+/* count pixels from pixel 'index' on, as RGBA floats */
+static void read_floats(const Pixmap* pixmap, size_t index, int count, float* rgba) {
+	int bpp = pixmap_bytes_per_pixel(pixmap->format);
+	unsigned char* pixels = (unsigned char*)pixmap->pixels + index * bpp;
+	get_pixel_func pget;
+
+	switch(pixmap->format) {
+		case pixmap_FORMAT_RGBA32F:
+			memcpy(rgba, pixels, (size_t)count * 16);
+			break;
+		case pixmap_FORMAT_RGBA16F:
+			half_to_float_row(rgba, (unsigned short*)pixels, count);
+			break;
+		case pixmap_FORMAT_RGBA8888:
+			bytes_to_float_row(rgba, pixels, count);
+			break;
+		default:
+			pget = get_pixel_func_ptr(pixmap->format);
+			for(; count > 0; count--, pixels += bpp, rgba += 4)
+				color_to_float(to_RGBA8888(pixmap->format, pget(pixels)), rgba);
+			break;
+	}
+}
+
+static void write_floats(const Pixmap* pixmap, size_t index, int count, const float* rgba) {
+	int bpp = pixmap_bytes_per_pixel(pixmap->format);
+	unsigned char* pixels = (unsigned char*)pixmap->pixels + index * bpp;
+	set_pixel_func pset;
+
+	switch(pixmap->format) {
+		case pixmap_FORMAT_RGBA32F:
+			memcpy(pixels, rgba, (size_t)count * 16);
+			break;
+		case pixmap_FORMAT_RGBA16F:
+			float_to_half_row((unsigned short*)pixels, rgba, count);
+			break;
+		case pixmap_FORMAT_RGBA8888:
+			float_to_bytes_row(pixels, rgba, count);
+			break;
+		default:
+			pset = set_pixel_func_ptr(pixmap->format);
+			for(; count > 0; count--, pixels += bpp, rgba += 4)
+				pset(pixels, to_format(pixmap->format, float_to_color(rgba)));
+			break;
+	}
+}
+
+/* count pixels from 'index' on set to rgba, or blended with it */
+static void fill_floats(const Pixmap* pixmap, size_t index, size_t count, const float* rgba, int blending) {
+	float color[FLOAT_CHUNK * 4], row[FLOAT_CHUNK * 4];
+	int i, n;
+
+	if(!count) return;
+	if(!blending) {
+		/* one pixel converted, then copied over in doubling steps */
+		size_t bpp = pixmap_bytes_per_pixel(pixmap->format), done = 1;
+		unsigned char* pixels = (unsigned char*)pixmap->pixels + index * bpp;
+		write_floats(pixmap, index, 1, rgba);
+		for(; done < count; done *= 2)
+			memcpy(pixels + done * bpp, pixels, (done < count - done ? done : count - done) * bpp);
+		return;
+	}
+	n = count < FLOAT_CHUNK ? (int)count : FLOAT_CHUNK;
+	for(i = 0; i < n; i++)
+		memcpy(color + i * 4, rgba, sizeof(float) * 4);
+	for(; count > 0; index += n, count -= n) {
+		n = count < FLOAT_CHUNK ? (int)count : FLOAT_CHUNK;
+		read_floats(pixmap, index, n, row);
+		blend_float_row(row, color, n);
+		write_floats(pixmap, index, n, row);
+	}
+}
+
+/* stbi_loadf's RGBA floats as a pixmap, packed to halves in place for RGBA16F */
+static Pixmap* wrap_floats(float* rgba, int width, int height, int format) {
+	if(rgba == NULL)
+		return load_failed();
+	if(format == pixmap_FORMAT_RGBA16F) {
+		float* packed;
+		float_to_half_row((unsigned short*)rgba, rgba, width * height);
+		packed = (float*)realloc(rgba, (size_t)width * height * 8);
+		if(packed) rgba = packed;
+	}
+	return wrap_pixels((unsigned char*)rgba, width, height, format);
+}
+
 
 
 
 
 Pixmap* pixmap_loadmemory(const unsigned char *buffer, int len, int req_format) {
 	int width, height, format;
-	const unsigned char* pixels = SOIL_load_image_from_memory(buffer, len, &width, &height, &format, req_format);
+	const unsigned char* pixels;
+	if(is_float_format(req_format)) {
+		float* rgba = stbi_loadf_from_memory(buffer, len, &width, &height, &format, 4);
+		return wrap_floats(rgba, width, height, req_format);
+	}
+	pixels = SOIL_load_image_from_memory(buffer, len, &width, &height, &format, req_format);
 	if(pixels == NULL)
-		return NULL;
+		return load_failed();
 
-	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
-	pixmap->width = (int)width;
-	pixmap->height = (int)height;
-	pixmap->format = (int)format;
-	pixmap->pixels = pixels;
-	return pixmap;
+	return wrap_pixels(pixels, width, height, req_format ? req_format : format);
+}
+
+Pixmap* pixmap_loadmemory_typed(const unsigned char *buffer, int len, int req_format, int type) {
+	int width, height, format;
+	const unsigned char* pixels;
+	if(is_float_format(req_format)) {
+		float* rgba = stbi_loadf_typed_from_memory(buffer, len, type, &width, &height, &format, 4);
+		return wrap_floats(rgba, width, height, req_format);
+	}
+	pixels = stbi_load_typed_from_memory(buffer, len, type, &width, &height, &format, req_format);
+	if(pixels == NULL)
+		return load_failed();
+
+	return wrap_pixels(pixels, width, height, req_format ? req_format : format);
+}
+
+int pixmap_detect_type(const unsigned char *buffer, int len) {
+	return stbi_detect_type(buffer, len);
 }
 
 Pixmap* pixmap_load(const  char *buffer,   int req_format) {
 	int width, height, format;
-	const unsigned char* pixels =SOIL_load_image(buffer,  &width, &height, &format, req_format);
+	const unsigned char* pixels;
+	if(is_float_format(req_format)) {
+		float* rgba = stbi_loadf(buffer, &width, &height, &format, 4);
+		return wrap_floats(rgba, width, height, req_format);
+	}
+	pixels =SOIL_load_image(buffer,  &width, &height, &format, req_format);
 	if(pixels == NULL)
+		return load_failed();
+
+	//printf(" f%s w:%i  h:%i f:%i  \n",buffer,width,height,format);
+	return wrap_pixels(pixels, width, height, req_format ? req_format : format);
+}
+
+static int fill_info(PixmapInfo* info, int width, int height, int channels) {
+	info->width = width;
+	info->height = height;
+	info->channels = channels;
+	info->format = channels;
+	return 1;
+}
+
+int pixmap_info(const char *file, PixmapInfo* info) {
+	int width, height, channels;
+	if(!stbi_info(file, &width, &height, &channels))
+		return 0;
+	return fill_info(info, width, height, channels);
+}
+
+int pixmap_info_memory(const unsigned char *buffer, int len, PixmapInfo* info) {
+	int width, height, channels;
+	if(!stbi_info_from_memory(buffer, len, &width, &height, &channels))
+		return 0;
+	return fill_info(info, width, height, channels);
+}
+
+/* a pixmap from pixmap_load_lazy. its pixels never go in map, so a
+   pixmap with NULL pixels is always one of these; the functions that
+   touch pixels pin them and work through a copy of map that has them */
+typedef struct lazy_pixmap {
+	Pixmap map;
+	int req_format;
+	int type;
+	stbi_file file;			/* data is NULL when it's the caller's buffer */
+	const unsigned char* buffer;
+	int len;
+	unsigned char* pixels;	/* NULL until decoded, and again once evicted */
+	size_t bytes;
+	int pins;
+	int decoding;
+	int dirty;				/* drawn into, so decoding again would lose that */
+	struct lazy_pixmap* older;	/* the decoded ones, in the order they were used */
+	struct lazy_pixmap* newer;
+} lazy_pixmap;
+
+/* all under image_monitor_shared() */
+static lazy_pixmap* lazy_oldest = NULL;
+static lazy_pixmap* lazy_newest = NULL;
+static size_t lazy_budget = 0;
+static size_t lazy_bytes = 0;
+
+static void lazy_unlink(lazy_pixmap* lazy) {
+	if(lazy->older) lazy->older->newer = lazy->newer;
+	else lazy_oldest = lazy->newer;
+	if(lazy->newer) lazy->newer->older = lazy->older;
+	else lazy_newest = lazy->older;
+	lazy->older = lazy->newer = NULL;
+}
+
+static void lazy_link(lazy_pixmap* lazy) {
+	lazy->older = lazy_newest;
+	lazy->newer = NULL;
+	if(lazy_newest) lazy_newest->newer = lazy;
+	else lazy_oldest = lazy;
+	lazy_newest = lazy;
+}
 
+/* frees the least recently used pixels that nobody holds and that can
+   be decoded again until the rest fit the budget */
+static void lazy_evict(void) {
+	lazy_pixmap* lazy = lazy_oldest;
+	while(lazy_budget && lazy_bytes > lazy_budget && lazy) {
+		lazy_pixmap* newer = lazy->newer;
+		if(!lazy->pins && !lazy->dirty) {
+			lazy_unlink(lazy);
+			free(lazy->pixels);
+			lazy->pixels = NULL;
+			lazy_bytes -= lazy->bytes;
+		}
+		lazy = newer;
+	}
+}
+
+/* decodes the pixels the way pixmap_loadmemory would, format and all */
+static Pixmap* lazy_decode(const lazy_pixmap* lazy) {
+	const unsigned char* data = lazy->file.data ? lazy->file.data : lazy->buffer;
+	int len = lazy->file.data ? lazy->file.len : lazy->len;
+	Pixmap* decoded = pixmap_loadmemory_typed(data, len, lazy->req_format, lazy->type);
+	if(!decoded) return NULL;
+	if(decoded->width != lazy->map.width || decoded->height != lazy->map.height) {
+		pixmap_free(decoded);
+		set_failure(pixmap_ERROR_CORRUPT, "Image doesn't match its header");
 		return NULL;
+	}
+	return decoded;
+}
 
-	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
-	pixmap->width = width;
-	pixmap->height =height;
-	pixmap->format =format;
-	pixmap->pixels = pixels;
+/**
+ * points view at the lazy pixmap's pixels, decoding them first if
+ * they aren't, and keeps them until lazy_unpin. the decode runs
+ * outside the lock, other threads wanting the same pixmap wait for
+ * it. returns 0 if it failed.
+ */
+static int lazy_pin(Pixmap* view, const Pixmap* pixmap, int writing) {
+	lazy_pixmap* lazy = (lazy_pixmap*)pixmap;
+	image_monitor* monitor = image_monitor_shared();
+
+	image_monitor_lock(monitor);
+	while(lazy->decoding)
+		image_monitor_wait(monitor);
+	if(lazy->pixels) {
+		lazy_unlink(lazy);
+	} else {
+		Pixmap* decoded;
+		lazy->decoding = 1;
+		image_monitor_unlock(monitor);
+		decoded = lazy_decode(lazy);
+		image_monitor_lock(monitor);
+		lazy->decoding = 0;
+		image_monitor_wake_all(monitor);
+		if(!decoded) {
+			image_monitor_unlock(monitor);
+			return 0;
+		}
+		/* the header can only guess some formats, DDS drops to RGB
+		   when every pixel turns out opaque: the first decode decides */
+		if(decoded->format != lazy->map.format) {
+			lazy->map.format = decoded->format;
+			lazy->bytes = (size_t)decoded->width * decoded->height * pixmap_bytes_per_pixel(decoded->format);
+		}
+		lazy->pixels = (unsigned char*)decoded->pixels;
+		free(decoded);
+		lazy_bytes += lazy->bytes;
+	}
+	lazy_link(lazy);
+	lazy->pins++;
+	if(writing) lazy->dirty = 1;
+	lazy_evict();
+	*view = lazy->map;
+	view->pixels = lazy->pixels;
+	image_monitor_unlock(monitor);
+	return 1;
+}
 
-	//printf(" f%s w:%i  h:%i f:%i  \n",buffer,width,height,format);
+/**
+ * the single-pixel functions' shortcut: when the pixels are already
+ * decoded, points view at them and returns 1 with the lock held, for
+ * image_monitor_unlock after the one pixel, instead of pinning them.
+ * returns 0, unlocked, if they have to be decoded first.
+ */
+static int lazy_lock_resident(Pixmap* view, const Pixmap* pixmap, int writing) {
+	lazy_pixmap* lazy = (lazy_pixmap*)pixmap;
+	image_monitor_lock(image_monitor_shared());
+	if(!lazy->pixels) {
+		image_monitor_unlock(image_monitor_shared());
+		return 0;
+	}
+	lazy_unlink(lazy);
+	lazy_link(lazy);
+	if(writing) lazy->dirty = 1;
+	*view = lazy->map;
+	view->pixels = lazy->pixels;
+	return 1;
+}
+
+static void lazy_unpin(const Pixmap* pixmap) {
+	lazy_pixmap* lazy = (lazy_pixmap*)pixmap;
+	image_monitor* monitor = image_monitor_shared();
+	image_monitor_lock(monitor);
+	lazy->pins--;
+	lazy_evict();
+	image_monitor_unlock(monitor);
+}
+
+/* for the top of a void function: does call on a lazy pixmap's pinned
+   pixels, through view, and returns */
+#define LAZY_CALL(pixmap, writing, call) \
+	if(!(pixmap)->pixels) { \
+		Pixmap view; \
+		if(lazy_pin(&view, pixmap, writing)) { \
+			call; \
+			lazy_unpin(pixmap); \
+		} \
+		return; \
+	}
+
+/* LAZY_CALL for one pixel: one lock, no pin, when it's decoded */
+#define LAZY_PIXEL(pixmap, writing, call) \
+	if(!(pixmap)->pixels) { \
+		Pixmap view; \
+		if(lazy_lock_resident(&view, pixmap, writing)) { \
+			call; \
+			image_monitor_unlock(image_monitor_shared()); \
+		} else if(lazy_pin(&view, pixmap, writing)) { \
+			call; \
+			lazy_unpin(pixmap); \
+		} \
+		return; \
+	}
+
+static void lazy_free(lazy_pixmap* lazy) {
+	image_monitor* monitor = image_monitor_shared();
+	image_monitor_lock(monitor);
+	if(lazy->pixels) {
+		lazy_unlink(lazy);
+		free(lazy->pixels);
+		lazy_bytes -= lazy->bytes;
+	}
+	image_monitor_unlock(monitor);
+	if(lazy->file.data)
+		stbi_file_close(&lazy->file);
+	free(lazy);
+}
+
+static Pixmap* wrap_lazy(const unsigned char* buffer, int len, const stbi_file* file, int req_format) {
+	lazy_pixmap* lazy;
+	PixmapInfo info;
+	if(!pixmap_info_memory(buffer, len, &info))
+		return load_failed();
+	lazy = (lazy_pixmap*)calloc(1, sizeof(lazy_pixmap));
+	if(!lazy) {
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	lazy->map.width = info.width;
+	lazy->map.height = info.height;
+	lazy->map.format = req_format ? req_format : info.format;
+	lazy->req_format = req_format;
+	lazy->type = pixmap_detect_type(buffer, len);
+	lazy->buffer = buffer;
+	lazy->len = len;
+	if(file)
+		lazy->file = *file;
+	lazy->bytes = (size_t)info.width * info.height * pixmap_bytes_per_pixel(lazy->map.format);
+	set_failure(pixmap_ERROR_NONE, 0);
+	return &lazy->map;
+}
+
+Pixmap* pixmap_load_lazy(const char *file, int req_format) {
+	Pixmap* pixmap;
+	stbi_file contents;
+	if(!stbi_file_open(&contents, file))
+		return load_failed();
+	pixmap = wrap_lazy(contents.data, contents.len, &contents, req_format);
+	if(!pixmap)
+		stbi_file_close(&contents);
 	return pixmap;
 }
 
+Pixmap* pixmap_loadmemory_lazy(const unsigned char *buffer, int len, int req_format) {
+	return wrap_lazy(buffer, len, NULL, req_format);
+}
+
+const unsigned char* pixmap_lock_pixels(const Pixmap* pixmap) {
+	Pixmap view;
+	if(pixmap->pixels)
+		return pixmap->pixels;
+	return lazy_pin(&view, pixmap, 0) ? view.pixels : NULL;
+}
+
+void pixmap_unlock_pixels(const Pixmap* pixmap) {
+	if(!pixmap->pixels)
+		lazy_unpin(pixmap);
+}
+
+void pixmap_set_lazy_budget(size_t bytes) {
+	image_monitor* monitor = image_monitor_shared();
+	image_monitor_lock(monitor);
+	lazy_budget = bytes;
+	lazy_evict();
+	image_monitor_unlock(monitor);
+}
+
 void free_image_data
 	(
 		unsigned char *img_data
@@ -252,22 +871,267 @@ void free_image_data
 	free( (void*)img_data );
 }
 
+static int pixmap_save_channels(int format) {
+	switch(format) {
+		case pixmap_FORMAT_RGB565:
+			return 3;
+		case pixmap_FORMAT_RGBA4444:
+		case pixmap_FORMAT_RGBA32F:
+		case pixmap_FORMAT_RGBA16F:
+			return 4;
+		default:
+			return format;
+	}
+}
+
+static int pixmap_read_row(void* context, int y, unsigned char* row) {
+	const Pixmap* map = (const Pixmap*)context;
+	int x;
+
+	if(map->format == pixmap_FORMAT_RGB565 || map->format == pixmap_FORMAT_RGBA4444) {
+		const unsigned short* src = (const unsigned short*)(map->pixels + (size_t)y * map->width * 2);
+		for(x = 0; x < map->width; x++) {
+			int color = to_RGBA8888(map->format, src[x]);
+			*row++ = (unsigned char)(color >> 24);
+			*row++ = (unsigned char)(color >> 16);
+			*row++ = (unsigned char)(color >> 8);
+			if(map->format == pixmap_FORMAT_RGBA4444) *row++ = (unsigned char)color;
+		}
+	} else if(is_float_format(map->format)) {
+		float rgba[FLOAT_CHUNK * 4];
+		for(x = 0; x < map->width; x += FLOAT_CHUNK) {
+			int count = min(map->width - x, FLOAT_CHUNK);
+			read_floats(map, (size_t)y * map->width + x, count, rgba);
+			float_to_bytes_row(row + x * 4, rgba, count);
+		}
+	} else {
+		memcpy(row, map->pixels + (size_t)y * map->width * map->format, map->width * map->format);
+	}
+	return 1;
+}
+
+int pixmap_save_to_func(Pixmap* map, int format, const PixmapSaveOptions* options, pixmap_write_func func, void* context) {
+	SOIL_save_options soil_options = { -1, 0, 0 };
+	if(map && !map->pixels) {
+		Pixmap view;
+		int result;
+		if(!lazy_pin(&view, map, 0)) return 0;
+		result = pixmap_save_to_func(&view, format, options, func, context);
+		lazy_unpin(map);
+		return result;
+	}
+	if(!map || !func || map->width < 1 || map->height < 1 ||
+			map->format < pixmap_FORMAT_ALPHA || (map->format > pixmap_FORMAT_RGBA4444 && !is_float_format(map->format)))
+		return set_failure(pixmap_ERROR_INVALID_ARGUMENT, "Invalid pixmap");
+	if(format < SOIL_SAVE_TYPE_TGA || format > SOIL_SAVE_TYPE_PNG)
+		return set_failure(pixmap_ERROR_UNSUPPORTED, "Unknown save format");
+	if(options) {
+		soil_options.png_level = options->png_level;
+		soil_options.dds_mipmaps = options->dds_mipmaps;
+		soil_options.tga_rle = options->tga_rle;
+	}
+	/* with the arguments checked, the encoders can only run out of memory */
+	if(!SOIL_save_image_rows_to_func(func, context, format, map->width, map->height,
+			pixmap_save_channels(map->format), pixmap_read_row, map, &soil_options))
+		return set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+	return set_failure(pixmap_ERROR_NONE, 0);
+}
+
+static void file_write(void* context, void* data, int size) {
+	fwrite(data, 1, size, (FILE*)context);
+}
+
+int pixmap_save_with_options(Pixmap* map, const char* file, int format, const PixmapSaveOptions* options) {
+	int result;
+	FILE* f = fopen(file, "wb");
+	if(!f) return set_failure(pixmap_ERROR_IO, "Unable to open file");
+	result = pixmap_save_to_func(map, format, options, file_write, f);
+	if(ferror(f) | fclose(f))
+		return set_failure(pixmap_ERROR_IO, "Unable to write file");
+	return result;
+}
+
 int pixmap_save(Pixmap* map, const unsigned char *buffer,int format)
 {
-    return SOIL_save_image(buffer,format,map->width,map->height,map->format,map->pixels);
-
+    return pixmap_save_with_options(map, (const char*)buffer, format, 0);
+}
 
+typedef struct {
+	unsigned char* data;
+	int len;
+	int capacity;
+	int failed;
+} memory_sink;
+
+static void memory_sink_write(void* context, void* data, int size) {
+	memory_sink* sink = (memory_sink*)context;
+	if(sink->failed) return;
+	if(sink->len + size > sink->capacity) {
+		int capacity = sink->capacity ? sink->capacity : 4096;
+		unsigned char* grown;
+		while(sink->len + size > capacity) capacity *= 2;
+		grown = (unsigned char*)realloc(sink->data, capacity);
+		if(!grown) {
+			sink->failed = 1;
+			return;
+		}
+		sink->data = grown;
+		sink->capacity = capacity;
+	}
+	memcpy(sink->data + sink->len, data, size);
+	sink->len += size;
+}
 
+unsigned char* pixmap_save_to_memory(Pixmap* map, int format, const PixmapSaveOptions* options, int* len) {
+	memory_sink sink = { 0, 0, 0, 0 };
+	if(!pixmap_save_to_func(map, format, options, memory_sink_write, &sink) || sink.failed) {
+		if(sink.failed) set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		free(sink.data);
+		return 0;
+	}
+	*len = sink.len;
+	return sink.data;
 }
 float sqrtf(float v)
 {
 	return 0.0f;
 }
 
-Pixmap* pixmap_rescale(Pixmap* map,  int new_width,int new_height )
+/* where a dst column or row samples the source: i0, or i0 and i1 weighted f to 1 - f */
+typedef struct {
+	int i0, i1;
+	float f;
+} float_tap;
+
+/* dest pixel j from columns taps[j] of source rows a and b, fy the weight of b */
+static void lerp_float_row(float* dest, const float* a, const float* b, const float_tap* taps, int count, float fy) {
+	int j;
+#ifdef PIXMAP_SSE2
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 y1 = _mm_set1_ps(fy), y0 = _mm_sub_ps(one, y1);
+	for(j = 0; j < count; j++) {
+		__m128 x1 = _mm_set1_ps(taps[j].f), x0 = _mm_sub_ps(one, x1);
+		__m128 top = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + taps[j].i0 * 4), x0), _mm_mul_ps(_mm_loadu_ps(a + taps[j].i1 * 4), x1));
+		__m128 bottom = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(b + taps[j].i0 * 4), x0), _mm_mul_ps(_mm_loadu_ps(b + taps[j].i1 * 4), x1));
+		_mm_storeu_ps(dest + j * 4, _mm_add_ps(_mm_mul_ps(top, y0), _mm_mul_ps(bottom, y1)));
+	}
+#else
+	int k;
+	for(j = 0; j < count; j++) {
+		float x1 = taps[j].f, x0 = 1 - x1;
+		for(k = 0; k < 4; k++) {
+			float top = a[taps[j].i0 * 4 + k] * x0 + a[taps[j].i1 * 4 + k] * x1;
+			float bottom = b[taps[j].i0 * 4 + k] * x0 + b[taps[j].i1 * 4 + k] * x1;
+			dest[j * 4 + k] = top * (1 - fy) + bottom * fy;
+		}
+	}
+#endif
+}
+
+/**
+ * fills width x height pixels of dst from dst_x, dst_y on with
+ * the source pixels cols and rows point at, nearest taking i0
+ * alone. the source rows are converted to floats once each.
+ * returns 0 if it couldn't allocate its buffers.
+ */
+static int sample_floats(const Pixmap* src_pixmap, const Pixmap* dst_pixmap, int dst_x, int dst_y,
+		float_tap* cols, int width, const float_tap* rows, int height, int nearest, int blending) {
+	int first, span, i, j, loaded_a = -1, loaded_b = -1;
+	float *buffer, *a, *b, *out, *dst;
+
+	if(width <= 0 || height <= 0) return 1;
+	first = cols[0].i0;
+	span = cols[width - 1].i1 - first + 1;
+	buffer = (float*)malloc(((size_t)span * 2 + (size_t)width * 2) * 4 * sizeof(float));
+	if(!buffer) return 0;
+	a = buffer;
+	b = a + (size_t)span * 4;
+	out = b + (size_t)span * 4;
+	dst = out + (size_t)width * 4;
+	for(j = 0; j < width; j++) {
+		cols[j].i0 -= first;
+		cols[j].i1 -= first;
+	}
+
+	for(i = 0; i < height; i++) {
+		const float_tap* row = &rows[i];
+		size_t index = (size_t)(dst_y + i) * dst_pixmap->width + dst_x;
+		if(loaded_a != row->i0 && loaded_b == row->i0) {
+			float* swap = a;
+			a = b;
+			b = swap;
+			loaded_b = loaded_a;
+			loaded_a = row->i0;
+		}
+		if(loaded_a != row->i0) {
+			read_floats(src_pixmap, (size_t)row->i0 * src_pixmap->width + first, span, a);
+			loaded_a = row->i0;
+		}
+		if(nearest) {
+			for(j = 0; j < width; j++)
+				memcpy(out + j * 4, a + cols[j].i0 * 4, sizeof(float) * 4);
+		} else {
+			if(row->i1 != row->i0 && loaded_b != row->i1) {
+				read_floats(src_pixmap, (size_t)row->i1 * src_pixmap->width + first, span, b);
+				loaded_b = row->i1;
+			}
+			lerp_float_row(out, a, row->i1 != row->i0 ? b : a, cols, width, row->f);
+		}
+		if(blending) {
+			read_floats(dst_pixmap, index, width, dst);
+			blend_float_row(dst, out, width);
+			write_floats(dst_pixmap, index, width, dst);
+		} else {
+			write_floats(dst_pixmap, index, width, out);
+		}
+	}
+	free(buffer);
+	return 1;
+}
+
+/* up_scale_image's sampling, the corners landing on the corners */
+static void scale_taps(float_tap* taps, int size, int new_size) {
+	float step = new_size > 1 ? (size - 1.0f) / (new_size - 1.0f) : 0;
+	int i;
+	for(i = 0; i < new_size; i++) {
+		float sample = i * step;
+		int s = (int)sample;
+		if(s > size - 2) s = size - 2;
+		if(s < 0) s = 0;
+		taps[i].i0 = s;
+		taps[i].i1 = s + 1 < size ? s + 1 : s;
+		taps[i].f = sample - s;
+	}
+}
+
+static Pixmap* rescale_float(const Pixmap* map, int new_width, int new_height) {
+	Pixmap* pixmap;
+	float_tap* taps = (float_tap*)malloc(((size_t)new_width + new_height) * sizeof(float_tap));
+	if(!taps) {
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	pixmap = alloc_pixmap(new_width, new_height, map->format);
+	if(pixmap) {
+		scale_taps(taps, map->width, new_width);
+		scale_taps(taps + new_width, map->height, new_height);
+		if(!sample_floats(map, pixmap, 0, 0, taps, new_width, taps + new_width, new_height, 0, 0)) {
+			pixmap_free(pixmap);
+			pixmap = NULL;
+			set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		}
+	}
+	free(taps);
+	return pixmap;
+}
+
+static Pixmap* rescale(const Pixmap* map,  int new_width,int new_height )
 {
     int width, height, format;
 
+	if(is_float_format(map->format))
+		return rescale_float(map, new_width, new_height);
+
 	       const	unsigned char *resampled = (unsigned char*)malloc( map->format*new_width*new_height );
 			up_scale_image(map->pixels, map->width, map->height, map->format,resampled, new_width, new_height );
 
@@ -277,97 +1141,325 @@ Pixmap* pixmap_rescale(Pixmap* map,  int new_width,int new_height )
 	pixmap->height = new_height;
 	pixmap->format = map->format;
 	pixmap->pixels = resampled;
-	pixmap_free(map );
 	return pixmap;
 
 }
 
-Pixmap* pixmap_load_power_of2(const  char *buffer,   int req_format) {
+Pixmap* pixmap_rescale(Pixmap* map,  int new_width,int new_height )
+{
+	Pixmap view;
+	Pixmap* pixmap = NULL;
+	if(map->pixels) {
+		pixmap = rescale(map, new_width, new_height);
+	} else if(lazy_pin(&view, map, 0)) {
+		pixmap = rescale(&view, new_width, new_height);
+		lazy_unpin(map);
+	}
+	pixmap_free(map);
+	return pixmap;
+}
 
-	int width, height, format;
-	if(req_format > pixmap_FORMAT_RGBA8888)  req_format = pixmap_FORMAT_RGBA8888;
+/* a PixmapCompressed and the file its blocks live in, if any */
+typedef struct {
+	PixmapCompressed map;
+	stbi_file file;
+} compressed_pixmap;
+
+static PixmapCompressed* wrap_blocks(const unsigned char* buffer, int len, const stbi_file* file) {
+	compressed_pixmap* compressed;
+	int width, height, dxt, levels;
+	const unsigned char* blocks = stbi_dds_blocks_from_memory(buffer, len, &width, &height, &dxt, &levels);
+	if(blocks == NULL) {
+		load_failed();
+		return NULL;
+	}
+	compressed = (compressed_pixmap*)malloc(sizeof(compressed_pixmap));
+	if(!compressed) {
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	compressed->map.width = width;
+	compressed->map.height = height;
+	compressed->map.format = dxt == 1 ? pixmap_FORMAT_DXT1 : dxt == 3 ? pixmap_FORMAT_DXT3 : pixmap_FORMAT_DXT5;
+	compressed->map.levels = levels;
+	compressed->map.blocks = blocks;
+	if(file)
+		compressed->file = *file;
+	else
+		compressed->file.data = NULL;
+	set_failure(pixmap_ERROR_NONE, 0);
+	return &compressed->map;
+}
 
+PixmapCompressed* pixmap_load_compressed(const char *file) {
+	PixmapCompressed* map;
+	stbi_file contents;
+	if(!stbi_file_open(&contents, file)) {
+		load_failed();
+		return NULL;
+	}
+	map = wrap_blocks(contents.data, contents.len, &contents);
+	if(!map)
+		stbi_file_close(&contents);
+	return map;
+}
 
-	const unsigned char* pixels =SOIL_load_image(buffer,  &width, &height, &format, req_format);
-	if(pixels == NULL) return NULL;
+PixmapCompressed* pixmap_loadmemory_compressed(const unsigned char *buffer, int len) {
+	return wrap_blocks(buffer, len, NULL);
+}
 
+static int dxt_family(int format) {
+	switch(format) {
+		case pixmap_FORMAT_DXT1:	return 1;
+		case pixmap_FORMAT_DXT3:	return 3;
+		default:					return 5;
+	}
+}
 
+const unsigned char* pixmap_compressed_level(const PixmapCompressed* map, int level, int* width, int* height, int* size) {
+	const unsigned char* blocks = map->blocks;
+	int dxt = dxt_family(map->format);
+	int i, bytes;
+	if(level < 0 || level >= map->levels)
+		return NULL;
+	for(i = 0; i < level; i++)
+		blocks += stbi_dds_level_size(map->width, map->height, dxt, i, NULL, NULL);
+	bytes = stbi_dds_level_size(map->width, map->height, dxt, level, width, height);
+	if(size) *size = bytes;
+	return blocks;
+}
 
-	    int new_width = 1;
-		int new_height = 1;
-		while( new_width < width )
-		{
-			new_width *= 2;
-		}
-		while( new_height < height )
-		{
-			new_height *= 2;
-		}
+Pixmap* pixmap_decode_compressed_level(const PixmapCompressed* map, int level) {
+	int width, height;
+	unsigned char* pixels;
+	const unsigned char* blocks = pixmap_compressed_level(map, level, &width, &height, NULL);
+	if(!blocks) {
+		set_failure(pixmap_ERROR_INVALID_ARGUMENT, "No such mip level");
+		return NULL;
+	}
+	pixels = (unsigned char*)malloc((size_t)width * height * 4);
+	if(!pixels) {
+		set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+		return NULL;
+	}
+	stbi_dds_decode_blocks(blocks, width, height, dxt_family(map->format), pixels);
+	return wrap_pixels(pixels, width, height, pixmap_FORMAT_RGBA8888);
+}
 
-		if( (new_width != width) || (new_height != height) )
-		{
+void pixmap_free_compressed(const PixmapCompressed* map) {
+	compressed_pixmap* compressed = (compressed_pixmap*)map;
+	if(compressed->file.data)
+		stbi_file_close(&compressed->file);
+	free(compressed);
+}
 
-		const	unsigned char *resampled = (unsigned char*)malloc( format*new_width*new_height );
-			up_scale_image(pixels, width, height, format,resampled, new_width, new_height );
-			free_image_data( pixels );
-			pixels = resampled;
-			width = new_width;
-			height = new_height;
-			//printf("resample  w:%i h:%i c:%i \n",width,height,channels);
-		}
+typedef struct {
+	const PixmapBatchItem* item;
+	stbi_file file;		/* the file's contents, mapped where the system allows */
+	int opened;		/* 0 if the file couldn't be read */
+} batch_job;
+
+typedef struct {
+	image_queue* queue;
+	image_budget* budget;
+	pixmap_batch_func done;
+	void* context;
+	int loaded;
+} batch_worker;
+
+static void batch_decode(batch_worker* w, batch_job* job) {
+	const PixmapBatchItem* item = job->item;
+	const unsigned char* data = item->file ? (job->opened ? job->file.data : NULL) : item->buffer;
+	int len = item->file ? job->file.len : item->len;
+	const char* reason;
+	Pixmap* pixmap = NULL;
+	PixmapInfo info;
+	size_t bytes = 0;
+
+	if(data) {
+		/* the header tells how much the decode will allocate */
+		if(pixmap_info_memory(data, len, &info))
+			bytes = (size_t)info.width * info.height * pixmap_bytes_per_pixel(item->req_format ? item->req_format : info.format);
+		image_budget_acquire(w->budget, bytes);
+		pixmap = pixmap_loadmemory(data, len, item->req_format);
+		if(pixmap) w->loaded++;
+	} else {
+		set_failure(pixmap_ERROR_IO, "Unable to open file");
+	}
+	reason = pixmap_get_failure_reason();
+	if(job->opened) stbi_file_close(&job->file);
+	job->opened = 0;
+	w->done(item, pixmap, reason, w->context);
+	if(data) image_budget_release(w->budget, bytes);
+}
 
+static void batch_work(void* arg) {
+	batch_worker* w = (batch_worker*)arg;
+	batch_job* job;
+	while((job = (batch_job*)image_queue_pop(w->queue)) != NULL) {
+		batch_decode(w, job);
+		free(job);
+	}
+}
 
+int pixmap_load_batch(const PixmapBatchItem* items, int count, const PixmapBatchOptions* options, pixmap_batch_func done, void* context) {
+	int threads = options && options->threads > 0 ? options->threads : image_thread_count();
+	int depth = options && options->queue_depth > 0 ? options->queue_depth : 0;
+	batch_worker* workers;
+	batch_worker self;
+	image_worker** handles;
+	image_queue* queue;
+	image_budget* budget;
+	int i, started = 0, loaded;
+
+	if(count <= 0) return 0;
+	if(threads > count) threads = count;
+	if(!depth) depth = threads * 2;
+
+	workers = (batch_worker*)malloc(threads * sizeof(batch_worker));
+	handles = (image_worker**)malloc(threads * sizeof(image_worker*));
+	queue = image_queue_create(depth);
+	budget = image_budget_create(options ? options->memory_budget : 0);
+	if(!workers || !handles || !queue || !budget) {
+		free(workers);
+		free(handles);
+		image_queue_destroy(queue);
+		image_budget_destroy(budget);
+		return -1;
+	}
 
-	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
-	pixmap->width = width;
-	pixmap->height = height;
-	pixmap->format = format;
-	pixmap->pixels = pixels;
+	for(i = 0; i < threads; i++) {
+		workers[i].queue = queue;
+		workers[i].budget = budget;
+		workers[i].done = done;
+		workers[i].context = context;
+		workers[i].loaded = 0;
+		handles[started] = image_worker_start(batch_work, &workers[i]);
+		if(handles[started]) started++;
+	}
+	self = workers[0];
+
+	/* the calling thread only does the file I/O, unless there's no pool */
+	for(i = 0; i < count; i++) {
+		batch_job local;
+		batch_job* job = started ? (batch_job*)malloc(sizeof(batch_job)) : NULL;
+		memset(&local, 0, sizeof(local));
+		local.item = &items[i];
+		if(items[i].file) local.opened = stbi_file_open(&local.file, items[i].file);
+		if(job) {
+			*job = local;
+			if(image_queue_push(queue, job)) continue;
+			free(job);
+		}
+		batch_decode(&self, &local);
+	}
+	image_queue_close(queue);
+
+	for(i = 0; i < started; i++) image_worker_join(handles[i]);
+	loaded = self.loaded;
+	for(i = 0; i < threads; i++) loaded += workers[i].loaded;
+	free(workers);
+	free(handles);
+	image_queue_destroy(queue);
+	image_budget_destroy(budget);
+	return loaded;
+}
 
+static inline int is_power_of2(int n) {
+	return (n & (n - 1)) == 0;
+}
 
-	return pixmap;
+/**
+ * RGB565 and RGBA4444 can't be resampled, so when the image
+ * isn't a power of two already it's loaded as RGB888/RGBA8888
+ * and packed only once it has its final size.
+ */
+static int power_of2_load_format(const PixmapInfo* info, int req_format) {
+	if(req_format != pixmap_FORMAT_RGB565 && req_format != pixmap_FORMAT_RGBA4444)
+		return req_format;
+	if(info && is_power_of2(info->width) && is_power_of2(info->height))
+		return req_format;
+	return req_format == pixmap_FORMAT_RGB565 ? pixmap_FORMAT_RGB888 : pixmap_FORMAT_RGBA8888;
 }
 
-Pixmap* pixmap_loadmemory_power_of2(const unsigned char *buffer, int len, int req_format) {
-	int width, height, format;
-	// TODO fix this! Add conversion to requested format
-//	if(req_format > pixmap_FORMAT_RGBA8888)
-	//	req_format = pixmap_FORMAT_RGBA8888;
-	const unsigned char* pixels = SOIL_load_image_from_memory(buffer, len, &width, &height, &format, req_format);
-	if(pixels == NULL)
-		return NULL;
+static Pixmap* power_of2_pixmap(unsigned char* pixels, int width, int height, int format, int req_format) {
+	int new_width = 1;
+	int new_height = 1;
 
+	if(pixels == NULL) return load_failed();
 
+	while( new_width < width )
+	{
+		new_width *= 2;
+	}
+	while( new_height < height )
+	{
+		new_height *= 2;
+	}
 
-	    int new_width = 1;
-		int new_height = 1;
-		while( new_width < width )
-		{
-			new_width *= 2;
-		}
-		while( new_height < height )
-		{
-			new_height *= 2;
+	if( (new_width != width) || (new_height != height) )
+	{
+		unsigned char *resampled = (unsigned char*)malloc( format*new_width*new_height );
+		if(resampled == NULL) {
+			free_image_data( pixels );
+			set_failure(pixmap_ERROR_OUT_OF_MEMORY, "Out of memory");
+			return NULL;
 		}
+		up_scale_image(pixels, width, height, format,resampled, new_width, new_height );
+		free_image_data( pixels );
+		pixels = resampled;
+		width = new_width;
+		height = new_height;
+	}
 
-		if( (new_width != width) || (new_height != height) )
-		{
+	if(req_format && format != req_format) {
+		pixels = stbi_pack_image(pixels, width, height, format, req_format);
+		if(pixels == NULL) return load_failed();
+		format = req_format;
+	}
 
-		const	unsigned char *resampled = (unsigned char*)malloc( format*new_width*new_height );
-			up_scale_image(pixels, width, height, format,resampled, new_width, new_height );
-			free_image_data( pixels );
-			pixels = resampled;
-			width = new_width;
-			height = new_height;
-			//printf("resample  w:%i h:%i c:%i \n",width,height,channels);
-		}
+	return wrap_pixels(pixels, width, height, format);
+}
 
-	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
-	pixmap->width = width;
-	pixmap->height =height;
-	pixmap->format =format;
-	pixmap->pixels = pixels;
-	return pixmap;
+/* the float formats resample as they are, after loading */
+static Pixmap* power_of2_float(Pixmap* map) {
+	int new_width = 1;
+	int new_height = 1;
+
+	if(map == NULL) return NULL;
+	while(new_width < map->width) new_width *= 2;
+	while(new_height < map->height) new_height *= 2;
+	if(new_width == map->width && new_height == map->height)
+		return map;
+	return pixmap_rescale(map, new_width, new_height);
+}
+
+Pixmap* pixmap_load_power_of2(const  char *buffer,   int req_format) {
+	int width, height, format;
+	PixmapInfo info;
+	int load_format;
+	unsigned char* pixels;
+
+	if(is_float_format(req_format))
+		return power_of2_float(pixmap_load(buffer, req_format));
+	load_format = power_of2_load_format(pixmap_info(buffer, &info) ? &info : 0, req_format);
+	pixels =SOIL_load_image(buffer,  &width, &height, &format, load_format);
+	if(load_format) format = load_format;
+	return power_of2_pixmap(pixels, width, height, format, req_format);
+}
+
+Pixmap* pixmap_loadmemory_power_of2(const unsigned char *buffer, int len, int req_format) {
+	int width, height, format;
+	PixmapInfo info;
+	int load_format;
+	unsigned char* pixels;
+
+	if(is_float_format(req_format))
+		return power_of2_float(pixmap_loadmemory(buffer, len, req_format));
+	load_format = power_of2_load_format(pixmap_info_memory(buffer, len, &info) ? &info : 0, req_format);
+	pixels = SOIL_load_image_from_memory(buffer, len, &width, &height, &format, load_format);
+	if(load_format) format = load_format;
+	return power_of2_pixmap(pixels, width, height, format, req_format);
 }
 
 
@@ -383,20 +1475,53 @@ int pixmap_bytes_per_pixel(int format) {
 			return 3;
 		case pixmap_FORMAT_RGBA8888:
 			return 4;
+		case pixmap_FORMAT_RGBA32F:
+			return 16;
+		case pixmap_FORMAT_RGBA16F:
+			return 8;
 		default:
 			return 4;
 	}
 }
 
 Pixmap* pixmap_new(int width, int height, int format) {
-	Pixmap* pixmap = (Pixmap*)malloc(sizeof(Pixmap));
-	pixmap->width = width;
-	pixmap->height = height;
-	pixmap->format = format;
-	pixmap->pixels = (unsigned char*)malloc(width * height * pixmap_bytes_per_pixel(format));
-	return pixmap;
+	return alloc_pixmap(width, height, format);
 }
+Pixmap* pixmap_convert(const Pixmap* pixmap, int format) {
+	size_t index, count = (size_t)pixmap->width * pixmap->height;
+	float rgba[FLOAT_CHUNK * 4];
+	Pixmap* converted;
+
+	if(format < pixmap_FORMAT_ALPHA || (format > pixmap_FORMAT_RGBA4444 && !is_float_format(format))) {
+		set_failure(pixmap_ERROR_INVALID_ARGUMENT, "Invalid format");
+		return NULL;
+	}
+	if(!pixmap->pixels) {
+		Pixmap view;
+		if(!lazy_pin(&view, pixmap, 0)) return NULL;
+		converted = pixmap_convert(&view, format);
+		lazy_unpin(pixmap);
+		return converted;
+	}
+	converted = alloc_pixmap(pixmap->width, pixmap->height, format);
+	if(!converted) return NULL;
+	if(format == pixmap->format) {
+		memcpy((void*)converted->pixels, pixmap->pixels, count * pixmap_bytes_per_pixel(format));
+		return converted;
+	}
+	for(index = 0; index < count; index += FLOAT_CHUNK) {
+		int n = count - index < FLOAT_CHUNK ? (int)(count - index) : FLOAT_CHUNK;
+		read_floats(pixmap, index, n, rgba);
+		write_floats(converted, index, n, rgba);
+	}
+	return converted;
+}
+
 void pixmap_free(const Pixmap* pixmap) {
+	if(!pixmap->pixels) {
+		lazy_free((lazy_pixmap*)pixmap);
+		return;
+	}
 	free((void*)pixmap->pixels);
 	free((void*)pixmap);
 }
@@ -409,8 +1534,16 @@ void pixmap_set_scale (int scale) {
 	pixmap_scale = scale;
 }
 
+void pixmap_set_dither (int dither) {
+	stbi_set_dither(dither);
+}
+
 const char *pixmap_get_failure_reason(void) {
-  return stbi_failure_reason();
+  return failure_reason;
+}
+
+int pixmap_get_failure_code(void) {
+	return failure_code;
 }
 
 static inline void clear_alpha(const Pixmap* pixmap, int col) {
@@ -484,6 +1617,13 @@ static inline void clear_RGBA4444(const Pixmap* pixmap, int col) {
 }
 
 void pixmap_clear(const Pixmap* pixmap, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_clear(&view, col))
+	if(is_float_format(pixmap->format)) {
+		float rgba[4];
+		color_to_float(col, rgba);
+		fill_floats(pixmap, 0, (size_t)pixmap->width * pixmap->height, rgba, 0);
+		return;
+	}
 	col = to_format(pixmap->format, col);
 
 	switch(pixmap->format) {
@@ -526,6 +1666,18 @@ static inline void set_pixel(unsigned char* pixels, int width, int height, int b
 }
 
 int pixmap_get_pixel(const Pixmap* pixmap, int x, int y) {
+	if(!pixmap->pixels) {
+		Pixmap view;
+		int color = 0;
+		if(lazy_lock_resident(&view, pixmap, 0)) {
+			color = pixmap_get_pixel(&view, x, y);
+			image_monitor_unlock(image_monitor_shared());
+		} else if(lazy_pin(&view, pixmap, 0)) {
+			color = pixmap_get_pixel(&view, x, y);
+			lazy_unpin(pixmap);
+		}
+		return color;
+	}
 	if(!in_pixmap(pixmap, x, y))
 		return 0;
 	unsigned char* ptr = (unsigned char*)pixmap->pixels + (x + pixmap->width * y) * pixmap_bytes_per_pixel(pixmap->format);
@@ -533,6 +1685,7 @@ int pixmap_get_pixel(const Pixmap* pixmap, int x, int y) {
 }
 
 void pixmap_set_pixel(const Pixmap* pixmap, int x, int y, int col) {
+	LAZY_PIXEL(pixmap, 1, pixmap_set_pixel(&view, x, y, col))
 	if(pixmap_blend) {
 		int dst = pixmap_get_pixel(pixmap, x, y);
 		col = blend(col, dst);
@@ -545,6 +1698,7 @@ void pixmap_set_pixel(const Pixmap* pixmap, int x, int y, int col) {
 }
 
 void pixmap_draw_line(const Pixmap* pixmap, int x0, int y0, int x1, int y1, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_draw_line(&view, x0, y0, x1, y1, col))
     int dy = y1 - y0;
     int dx = x1 - x0;
 	int fraction = 0;
@@ -627,6 +1781,13 @@ static inline void hline(const Pixmap* pixmap, int x1, int x2, int y, int col) {
 	if(x2 >= (int)pixmap->width) x2 = pixmap->width - 1;
 	x2 += 1;
 
+	if(is_float_format(pixmap->format)) {
+		float rgba[4];
+		color_to_float(col, rgba);
+		fill_floats(pixmap, (size_t)y * pixmap->width + x1, x2 - x1, rgba, pixmap_blend);
+		return;
+	}
+
 	ptr += (x1 + y * pixmap->width) * bpp;
 
 	while(x1 != x2) {
@@ -676,6 +1837,7 @@ static inline void vline(const Pixmap* pixmap, int y1, int y2, int x, int col) {
 }
 
 void pixmap_draw_rect(const Pixmap* pixmap, int x, int y, int width, int height, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_draw_rect(&view, x, y, width, height, col))
 	hline(pixmap, x, x + width - 1, y, col);
 	hline(pixmap, x, x + width - 1, y + height - 1, col);
 	vline(pixmap, y, y + height - 1, x, col);
@@ -708,6 +1870,7 @@ static inline void circle_points(unsigned char* pixels, int width, int height, i
 }
 
 void pixmap_draw_circle(const Pixmap* pixmap, int x, int y, int radius, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_draw_circle(&view, x, y, radius, col))
     int px = 0;
     int py = radius;
     int p = (5 - (int)radius*4)/4;
@@ -732,6 +1895,7 @@ void pixmap_draw_circle(const Pixmap* pixmap, int x, int y, int radius, int col)
 }
 
 void pixmap_fill_rect(const Pixmap* pixmap, int x, int y, int width, int height, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_fill_rect(&view, x, y, width, height, col))
 	int x2 = x + width - 1;
 	int y2 = y + height - 1;
 
@@ -753,6 +1917,7 @@ void pixmap_fill_rect(const Pixmap* pixmap, int x, int y, int width, int height,
 }
 
 void pixmap_fill_circle(const Pixmap* pixmap, int x0, int y0, int radius, int col) {
+	LAZY_CALL(pixmap, 1, pixmap_fill_circle(&view, x0, y0, radius, col))
 	int f = 1 - (int)radius;
 	int ddF_x = 1;
 	int ddF_y = -2 * (int)radius;
@@ -962,12 +2127,152 @@ static inline void blit(const Pixmap* src_pixmap, const Pixmap* dst_pixmap,
 		blit_bilinear(src_pixmap, dst_pixmap, src_x, src_y, src_width, src_height, dst_x, dst_y, dst_width, dst_height);
 }
 
+/* blit_same_size through RGBA floats, a chunk of a row at a time */
+static void copy_floats(const Pixmap* src_pixmap, const Pixmap* dst_pixmap,
+						int src_x, int src_y,
+						int dst_x, int dst_y,
+						int width, int height) {
+	float rgba[FLOAT_CHUNK * 4], row[FLOAT_CHUNK * 4];
+	int x0 = -min(src_x, dst_x);
+	int y0 = -min(src_y, dst_y);
+	int i, j, n;
+
+	if(x0 < 0) x0 = 0;
+	if(y0 < 0) y0 = 0;
+	width = min(width, min(src_pixmap->width - src_x, dst_pixmap->width - dst_x));
+	height = min(height, min(src_pixmap->height - src_y, dst_pixmap->height - dst_y));
+
+	for(i = y0; i < height; i++) {
+		size_t from = (size_t)(src_y + i) * src_pixmap->width + src_x;
+		size_t to = (size_t)(dst_y + i) * dst_pixmap->width + dst_x;
+		for(j = x0; j < width; j += n) {
+			n = min(width - j, FLOAT_CHUNK);
+			read_floats(src_pixmap, from + j, n, rgba);
+			if(pixmap_blend) {
+				read_floats(dst_pixmap, to + j, n, row);
+				blend_float_row(row, rgba, n);
+				write_floats(dst_pixmap, to + j, n, row);
+			} else {
+				write_floats(dst_pixmap, to + j, n, rgba);
+			}
+		}
+	}
+}
+
+/**
+ * the source columns (or rows) blit_linear or blit_bilinear
+ * samples for dst, clipped the way they clip them. returns how
+ * many there are, the first of them going to dst *first.
+ */
+static int blit_taps(float_tap* taps, int src, int src_size, int src_limit,
+					 int dst, int dst_size, int dst_limit, int nearest, int* first) {
+	int ratio = (src_size << 16) / dst_size + 1;
+	float bilinear_ratio = ((float)src_size - 1) / dst_size;
+	int end = min(src + src_size, src_limit);
+	int i, count = 0;
+
+	for(i = 0; i < dst_size; i++) {
+		int s = nearest ? ((i * ratio) >> 16) + src : (int)(i * bilinear_ratio) + src;
+		int d = i + dst;
+		if(s < 0 || d < 0) {
+			if(count) break;
+			continue;
+		}
+		if(s >= src_limit || d >= dst_limit) break;
+		if(!count) *first = d;
+		taps[count].i0 = s;
+		taps[count].i1 = s + 1 < end ? s + 1 : s;
+		taps[count].f = nearest ? 0 : (bilinear_ratio * i + src) - s;
+		count++;
+	}
+	return count;
+}
+
+/* blit() for when either pixmap is a float one, with the same sampling */
+static void blit_float(const Pixmap* src_pixmap, const Pixmap* dst_pixmap,
+					   int src_x, int src_y, int src_width, int src_height,
+					   int dst_x, int dst_y, int dst_width, int dst_height) {
+	int nearest = pixmap_scale == pixmap_SCALE_NEAREST;
+	int cols, rows, first_x = 0, first_y = 0;
+	float_tap* taps;
+
+	if(!nearest && pixmap_scale != pixmap_SCALE_BILINEAR) return;
+	if(dst_width <= 0 || dst_height <= 0) return;
+	taps = (float_tap*)malloc(((size_t)dst_width + dst_height) * sizeof(float_tap));
+	if(!taps) return;
+	cols = blit_taps(taps, src_x, src_width, src_pixmap->width, dst_x, dst_width, dst_pixmap->width, nearest, &first_x);
+	rows = blit_taps(taps + cols, src_y, src_height, src_pixmap->height, dst_y, dst_height, dst_pixmap->height, nearest, &first_y);
+	sample_floats(src_pixmap, dst_pixmap, first_x, first_y, taps, cols, taps + cols, rows, nearest, pixmap_blend);
+	free(taps);
+}
+
 void pixmap_draw_pixmap(const Pixmap* src_pixmap, const Pixmap* dst_pixmap,
 					   int src_x, int src_y, int src_width, int src_height,
 					   int dst_x, int dst_y, int dst_width, int dst_height) {
+	if(!src_pixmap->pixels || !dst_pixmap->pixels) {
+		Pixmap src_view, dst_view;
+		if(!src_pixmap->pixels && !lazy_pin(&src_view, src_pixmap, 0))
+			return;
+		if(!dst_pixmap->pixels && !lazy_pin(&dst_view, dst_pixmap, 1)) {
+			if(!src_pixmap->pixels) lazy_unpin(src_pixmap);
+			return;
+		}
+		pixmap_draw_pixmap(src_pixmap->pixels ? src_pixmap : &src_view, dst_pixmap->pixels ? dst_pixmap : &dst_view,
+						   src_x, src_y, src_width, src_height, dst_x, dst_y, dst_width, dst_height);
+		if(!src_pixmap->pixels) lazy_unpin(src_pixmap);
+		if(!dst_pixmap->pixels) lazy_unpin(dst_pixmap);
+		return;
+	}
+	if(is_float_format(src_pixmap->format) || is_float_format(dst_pixmap->format)) {
+		if(src_width == dst_width && src_height == dst_height)
+			copy_floats(src_pixmap, dst_pixmap, src_x, src_y, dst_x, dst_y, src_width, src_height);
+		else
+			blit_float(src_pixmap, dst_pixmap, src_x, src_y, src_width, src_height, dst_x, dst_y, dst_width, dst_height);
+		return;
+	}
 	if(src_width == dst_width && src_height == dst_height) {
 		blit_same_size(src_pixmap, dst_pixmap, src_x, src_y, dst_x, dst_y, src_width, src_height);
 	} else {
 		blit(src_pixmap, dst_pixmap, src_x, src_y, src_width, src_height, dst_x, dst_y, dst_width, dst_height);
 	}
 }
+
+void pixmap_clear_float(const Pixmap* pixmap, const float* rgba) {
+	LAZY_CALL(pixmap, 1, pixmap_clear_float(&view, rgba))
+	fill_floats(pixmap, 0, (size_t)pixmap->width * pixmap->height, rgba, 0);
+}
+
+void pixmap_set_pixel_float(const Pixmap* pixmap, int x, int y, const float* rgba) {
+	LAZY_PIXEL(pixmap, 1, pixmap_set_pixel_float(&view, x, y, rgba))
+	if(!in_pixmap(pixmap, x, y))
+		return;
+	fill_floats(pixmap, (size_t)y * pixmap->width + x, 1, rgba, pixmap_blend);
+}
+
+void pixmap_get_pixel_float(const Pixmap* pixmap, int x, int y, float* rgba) {
+	LAZY_PIXEL(pixmap, 0, pixmap_get_pixel_float(&view, x, y, rgba))
+	if(!in_pixmap(pixmap, x, y)) {
+		rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+		return;
+	}
+	read_floats(pixmap, (size_t)y * pixmap->width + x, 1, rgba);
+}
+
+void pixmap_fill_rect_float(const Pixmap* pixmap, int x, int y, int width, int height, const float* rgba) {
+	LAZY_CALL(pixmap, 1, pixmap_fill_rect_float(&view, x, y, width, height, rgba))
+	int x2 = x + width - 1;
+	int y2 = y + height - 1;
+
+	if(x >= (int)pixmap->width) return;
+	if(y >= (int)pixmap->height) return;
+	if(x2 < 0) return;
+	if(y2 < 0) return;
+
+	if(x < 0) x = 0;
+	if(y < 0) y = 0;
+	if(x2 >= (int)pixmap->width) x2 = pixmap->width - 1;
+	if(y2 >= (int)pixmap->height) y2 = pixmap->height - 1;
+
+	for(; y <= y2; y++)
+		fill_floats(pixmap, (size_t)y * pixmap->width + x, x2 - x + 1, rgba, pixmap_blend);
+}
@@ -16,6 +16,8 @@
 
 
 
+#include <stddef.h>
+
 #define JNIEXPORT
 
 #ifdef __cplusplus
@@ -39,6 +41,25 @@ extern "C" {
 #define pixmap_FORMAT_RGB565				5
 #define pixmap_FORMAT_RGBA4444			6
 
+/**
+ * block compressed formats, 4x4 pixels per 8 byte (DXT1)
+ * or 16 byte block. only found in a PixmapCompressed.
+ */
+#define pixmap_FORMAT_DXT1				7
+#define pixmap_FORMAT_DXT3				8
+#define pixmap_FORMAT_DXT5				9
+
+/**
+ * float formats, RGBA as four 32-bit or four 16-bit (half)
+ * IEEE floats per pixel. values are linear and not clamped;
+ * the int color functions map 0-255 to 0-1 on them and clamp
+ * back. loading into them goes through stbi_loadf, so Radiance
+ * HDR files keep their range and 8-bit files are linearized as
+ * set by stbi_ldr_to_hdr_gamma/scale.
+ */
+#define pixmap_FORMAT_RGBA32F			10
+#define pixmap_FORMAT_RGBA16F			11
+
 /**
  * blending modes, to be extended
  */
@@ -51,6 +72,37 @@ extern "C" {
 #define pixmap_SCALE_NEAREST		0
 #define pixmap_SCALE_BILINEAR	1
 
+/**
+ * dithering used when loading straight into
+ * RGB565 or RGBA4444, see pixmap_set_dither
+ */
+#define pixmap_DITHER_NONE		0
+#define pixmap_DITHER_ORDERED	1
+#define pixmap_DITHER_DIFFUSION	2
+
+/**
+ * image file types, as found by pixmap_detect_type and
+ * taken as a hint by pixmap_loadmemory_typed
+ */
+#define pixmap_TYPE_UNKNOWN		0
+#define pixmap_TYPE_JPEG			1
+#define pixmap_TYPE_PNG			2
+#define pixmap_TYPE_BMP			3
+#define pixmap_TYPE_PSD			4
+#define pixmap_TYPE_DDS			5
+#define pixmap_TYPE_HDR			6
+#define pixmap_TYPE_TGA			7
+
+/**
+ * failure categories, see pixmap_get_failure_code
+ */
+#define pixmap_ERROR_NONE				0
+#define pixmap_ERROR_CORRUPT			1
+#define pixmap_ERROR_UNSUPPORTED		2
+#define pixmap_ERROR_OUT_OF_MEMORY		3
+#define pixmap_ERROR_IO					4
+#define pixmap_ERROR_INVALID_ARGUMENT	5
+
 /**
  * simple pixmap struct holding the pixel data,
  * the dimensions and the format of the pixmap.
@@ -63,21 +115,216 @@ typedef struct {
 	const unsigned char* pixels;
 } Pixmap;
 
+/**
+ * the blocks of a DXT1/3/5 DDS file exactly as stored, with
+ * all of its mip levels and nothing decoded. blocks points at
+ * level 0, the other levels follow it, see
+ * pixmap_compressed_level. format is one of the
+ * pixmap_FORMAT_DXTX constants.
+ */
+typedef struct {
+	int width;
+	int height;
+	int format;
+	int levels;
+	const unsigned char* blocks;
+} PixmapCompressed;
+
+/**
+ * dimensions and format of an image file as read from its
+ * header alone, without decoding or allocating any pixels.
+ * channels is the number of 8-bit components stored in the
+ * file and format the pixmap_FORMAT_XXX constant a
+ * pixmap_load with req_format 0 would produce.
+ */
+typedef struct {
+	int width;
+	int height;
+	int channels;
+	int format;
+} PixmapInfo;
+
+/**
+ * encoder settings for the pixmap_save functions, NULL
+ * meaning all defaults. png_level is the zlib level 0-9
+ * or -1 for the default, dds_mipmaps non-zero appends the
+ * full mipmap chain to DDS files, tga_rle non-zero writes
+ * run-length encoded TGAs.
+ */
+typedef struct {
+	int png_level;
+	int dds_mipmaps;
+	int tga_rle;
+} PixmapSaveOptions;
+
+/**
+ * receives an encoded image a piece at a time, in order.
+ */
+typedef void (*pixmap_write_func)(void* context, void* data, int size);
+
+/**
+ * one image for pixmap_load_batch: the file named by file, or
+ * if that is NULL the len bytes at buffer, which must stay
+ * valid until the item's callback. user is not touched.
+ */
+typedef struct {
+	const char* file;
+	const unsigned char* buffer;
+	int len;
+	int req_format;
+	void* user;
+} PixmapBatchItem;
+
+/**
+ * threads is the number of decoding threads, 0 for one per
+ * core. queue_depth is how many files may be read ahead of
+ * the decoders, 0 for twice the threads. memory_budget caps
+ * the bytes of decoded pixels in flight, from the start of a
+ * decode until its callback returns, 0 for no cap; a single
+ * image bigger than the cap is decoded on its own.
+ */
+typedef struct {
+	int threads;
+	int queue_depth;
+	size_t memory_budget;
+} PixmapBatchOptions;
+
+/**
+ * called once for every item, on one of the decoding threads
+ * and possibly several at once, with the pixmap, which the
+ * callee now owns, or with NULL and the reason it failed;
+ * pixmap_get_failure_code gives the category.
+ */
+typedef void (*pixmap_batch_func)(const PixmapBatchItem* item, Pixmap* pixmap, const char* failure_reason, void* context);
+
+JNIEXPORT int pixmap_info (const char *file, PixmapInfo* info);
+JNIEXPORT int pixmap_info_memory (const unsigned char *buffer, int len, PixmapInfo* info);
+
 JNIEXPORT Pixmap* pixmap_loadmemory (const unsigned char *buffer, int len, int req_format);
+/**
+ * pixmap_loadmemory for a buffer the caller knows to hold a
+ * pixmap_TYPE_XXX image, skipping format detection;
+ * pixmap_TYPE_UNKNOWN detects it as usual.
+ */
+JNIEXPORT Pixmap* pixmap_loadmemory_typed (const unsigned char *buffer, int len, int req_format, int type);
+/**
+ * the pixmap_TYPE_XXX of an image from its first bytes, 32 are
+ * enough. TGA has no signature, so that one is only a guess.
+ */
+JNIEXPORT int pixmap_detect_type (const unsigned char *buffer, int len);
 JNIEXPORT Pixmap* pixmap_load (const  char *buffer,  int req_format);
 JNIEXPORT Pixmap* pixmap_load_power_of2(const  char *buffer,   int req_format);
 JNIEXPORT Pixmap* pixmap_loadmemory_power_of2(const unsigned char *buffer, int len, int req_format) ;
+/**
+ * a DXT1/3/5 DDS without decoding it. from a file the blocks
+ * are in the mapped file where the system allows it, from
+ * memory they point into buffer, which has to outlive the
+ * result. other DDS variants fail as pixmap_ERROR_UNSUPPORTED,
+ * pixmap_load decodes those.
+ */
+JNIEXPORT PixmapCompressed* pixmap_load_compressed (const char *file);
+JNIEXPORT PixmapCompressed* pixmap_loadmemory_compressed (const unsigned char *buffer, int len);
+/**
+ * where mip level 'level' starts, its dimensions and its size
+ * in bytes, NULL if there is no such level.
+ */
+JNIEXPORT const unsigned char* pixmap_compressed_level (const PixmapCompressed* map, int level, int* width, int* height, int* size);
+/**
+ * decodes mip level 'level' into a new RGBA8888 pixmap, NULL if
+ * there is no such level or it couldn't be allocated.
+ */
+JNIEXPORT Pixmap* pixmap_decode_compressed_level (const PixmapCompressed* map, int level);
+JNIEXPORT void pixmap_free_compressed (const PixmapCompressed* map);
+/**
+ * reads the files on the calling thread and decodes them on a
+ * pool of threads, see PixmapBatchOptions. returns once every
+ * callback has returned, with the number of pixmaps loaded, or
+ * -1 without making any callbacks if the pool couldn't be set
+ * up. options may be NULL for the defaults.
+ */
+JNIEXPORT int pixmap_load_batch(const PixmapBatchItem* items, int count, const PixmapBatchOptions* options, pixmap_batch_func done, void* context);
+/**
+ * a pixmap whose pixels are only decoded when something first
+ * needs them. width, height and format come from the header at
+ * once; the file stays mapped, or buffer, which then has to
+ * outlive the pixmap, is kept. every pixmap function decodes it
+ * when it has to, from any thread, and pixels stays NULL, so
+ * code reading the pixels itself goes through
+ * pixmap_lock_pixels. NULL if the header couldn't be read.
+ * without req_format, format is the header's guess until the
+ * first decode sets it to what pixmap_load gives; only DDS,
+ * whose alpha the header can't tell, ever changes.
+ */
+JNIEXPORT Pixmap* pixmap_load_lazy (const char *file, int req_format);
+JNIEXPORT Pixmap* pixmap_loadmemory_lazy (const unsigned char *buffer, int len, int req_format);
+/**
+ * the pixels of any pixmap, a lazy one decoded if it isn't and
+ * then kept until pixmap_unlock_pixels. NULL if the decode
+ * failed. changes made through the pointer can be lost when a
+ * lazy pixmap is evicted, the drawing functions' can't. this is
+ * also how to loop over pixels, see pixmap_get_pixel.
+ */
+JNIEXPORT const unsigned char* pixmap_lock_pixels (const Pixmap* pixmap);
+JNIEXPORT void pixmap_unlock_pixels (const Pixmap* pixmap);
+/**
+ * caps the bytes of pixels lazy pixmaps hold decoded, 0 (the
+ * default) for no cap. over it, the least recently used ones
+ * that aren't locked or drawn into are freed, to be decoded
+ * again when next needed.
+ */
+JNIEXPORT void pixmap_set_lazy_budget (size_t bytes);
 JNIEXPORT Pixmap* pixmap_new  (int width, int height, int format);
 JNIEXPORT void 	  pixmap_free (const Pixmap* pixmap);
 
+/**
+ * the save functions take one of the SOIL_SAVE_TYPE_XXX
+ * constants as format and work for every pixmap format;
+ * RGB565 and RGBA4444 are widened to 8 bits a row at a
+ * time as they are encoded, the float formats clamped to
+ * 0-1 and written as RGBA8888. they return 0 on failure.
+ */
 JNIEXPORT int pixmap_save(Pixmap* map, const unsigned char *buffer,int format);
+JNIEXPORT int pixmap_save_with_options(Pixmap* map, const char* file, int format, const PixmapSaveOptions* options);
+JNIEXPORT int pixmap_save_to_func(Pixmap* map, int format, const PixmapSaveOptions* options, pixmap_write_func func, void* context);
+/**
+ * encodes into a malloc'd buffer, which the caller frees.
+ * returns NULL on failure, otherwise stores the size in len.
+ */
+JNIEXPORT unsigned char* pixmap_save_to_memory(Pixmap* map, int format, const PixmapSaveOptions* options, int* len);
 JNIEXPORT Pixmap* pixmap_rescale(Pixmap* map,  int new_width,int new_height );
+/**
+ * a copy of pixmap in another pixmap_FORMAT_XXX, NULL if it
+ * couldn't be allocated. goes through RGBA floats, so 8-bit
+ * formats convert to and from the float ones without steps.
+ */
+JNIEXPORT Pixmap* pixmap_convert(const Pixmap* pixmap, int format);
 
 JNIEXPORT void pixmap_set_blend	  (int blend);
 JNIEXPORT void pixmap_set_scale	  (int scale);
+/**
+ * the loaders decode RGB565 and RGBA4444 req_formats
+ * straight into 16-bit pixels; this picks how they are
+ * quantized, one of the pixmap_DITHER_XXX constants.
+ */
+JNIEXPORT void pixmap_set_dither  (int dither);
 
+/**
+ * what went wrong in the last load or save on the calling
+ * thread, pixmap_ERROR_NONE and NULL if it succeeded. batch
+ * callbacks run on the thread that decoded their item, so
+ * these describe that item there.
+ */
 JNIEXPORT const char*   pixmap_get_failure_reason(void);
+JNIEXPORT int			pixmap_get_failure_code(void);
 JNIEXPORT void		pixmap_clear	   	  (const Pixmap* pixmap, int col);
+/**
+ * on a lazy pixmap, pixmap_set_pixel and pixmap_get_pixel, and
+ * their float versions, take the lock all lazy pixmaps share for
+ * every pixel, and decode first if they must. loops reading many
+ * pixels should lock them once instead: after pixmap_lock_pixels,
+ * copy the pixmap, point the copy's pixels at what it returned
+ * and read through the copy until pixmap_unlock_pixels.
+ */
 JNIEXPORT void		pixmap_set_pixel   (const Pixmap* pixmap, int x, int y, int col);
 JNIEXPORT int       pixmap_get_pixel	  (const Pixmap* pixmap, int x, int y);
 JNIEXPORT void		pixmap_draw_line   (const Pixmap* pixmap, int x, int y, int x2, int y2, int col);
@@ -89,6 +336,15 @@ JNIEXPORT void		pixmap_draw_pixmap (const Pixmap* src_pixmap,
 								   const Pixmap* dst_pixmap,
 								   int src_x, int src_y, int src_width, int src_height,
 								   int dst_x, int dst_y, int dst_width, int dst_height);
+/**
+ * the color as four floats, r, g, b and a, for HDR values the
+ * int colors can't hold. they work on every format, clamping
+ * to 0-1 for the 8-bit ones, and blend like the int versions.
+ */
+JNIEXPORT void		pixmap_clear_float	   (const Pixmap* pixmap, const float* rgba);
+JNIEXPORT void		pixmap_set_pixel_float (const Pixmap* pixmap, int x, int y, const float* rgba);
+JNIEXPORT void		pixmap_get_pixel_float (const Pixmap* pixmap, int x, int y, float* rgba);
+JNIEXPORT void		pixmap_fill_rect_float (const Pixmap* pixmap, int x, int y, int width, int height, const float* rgba);
 
 JNIEXPORT int pixmap_bytes_per_pixel(int format);
 
@@ -8,6 +8,7 @@
 */
 
 #include "image_DXT.h"
+#include "image_helper.h"
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +39,102 @@ void compress_DDS_alpha_block(
 				const unsigned char *const uncompressed,
 				unsigned char compressed[8] );
 
+/*
+	Compresses one strip of 1 to 4 rows into a row of DXT1 blocks
+	(no alpha) or DXT5 blocks (alpha), exactly the way
+	convert_image_to_DXT1 / convert_image_to_DXT5 would.
+	Returns the number of bytes written.
+*/
+static int
+	compress_DDS_strip
+	(
+		const unsigned char *const strip,
+		int width, int rows, int channels,
+		unsigned char *compressed
+	)
+{
+	unsigned char ublock[16*4];
+	int i, x, y, k, index = 0;
+	/*	for channels == 1 or 2, I do not step forward for R,G,B values	*/
+	int chan_step = (channels < 3) ? 0 : 1;
+	/*	# channels = 1 or 3 have no alpha, 2 & 4 do have alpha	*/
+	int has_alpha = 1 - (channels & 1);
+	int block_channels = 3 + has_alpha;
+	for( i = 0; i < width; i += 4 )
+	{
+		int idx = 0;
+		int mx = 4;
+		if( i+4 >= width )
+		{
+			mx = width - i;
+		}
+		for( y = 0; y < rows; ++y )
+		{
+			for( x = 0; x < mx; ++x )
+			{
+				const unsigned char *p = strip + (y*width+i+x)*channels;
+				ublock[idx++] = p[0];
+				ublock[idx++] = p[chan_step];
+				ublock[idx++] = p[chan_step+chan_step];
+				if( has_alpha )
+				{
+					ublock[idx++] = p[channels-1];
+				}
+			}
+			for( x = mx; x < 4; ++x )
+			{
+				for( k = 0; k < block_channels; ++k )
+				{
+					ublock[idx++] = ublock[k];
+				}
+			}
+		}
+		for( y = rows; y < 4; ++y )
+		{
+			for( x = 0; x < 4; ++x )
+			{
+				for( k = 0; k < block_channels; ++k )
+				{
+					ublock[idx++] = ublock[k];
+				}
+			}
+		}
+		if( has_alpha )
+		{
+			compress_DDS_alpha_block( ublock, compressed + index );
+			compress_DDS_color_block( 4, ublock, compressed + index + 8 );
+			index += 16;
+		} else
+		{
+			compress_DDS_color_block( 3, ublock, compressed + index );
+			index += 8;
+		}
+	}
+	return index;
+}
+
+int
+	DDS_read_memory_row
+	(
+		void *context,
+		int y, unsigned char *row
+	)
+{
+	DDS_memory_rows *m = (DDS_memory_rows *)context;
+	memcpy( row, m->data + (size_t)y * m->row_bytes, m->row_bytes );
+	return 1;
+}
+
+static void
+	write_to_file
+	(
+		void *context,
+		void *data, int size
+	)
+{
+	fwrite( data, 1, size, (FILE *)context );
+}
+
 /********* Actual Exposed Functions *********/
 int
 	save_image_as_DDS
@@ -49,9 +146,8 @@ int
 {
 	/*	variables	*/
 	FILE *fout;
-	unsigned char *DDS_data;
-	DDS_header header;
-	int DDS_size;
+	DDS_memory_rows rows;
+	int result;
 	/*	error check	*/
 	if( (NULL == filename) ||
 		(width < 1) || (height < 1) ||
@@ -60,24 +156,84 @@ int
 	{
 		return 0;
 	}
-	/*	Convert the image	*/
-	if( (channels & 1) == 1 )
+	fout = fopen( filename, "wb");
+	if( NULL == fout )
 	{
-		/*	no alpha, just use DXT1	*/
-		DDS_data = convert_image_to_DXT1( data, width, height, channels, &DDS_size );
-	} else
+		return 0;
+	}
+	/*	convert and write it a strip at a time	*/
+	rows.data = data;
+	rows.row_bytes = width * channels;
+	result = save_image_as_DDS_to_func( write_to_file, fout,
+			width, height, channels, DDS_read_memory_row, &rows, 0 );
+	if( ferror( fout ) )
+	{
+		result = 0;
+	}
+	if( fclose( fout ) )
+	{
+		result = 0;
+	}
+	/*	done	*/
+	return result;
+}
+
+int
+	save_image_as_DDS_to_func
+	(
+		DDS_write_func write, void *context,
+		int width, int height, int channels,
+		DDS_row_func get_row, void *row_context,
+		int mipmaps
+	)
+{
+	/*	variables	*/
+	DDS_header header;
+	unsigned char *strip, *compressed, *mip = NULL;
+	int block_size, levels = 1, level, mip_width, mip_height, w, h, j, y;
+	int ok = 1;
+	/*	error check	*/
+	if( (NULL == write) || (NULL == get_row) ||
+		(width < 1) || (height < 1) ||
+		(channels < 1) || (channels > 4) )
+	{
+		return 0;
+	}
+	/*	no alpha, just use DXT1; has alpha, so use DXT5	*/
+	block_size = ((channels & 1) == 1) ? 8 : 16;
+	mip_width = (width > 1) ? width / 2 : 1;
+	mip_height = (height > 1) ? height / 2 : 1;
+	if( mipmaps )
+	{
+		/*	halve until 1x1, like mipmap_image does	*/
+		for( w = width, h = height; (w > 1) || (h > 1); ++levels )
+		{
+			w = (w > 1) ? w / 2 : 1;
+			h = (h > 1) ? h / 2 : 1;
+		}
+	}
+	/*	4 rows in, one row of blocks out, and the first MIPmap	*/
+	strip = (unsigned char*)malloc( 4 * width * channels );
+	compressed = (unsigned char*)malloc( ((width+3) >> 2) * block_size );
+	if( levels > 1 )
+	{
+		mip = (unsigned char*)malloc( mip_width * mip_height * channels );
+	}
+	if( (NULL == strip) || (NULL == compressed) || ((levels > 1) && (NULL == mip)) )
 	{
-		/*	has alpha, so use DXT5	*/
-		DDS_data = convert_image_to_DXT5( data, width, height, channels, &DDS_size );
+		free( strip );
+		free( compressed );
+		free( mip );
+		return 0;
 	}
-	/*	save it	*/
+	/*	the header	*/
 	memset( &header, 0, sizeof( DDS_header ) );
 	header.dwMagic = ('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24);
 	header.dwSize = 124;
 	header.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_LINEARSIZE;
 	header.dwWidth = width;
 	header.dwHeight = height;
-	header.dwPitchOrLinearSize = DDS_size;
+	header.dwPitchOrLinearSize = ((width+3) >> 2) * ((height+3) >> 2) * block_size;
 	header.sPixelFormat.dwSize = 32;
 	header.sPixelFormat.dwFlags = DDPF_FOURCC;
 	if( (channels & 1) == 1 )
@@ -88,14 +244,58 @@ int
 		header.sPixelFormat.dwFourCC = ('D' << 0) | ('X' << 8) | ('T' << 16) | ('5' << 24);
 	}
 	header.sCaps.dwCaps1 = DDSCAPS_TEXTURE;
-	/*	write it out	*/
-	fout = fopen( filename, "wb");
-	fwrite( &header, sizeof( DDS_header ), 1, fout );
-	fwrite( DDS_data, 1, DDS_size, fout );
-	fclose( fout );
+	if( levels > 1 )
+	{
+		header.dwFlags |= DDSD_MIPMAPCOUNT;
+		header.dwMipMapCount = levels;
+		header.sCaps.dwCaps1 |= DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+	}
+	write( context, &header, sizeof( DDS_header ) );
+	/*	the image itself, a strip of 4 rows at a time	*/
+	for( j = 0; j < height; j += 4 )
+	{
+		int rows = (height - j < 4) ? height - j : 4;
+		for( y = 0; (y < rows) && ok; ++y )
+		{
+			ok = get_row( row_context, j + y, strip + y * width * channels );
+		}
+		if( !ok )
+		{
+			break;
+		}
+		write( context, compressed,
+			compress_DDS_strip( strip, width, rows, channels, compressed ) );
+		/*	each strip makes 2 rows of the first MIPmap (1 for a last odd
+			row, which the halving drops unless it is the only row)	*/
+		if( (NULL != mip) && ((rows > 1) || (height == 1)) )
+		{
+			mipmap_image( strip, width, rows, channels,
+				mip + (j / 2) * mip_width * channels, 2, 2 );
+		}
+	}
+	/*	then the rest of the chain, each level halved in place	*/
+	w = mip_width;
+	h = mip_height;
+	for( level = 1; (level < levels) && ok; ++level )
+	{
+		for( j = 0; j < h; j += 4 )
+		{
+			int rows = (h - j < 4) ? h - j : 4;
+			write( context, compressed,
+				compress_DDS_strip( mip + j * w * channels, w, rows, channels, compressed ) );
+		}
+		if( level + 1 < levels )
+		{
+			mipmap_image( mip, w, h, channels, mip, 2, 2 );
+			w = (w > 1) ? w / 2 : 1;
+			h = (h > 1) ? h / 2 : 1;
+		}
+	}
 	/*	done	*/
-	free( DDS_data );
-	return 1;
+	free( strip );
+	free( compressed );
+	free( mip );
+	return ok;
 }
 
 unsigned char* convert_image_to_DXT1(
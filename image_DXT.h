@@ -23,6 +23,51 @@ save_image_as_DDS
     const unsigned char *const data
 );
 
+/**
+	Reads row y of an image into row (width * channels bytes).
+	\return 0 to abandon the save, otherwise 1
+**/
+typedef int (*DDS_row_func)( void *context, int y, unsigned char *row );
+
+/**
+	A DDS_row_func (or SOIL_row_func) for an image already in memory:
+	pass a DDS_memory_rows as the context.
+**/
+typedef struct
+{
+    const unsigned char *data;
+    int row_bytes;
+} DDS_memory_rows;
+
+int
+DDS_read_memory_row
+(
+    void *context,
+    int y, unsigned char *row
+);
+
+/**
+	Receives a DDS file a piece at a time, in order.
+**/
+typedef void (*DDS_write_func)( void *context, void *data, int size );
+
+/**
+	Like save_image_as_DDS, but the rows come from get_row four at a
+	time, and each row of 4x4 blocks goes to write as soon as it has
+	been compressed.  If mipmaps is non-zero the full MIPmap chain,
+	down to 1x1, follows the image; building it keeps a quarter size
+	copy of the image, never the whole thing.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+save_image_as_DDS_to_func
+(
+    DDS_write_func write, void *context,
+    int width, int height, int channels,
+    DDS_row_func get_row, void *row_context,
+    int mipmaps
+);
+
 /**
 	take an image and convert it to DXT1 (no alpha)
 **/
@@ -0,0 +1,44 @@
+/*
+	CRC-32 and Adler-32 checksums shared by the PNG reader and writer,
+	with table-sliced and SIMD paths picked to suit the machine
+
+	public domain
+*/
+
+#ifndef HEADER_IMAGE_CHECKSUM
+#define HEADER_IMAGE_CHECKSUM
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+	Continues the CRC-32 (as used by PNG and gzip) of a stream with the
+	next len bytes of it.  Start a new stream with crc = 0; feeding a
+	stream in pieces gives the same result as feeding it all at once.
+**/
+unsigned int
+	image_crc32
+	(
+		unsigned int crc,
+		const unsigned char *data, size_t len
+	);
+
+/**
+	Continues the Adler-32 (as used by zlib) of a stream with the next
+	len bytes of it.  Start a new stream with adler = 1.
+**/
+unsigned int
+	image_adler32
+	(
+		unsigned int adler,
+		const unsigned char *data, size_t len
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_CHECKSUM	*/
@@ -0,0 +1,607 @@
+/*
+	minimal thread helpers
+
+	public domain
+*/
+
+#include "image_thread.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*	never start more threads than this, whatever the machine says	*/
+#define IMAGE_MAX_THREADS 64
+
+typedef struct
+{
+	image_job_func func;
+	unsigned char *jobs;
+	int job_size, num_jobs;
+	int next;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+} image_batch;
+
+/*	hand out the next unclaimed job index	*/
+static int
+	claim_job
+	(
+		image_batch *b
+	)
+{
+	int i;
+#ifdef _WIN32
+	EnterCriticalSection( &b->lock );
+	i = b->next++;
+	LeaveCriticalSection( &b->lock );
+#else
+	pthread_mutex_lock( &b->lock );
+	i = b->next++;
+	pthread_mutex_unlock( &b->lock );
+#endif
+	return i;
+}
+
+static void
+	run_jobs
+	(
+		image_batch *b
+	)
+{
+	int i;
+	while( (i = claim_job( b )) < b->num_jobs )
+	{
+		b->func( b->jobs + (size_t)i * b->job_size );
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+	worker
+	(
+		LPVOID arg
+	)
+{
+	run_jobs( (image_batch *)arg );
+	return 0;
+}
+#else
+static void *
+	worker
+	(
+		void *arg
+	)
+{
+	run_jobs( (image_batch *)arg );
+	return NULL;
+}
+#endif
+
+int
+	image_thread_count
+	(
+		void
+	)
+{
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	n = (int)info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+	if( n < 1 )
+	{
+		n = 1;
+	}
+	if( n > IMAGE_MAX_THREADS )
+	{
+		n = IMAGE_MAX_THREADS;
+	}
+	return n;
+}
+
+void
+	image_thread_run
+	(
+		image_job_func func,
+		void *jobs, int job_size, int num_jobs
+	)
+{
+	image_batch b;
+	int i, n, started = 0;
+#ifdef _WIN32
+	HANDLE threads[IMAGE_MAX_THREADS];
+#else
+	pthread_t threads[IMAGE_MAX_THREADS];
+#endif
+	if( num_jobs < 1 )
+	{
+		return;
+	}
+	b.func = func;
+	b.jobs = (unsigned char *)jobs;
+	b.job_size = job_size;
+	b.num_jobs = num_jobs;
+	b.next = 0;
+	/*	the calling thread works too, so start one fewer	*/
+	n = image_thread_count();
+	if( n > num_jobs )
+	{
+		n = num_jobs;
+	}
+#ifdef _WIN32
+	InitializeCriticalSection( &b.lock );
+	for( i = 0; i < n - 1; ++i )
+	{
+		threads[started] = CreateThread( NULL, 0, worker, &b, 0, NULL );
+		if( threads[started] != NULL )
+		{
+			++started;
+		}
+	}
+	run_jobs( &b );
+	if( started > 0 )
+	{
+		WaitForMultipleObjects( started, threads, TRUE, INFINITE );
+	}
+	for( i = 0; i < started; ++i )
+	{
+		CloseHandle( threads[i] );
+	}
+	DeleteCriticalSection( &b.lock );
+#else
+	pthread_mutex_init( &b.lock, NULL );
+	for( i = 0; i < n - 1; ++i )
+	{
+		if( pthread_create( &threads[started], NULL, worker, &b ) == 0 )
+		{
+			++started;
+		}
+	}
+	run_jobs( &b );
+	for( i = 0; i < started; ++i )
+	{
+		pthread_join( threads[i], NULL );
+	}
+	pthread_mutex_destroy( &b.lock );
+#endif
+}
+
+/*	the lock and condition variable the queue and budget are built on	*/
+struct image_monitor
+{
+#ifdef _WIN32
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE cond;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+static void
+	monitor_init
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	InitializeCriticalSection( &m->mutex );
+	InitializeConditionVariable( &m->cond );
+#else
+	pthread_mutex_init( &m->mutex, NULL );
+	pthread_cond_init( &m->cond, NULL );
+#endif
+}
+
+static void
+	monitor_destroy
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	DeleteCriticalSection( &m->mutex );
+#else
+	pthread_cond_destroy( &m->cond );
+	pthread_mutex_destroy( &m->mutex );
+#endif
+}
+
+static void
+	monitor_lock
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	EnterCriticalSection( &m->mutex );
+#else
+	pthread_mutex_lock( &m->mutex );
+#endif
+}
+
+static void
+	monitor_unlock
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	LeaveCriticalSection( &m->mutex );
+#else
+	pthread_mutex_unlock( &m->mutex );
+#endif
+}
+
+/*	call with the lock held; it is held again on return	*/
+static void
+	monitor_wait
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS( &m->cond, &m->mutex, INFINITE );
+#else
+	pthread_cond_wait( &m->cond, &m->mutex );
+#endif
+}
+
+static void
+	monitor_wake_all
+	(
+		image_monitor *m
+	)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable( &m->cond );
+#else
+	pthread_cond_broadcast( &m->cond );
+#endif
+}
+
+/*	the shared monitor is set up by whichever thread asks first	*/
+static image_monitor shared_monitor;
+#ifdef _WIN32
+static INIT_ONCE shared_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+	shared_init
+	(
+		PINIT_ONCE once, PVOID param, PVOID *context
+	)
+{
+	monitor_init( &shared_monitor );
+	return TRUE;
+}
+#else
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+static void
+	shared_init
+	(
+		void
+	)
+{
+	monitor_init( &shared_monitor );
+}
+#endif
+
+image_monitor *
+	image_monitor_shared
+	(
+		void
+	)
+{
+#ifdef _WIN32
+	InitOnceExecuteOnce( &shared_once, shared_init, NULL, NULL );
+#else
+	pthread_once( &shared_once, shared_init );
+#endif
+	return &shared_monitor;
+}
+
+void
+	image_monitor_lock
+	(
+		image_monitor *monitor
+	)
+{
+	monitor_lock( monitor );
+}
+
+void
+	image_monitor_unlock
+	(
+		image_monitor *monitor
+	)
+{
+	monitor_unlock( monitor );
+}
+
+void
+	image_monitor_wait
+	(
+		image_monitor *monitor
+	)
+{
+	monitor_wait( monitor );
+}
+
+void
+	image_monitor_wake_all
+	(
+		image_monitor *monitor
+	)
+{
+	monitor_wake_all( monitor );
+}
+
+/*	pushers wait for room and poppers for items on the same condition,
+	the queue is only ever a handful of threads deep	*/
+struct image_queue
+{
+	void **items;
+	int capacity, head, count, closed;
+	image_monitor monitor;
+};
+
+image_queue *
+	image_queue_create
+	(
+		int capacity
+	)
+{
+	image_queue *q;
+	if( capacity < 1 )
+	{
+		capacity = 1;
+	}
+	q = (image_queue *)malloc( sizeof(image_queue) );
+	if( q == NULL )
+	{
+		return NULL;
+	}
+	q->items = (void **)malloc( capacity * sizeof(void *) );
+	if( q->items == NULL )
+	{
+		free( q );
+		return NULL;
+	}
+	q->capacity = capacity;
+	q->head = q->count = q->closed = 0;
+	monitor_init( &q->monitor );
+	return q;
+}
+
+int
+	image_queue_push
+	(
+		image_queue *q,
+		void *item
+	)
+{
+	int ok;
+	monitor_lock( &q->monitor );
+	while( !q->closed && (q->count == q->capacity) )
+	{
+		monitor_wait( &q->monitor );
+	}
+	ok = !q->closed;
+	if( ok )
+	{
+		q->items[(q->head + q->count) % q->capacity] = item;
+		++q->count;
+		monitor_wake_all( &q->monitor );
+	}
+	monitor_unlock( &q->monitor );
+	return ok;
+}
+
+void *
+	image_queue_pop
+	(
+		image_queue *q
+	)
+{
+	void *item = NULL;
+	monitor_lock( &q->monitor );
+	while( !q->closed && (q->count == 0) )
+	{
+		monitor_wait( &q->monitor );
+	}
+	if( q->count > 0 )
+	{
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->capacity;
+		--q->count;
+		monitor_wake_all( &q->monitor );
+	}
+	monitor_unlock( &q->monitor );
+	return item;
+}
+
+void
+	image_queue_close
+	(
+		image_queue *q
+	)
+{
+	monitor_lock( &q->monitor );
+	q->closed = 1;
+	monitor_wake_all( &q->monitor );
+	monitor_unlock( &q->monitor );
+}
+
+void
+	image_queue_destroy
+	(
+		image_queue *q
+	)
+{
+	if( q == NULL )
+	{
+		return;
+	}
+	monitor_destroy( &q->monitor );
+	free( q->items );
+	free( q );
+}
+
+struct image_budget
+{
+	size_t limit, used;
+	int holders;
+	image_monitor monitor;
+};
+
+image_budget *
+	image_budget_create
+	(
+		size_t limit
+	)
+{
+	image_budget *b = (image_budget *)malloc( sizeof(image_budget) );
+	if( b == NULL )
+	{
+		return NULL;
+	}
+	b->limit = limit;
+	b->used = 0;
+	b->holders = 0;
+	monitor_init( &b->monitor );
+	return b;
+}
+
+void
+	image_budget_acquire
+	(
+		image_budget *b,
+		size_t amount
+	)
+{
+	monitor_lock( &b->monitor );
+	while( b->limit && (b->holders > 0) && (b->used + amount > b->limit) )
+	{
+		monitor_wait( &b->monitor );
+	}
+	b->used += amount;
+	++b->holders;
+	monitor_unlock( &b->monitor );
+}
+
+void
+	image_budget_release
+	(
+		image_budget *b,
+		size_t amount
+	)
+{
+	monitor_lock( &b->monitor );
+	b->used -= amount;
+	--b->holders;
+	monitor_wake_all( &b->monitor );
+	monitor_unlock( &b->monitor );
+}
+
+void
+	image_budget_destroy
+	(
+		image_budget *b
+	)
+{
+	if( b == NULL )
+	{
+		return;
+	}
+	monitor_destroy( &b->monitor );
+	free( b );
+}
+
+struct image_worker
+{
+	image_job_func func;
+	void *arg;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI
+	worker_main
+	(
+		LPVOID arg
+	)
+{
+	image_worker *w = (image_worker *)arg;
+	w->func( w->arg );
+	return 0;
+}
+#else
+static void *
+	worker_main
+	(
+		void *arg
+	)
+{
+	image_worker *w = (image_worker *)arg;
+	w->func( w->arg );
+	return NULL;
+}
+#endif
+
+image_worker *
+	image_worker_start
+	(
+		image_job_func func,
+		void *arg
+	)
+{
+	image_worker *w = (image_worker *)malloc( sizeof(image_worker) );
+	if( w == NULL )
+	{
+		return NULL;
+	}
+	w->func = func;
+	w->arg = arg;
+#ifdef _WIN32
+	w->thread = CreateThread( NULL, 0, worker_main, w, 0, NULL );
+	if( w->thread == NULL )
+#else
+	if( pthread_create( &w->thread, NULL, worker_main, w ) != 0 )
+#endif
+	{
+		free( w );
+		return NULL;
+	}
+	return w;
+}
+
+void
+	image_worker_join
+	(
+		image_worker *w
+	)
+{
+#ifdef _WIN32
+	WaitForSingleObject( w->thread, INFINITE );
+	CloseHandle( w->thread );
+#else
+	pthread_join( w->thread, NULL );
+#endif
+	free( w );
+}
@@ -0,0 +1,218 @@
+/*
+	minimal thread helpers, so the image code can spread a batch of
+	independent jobs over all the cores
+
+	public domain
+*/
+
+#ifndef HEADER_IMAGE_THREAD
+#define HEADER_IMAGE_THREAD
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*	storage class for state kept per thread, such as the last failure;
+	define IMAGE_THREAD_LOCAL first to override it	*/
+#ifndef IMAGE_THREAD_LOCAL
+	#if defined(_MSC_VER)
+		#define IMAGE_THREAD_LOCAL __declspec(thread)
+	#elif defined(__GNUC__)
+		#define IMAGE_THREAD_LOCAL __thread
+	#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+		#define IMAGE_THREAD_LOCAL _Thread_local
+	#else
+		#define IMAGE_THREAD_LOCAL
+	#endif
+#endif
+
+typedef void (*image_job_func)( void *job );
+
+/**
+	Returns the number of hardware threads available, at least 1.
+**/
+int
+	image_thread_count
+	(
+		void
+	);
+
+/**
+	Calls func once for each of the num_jobs jobs, which are stored
+	job_size bytes apart starting at jobs.  The jobs are shared out
+	between up to image_thread_count() threads, the calling thread
+	included, and this returns once every job has finished.  Jobs run
+	in no particular order and must not depend on each other.
+**/
+void
+	image_thread_run
+	(
+		image_job_func func,
+		void *jobs, int job_size, int num_jobs
+	);
+
+/**
+	A first-in first-out queue of pointers holding at most capacity
+	of them, for handing work from one thread to others.
+**/
+typedef struct image_queue image_queue;
+
+/**
+	Returns a new empty queue, or NULL if it couldn't be allocated.
+**/
+image_queue *
+	image_queue_create
+	(
+		int capacity
+	);
+
+/**
+	Appends item, waiting while the queue is full.  Returns 0 if the
+	queue has been closed, in which case item was not added.
+**/
+int
+	image_queue_push
+	(
+		image_queue *queue,
+		void *item
+	);
+
+/**
+	Removes and returns the oldest item, waiting while the queue is
+	empty.  Returns NULL once the queue is closed and empty.
+**/
+void *
+	image_queue_pop
+	(
+		image_queue *queue
+	);
+
+/**
+	No more items will be pushed; wakes every thread waiting in
+	image_queue_pop once the remaining items are gone.
+**/
+void
+	image_queue_close
+	(
+		image_queue *queue
+	);
+
+void
+	image_queue_destroy
+	(
+		image_queue *queue
+	);
+
+/**
+	Limits how many bytes threads may have in use at once.  A thread
+	that would go over the limit waits until enough is released, but
+	is always let through when nothing else is held, so one request
+	bigger than the whole limit still makes progress.
+**/
+typedef struct image_budget image_budget;
+
+/**
+	limit is in bytes, 0 meaning no limit.  Returns NULL if the budget
+	couldn't be allocated.
+**/
+image_budget *
+	image_budget_create
+	(
+		size_t limit
+	);
+
+void
+	image_budget_acquire
+	(
+		image_budget *budget,
+		size_t amount
+	);
+
+void
+	image_budget_release
+	(
+		image_budget *budget,
+		size_t amount
+	);
+
+void
+	image_budget_destroy
+	(
+		image_budget *budget
+	);
+
+/**
+	A lock with a condition variable, for state that threads share
+	beyond a single batch, such as a cache.
+**/
+typedef struct image_monitor image_monitor;
+
+/**
+	The one monitor of the whole process, set up the first time any
+	thread asks for it.
+**/
+image_monitor *
+	image_monitor_shared
+	(
+		void
+	);
+
+void
+	image_monitor_lock
+	(
+		image_monitor *monitor
+	);
+
+void
+	image_monitor_unlock
+	(
+		image_monitor *monitor
+	);
+
+/**
+	Call with the lock held; waits for image_monitor_wake_all and
+	holds the lock again on return.
+**/
+void
+	image_monitor_wait
+	(
+		image_monitor *monitor
+	);
+
+void
+	image_monitor_wake_all
+	(
+		image_monitor *monitor
+	);
+
+/**
+	A thread running func( arg ) until it returns.
+**/
+typedef struct image_worker image_worker;
+
+/**
+	Starts the thread, returns NULL if it couldn't be started.
+**/
+image_worker *
+	image_worker_start
+	(
+		image_job_func func,
+		void *arg
+	);
+
+/**
+	Waits for the thread to finish and frees it.
+**/
+void
+	image_worker_join
+	(
+		image_worker *worker
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_THREAD	*/
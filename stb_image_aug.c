@@ -6,7 +6,7 @@
           avoid problematic images and only need the trivial interface
 
       JPEG baseline (no JPEG progressive, no oddball channel decimations)
-      PNG non-interlaced
+      PNG 1/2/4/8/16-bit, interlaced or not
       BMP non-1bpp, non-RLE
       TGA (not sure what subset, if a subset)
       PSD (composited view only, no extra channels)
@@ -15,9 +15,6 @@
       decoded from memory or through stdio FILE (define STBI_NO_STDIO to remove code)
       supports installable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
 
-   TODO:
-      stbi_info_*
-
    history:
       1.16   major bugfix - convert_format converted one too many pixels
       1.15   initialize some fields for thread safety
@@ -74,12 +71,39 @@
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+// loading by filename maps the file where the platform allows it; define
+// STBI_NO_MMAP to always read it into memory instead
+#ifndef STBI_NO_MMAP
+   #ifdef _WIN32
+      #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+      #endif
+      #ifndef NOMINMAX
+      #define NOMINMAX
+      #endif
+      #include <windows.h>
+      #include <io.h>  // _get_osfhandle
+   #else
+      #include <sys/types.h>
+      #include <sys/stat.h>
+      #include <sys/mman.h>
+   #endif
+#endif
 #endif
 #include <stdlib.h>
+#include <limits.h>
+#include <float.h>
 #include <memory.h>
 #include <assert.h>
 #include <stdarg.h>
 
+// SSE2 kernels are used whenever the compiler targets SSE2; define
+// STBI_NO_SSE2 to build the plain C paths only
+#if !defined(STBI_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBI_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifndef _MSC_VER
   #ifdef __cplusplus
   #define __forceinline inline
@@ -95,6 +119,11 @@ typedef unsigned short uint16;
 typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
+#ifdef _MSC_VER
+typedef unsigned __int64 uint64;
+#else
+typedef unsigned long long uint64;
+#endif
 #ifndef ANDROID
 typedef unsigned int   uint;
 #endif
@@ -109,6 +138,9 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 #include "stbi_DDS_aug.h"
 #endif
 
+#include "image_checksum.h"
+#include "image_thread.h"
+
 //	I (JLD) want full messages for SOIL
 #define STBI_FAILURE_USERMSG 1
 
@@ -117,30 +149,50 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 // Generic API that works on all image types
 //
 
-// this is not threadsafe
-static char *failure_reason;
+// the failure reason and the few other scratch globals are per thread, so
+// images can be decoded on any number of threads at once. the settings
+// (gamma, dither, CRC checks, installed hooks) stay process-wide; every
+// load reads them once when it starts
+static IMAGE_THREAD_LOCAL char *failure_reason;
+static IMAGE_THREAD_LOCAL int failure_code;
 
 char *stbi_failure_reason(void)
 {
    return failure_reason;
 }
 
-static int e(char *str)
+int stbi_failure_code(void)
+{
+   return failure_code;
+}
+
+static int fail(char *str, char const *why, int code)
 {
    failure_reason = str;
+   failure_code = code;
    return 0;
 }
 
+// ec() and friends take the STBI_ERROR_xxx category; plain e() is for bad
+// data, which is most failures
 #ifdef STBI_NO_FAILURE_STRINGS
-   #define e(x,y)  0
+   #define ec(x,y,c)  fail(NULL,y,c)
 #elif defined(STBI_FAILURE_USERMSG)
-   #define e(x,y)  e(y)
+   #define ec(x,y,c)  fail(y,y,c)
 #else
-   #define e(x,y)  e(x)
+   #define ec(x,y,c)  fail(x,y,c)
 #endif
+#define e(x,y)        ec(x,y,STBI_ERROR_CORRUPT)
 
-#define epf(x,y)   ((float *) (e(x,y)?NULL:NULL))
-#define epuc(x,y)  ((unsigned char *) (e(x,y)?NULL:NULL))
+#define epfc(x,y,c)   ((float *) (ec(x,y,c)?NULL:NULL))
+#define epucc(x,y,c)  ((unsigned char *) (ec(x,y,c)?NULL:NULL))
+#define epf(x,y)      epfc(x,y,STBI_ERROR_CORRUPT)
+#define epuc(x,y)     epucc(x,y,STBI_ERROR_CORRUPT)
+
+#ifndef STBI_PARALLEL
+#define STBI_PARALLEL image_thread_run
+#endif
+stbi_parallel_func stbi_parallel = STBI_PARALLEL;
 
 void stbi_image_free(void *retval_from_stbi_load)
 {
@@ -173,77 +225,272 @@ int stbi_register_loader(stbi_loader *loader)
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
+static int is_packed(int req_comp);
+static int packed_comp(int req_comp);
+static unsigned char *pack_format(unsigned char *data, int img_n, int req_comp, uint x, uint y);
 
 #ifndef STBI_NO_STDIO
-unsigned char *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+// a whole image file, held for the in-memory decoders: the FILE path pays
+// a call per byte and a seek per format probe, the memory path neither.
+// big regular files are mapped, everything else (small files, pipes,
+// devices, or STBI_NO_MMAP) is read in as few large reads as possible
+// below this, one read is cheaper than setting up and tearing down a map
+#define MAP_MIN_SIZE  (64 << 10)
+#define READ_CHUNK    (64 << 10)
+
+static int read_stream(stbi_file *m, FILE *f)
+{
+   size_t cap = 0, len = 0, got;
+   long size = -1;
+   stbi_uc *data = NULL, *p;
+   // size a seekable stream up front so a regular file is one fread; if
+   // that doesn't work, grow through chunked reads until EOF
+   if (!fseek(f, 0, SEEK_END)) {
+      size = ftell(f);
+      if (fseek(f, 0, SEEK_SET)) size = -1;
+   }
+   if (size > INT_MAX) return ec("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
+   // the spare byte makes the fread that hits EOF come back short
+   cap = size >= 0 ? (size_t) size + 1 : READ_CHUNK;
+   for (;;) {
+      if (!data || len == cap) {
+         if (data) {
+            if (cap >= INT_MAX) { free(data); return ec("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED); }
+            cap = cap > INT_MAX / 2 ? INT_MAX : cap * 2;
+         }
+         p = (stbi_uc *) realloc(data, cap);
+         if (!p) { free(data); return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
+         data = p;
+      }
+      got = fread(data + len, 1, cap - len, f);
+      len += got;
+      if (len < cap) {
+         if (ferror(f)) { free(data); return ec("can't fread", "Unable to read file", STBI_ERROR_IO); }
+         break;
+      }
+   }
+   m->data = data;
+   m->len = (int) len;
+   m->mapped = 0;
+   return 1;
+}
+
+#ifndef STBI_NO_MMAP
+// 1 with the file mapped; 0 to fall back to reading it. the map goes
+// through the already open stream, since a pipe can't be opened twice
+static int map_file(stbi_file *m, FILE *f)
+{
+#ifdef _WIN32
+   HANDLE file = (HANDLE) _get_osfhandle(_fileno(f)), mapping;
+   LARGE_INTEGER size;
+   void *p = NULL;
+   if (file == INVALID_HANDLE_VALUE || GetFileType(file) != FILE_TYPE_DISK
+         || !GetFileSizeEx(file, &size) || size.QuadPart < MAP_MIN_SIZE || size.QuadPart > INT_MAX)
+      return 0;
+   mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (mapping) {
+      p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+   }
+   if (!p) return 0;
+   m->len = (int) size.QuadPart;
+#else
+   struct stat st;
+   void *p;
+   if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_size < MAP_MIN_SIZE || st.st_size > INT_MAX)
+      return 0;
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+   if (p == MAP_FAILED) return 0;
+   #ifdef MADV_SEQUENTIAL
+   madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+   #endif
+   m->len = (int) st.st_size;
+#endif
+   m->data = (stbi_uc *) p;
+   m->mapped = 1;
+   return 1;
+}
+#endif
+
+int stbi_file_open(stbi_file *m, char const *filename)
 {
    FILE *f = fopen(filename, "rb");
-   unsigned char *result;
-   if (!f) return epuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
+   int ok;
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   #ifndef STBI_NO_MMAP
+   ok = map_file(m, f);
+   if (!ok)
+   #endif
+      ok = read_stream(m, f);
    fclose(f);
-   return result;
+   return ok;
 }
 
-unsigned char *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+void stbi_file_close(stbi_file *m)
+{
+   #ifndef STBI_NO_MMAP
+   if (m->mapped) {
+      #ifdef _WIN32
+      UnmapViewOfFile(m->data);
+      #else
+      munmap(m->data, (size_t) m->len);
+      #endif
+      return;
+   }
+   #endif
+   free(m->data);
+}
+#endif
+
+// every built-in type is told apart by a signature in its first bytes, so
+// one look at them picks the loader, instead of a test (and, for a FILE, a
+// seek back) per format. TGA has no signature: it stays a guess from its
+// header fields, made only after the registered loaders pass
+#define HEADER_LEN  32
+
+static int signature_type(stbi_uc const *h, int len)
 {
+   static uint8 png_sig[8] = { 137,80,78,71,13,10,26,10 };
    int i;
-   if (stbi_jpeg_test_file(f))
-      return stbi_jpeg_load_from_file(f,x,y,comp,req_comp);
-   if (stbi_png_test_file(f))
-      return stbi_png_load_from_file(f,x,y,comp,req_comp);
-   if (stbi_bmp_test_file(f))
-      return stbi_bmp_load_from_file(f,x,y,comp,req_comp);
-   if (stbi_psd_test_file(f))
-      return stbi_psd_load_from_file(f,x,y,comp,req_comp);
+   if (len > HEADER_LEN) len = HEADER_LEN;
+   if (len >= 2 && h[0] == 0xff) {
+      // SOI, after any 0xff fill bytes
+      for (i=1; i < len && h[i] == 0xff; ++i)
+         ;
+      if (i < len && h[i] == 0xd8) return STBI_type_jpeg;
+   }
+   if (len >= 8 && !memcmp(h, png_sig, 8)) return STBI_type_png;
+   if (len >= 18 && h[0] == 'B' && h[1] == 'M') {
+      // the info header size picks the BMP versions we read
+      uint32 sz = h[14] + (h[15] << 8) + (h[16] << 16) + ((uint32) h[17] << 24);
+      if (sz == 12 || sz == 40 || sz == 56 || sz == 108) return STBI_type_bmp;
+   }
+   if (len >= 4 && !memcmp(h, "8BPS", 4)) return STBI_type_psd;
    #ifndef STBI_NO_DDS
-   if (stbi_dds_test_file(f))
-      return stbi_dds_load_from_file(f,x,y,comp,req_comp);
+   if (len >= 8 && !memcmp(h, "DDS ", 4) && h[4] == 124 && !h[5] && !h[6] && !h[7])
+      return STBI_type_dds;
    #endif
    #ifndef STBI_NO_HDR
-   if (stbi_hdr_test_file(f)) {
-      float *hdr = stbi_hdr_load_from_file(f, x,y,comp,req_comp);
-      return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
-   }
+   if (len >= 11 && !memcmp(h, "#?RADIANCE\n", 11)) return STBI_type_hdr;
    #endif
+   return STBI_type_unknown;
+}
+
+int stbi_detect_type(stbi_uc const *header, int len)
+{
+   int type = signature_type(header, len);
+   if (type == STBI_type_unknown && stbi_tga_test_memory(header, len < HEADER_LEN ? len : HEADER_LEN))
+      type = STBI_type_tga;
+   return type;
+}
+
+#ifndef STBI_NO_STDIO
+unsigned char *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_file m;
+   unsigned char *result;
+   failure_code = STBI_ERROR_NONE;
+   if (!stbi_file_open(&m, filename)) return NULL;
+   result = stbi_load_from_memory(m.data,m.len,x,y,comp,req_comp);
+   stbi_file_close(&m);
+   return result;
+}
+
+// the header is read once, and the stream put back where it was
+static int file_type(FILE *f)
+{
+   stbi_uc header[HEADER_LEN];
+   long n = ftell(f);
+   int len = (int) fread(header, 1, HEADER_LEN, f);
+   fseek(f,n,SEEK_SET);
+   return signature_type(header, len);
+}
+
+static unsigned char *load_file(FILE *f, int type, int *x, int *y, int *comp, int req_comp)
+{
+   int i;
+   switch (type) {
+      case STBI_type_jpeg: return stbi_jpeg_load_from_file(f,x,y,comp,req_comp);
+      case STBI_type_png:  return stbi_png_load_from_file(f,x,y,comp,req_comp);
+      case STBI_type_bmp:  return stbi_bmp_load_from_file(f,x,y,comp,req_comp);
+      case STBI_type_psd:  return stbi_psd_load_from_file(f,x,y,comp,req_comp);
+      #ifndef STBI_NO_DDS
+      case STBI_type_dds:  return stbi_dds_load_from_file(f,x,y,comp,req_comp);
+      #endif
+      #ifndef STBI_NO_HDR
+      case STBI_type_hdr: {
+         float *hdr = stbi_hdr_load_from_file(f, x,y,comp,req_comp);
+         return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      }
+      #endif
+      case STBI_type_tga:  return stbi_tga_load_from_file(f,x,y,comp,req_comp);
+   }
    for (i=0; i < max_loaders; ++i)
       if (loaders[i]->test_file(f))
          return loaders[i]->load_from_file(f,x,y,comp,req_comp);
    // test tga last because it's a crappy test!
    if (stbi_tga_test_file(f))
       return stbi_tga_load_from_file(f,x,y,comp,req_comp);
-   return epuc("unknown image type", "Image not of any known type, or corrupt");
+   return epucc("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
+}
+
+unsigned char *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   int type = file_type(f);
+   failure_code = STBI_ERROR_NONE;
+   // jpeg and png pack as they color-convert, the rest afterwards
+   if (is_packed(req_comp) && type != STBI_type_jpeg && type != STBI_type_png) {
+      unsigned char *data = load_file(f,type,x,y,comp,packed_comp(req_comp));
+      return data ? pack_format(data, packed_comp(req_comp), req_comp, *x, *y) : NULL;
+   }
+   return load_file(f,type,x,y,comp,req_comp);
 }
 #endif
 
-unsigned char *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+static unsigned char *load_memory(stbi_uc const *buffer, int len, int type, int *x, int *y, int *comp, int req_comp)
 {
    int i;
-   if (stbi_jpeg_test_memory(buffer,len))
-      return stbi_jpeg_load_from_memory(buffer,len,x,y,comp,req_comp);
-   if (stbi_png_test_memory(buffer,len))
-      return stbi_png_load_from_memory(buffer,len,x,y,comp,req_comp);
-   if (stbi_bmp_test_memory(buffer,len))
-      return stbi_bmp_load_from_memory(buffer,len,x,y,comp,req_comp);
-   if (stbi_psd_test_memory(buffer,len))
-      return stbi_psd_load_from_memory(buffer,len,x,y,comp,req_comp);
-   #ifndef STBI_NO_DDS
-   if (stbi_dds_test_memory(buffer,len))
-      return stbi_dds_load_from_memory(buffer,len,x,y,comp,req_comp);
-   #endif
-   #ifndef STBI_NO_HDR
-   if (stbi_hdr_test_memory(buffer, len)) {
-      float *hdr = stbi_hdr_load_from_memory(buffer, len,x,y,comp,req_comp);
-      return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+   switch (type) {
+      case STBI_type_jpeg: return stbi_jpeg_load_from_memory(buffer,len,x,y,comp,req_comp);
+      case STBI_type_png:  return stbi_png_load_from_memory(buffer,len,x,y,comp,req_comp);
+      case STBI_type_bmp:  return stbi_bmp_load_from_memory(buffer,len,x,y,comp,req_comp);
+      case STBI_type_psd:  return stbi_psd_load_from_memory(buffer,len,x,y,comp,req_comp);
+      #ifndef STBI_NO_DDS
+      case STBI_type_dds:  return stbi_dds_load_from_memory(buffer,len,x,y,comp,req_comp);
+      #endif
+      #ifndef STBI_NO_HDR
+      case STBI_type_hdr: {
+         float *hdr = stbi_hdr_load_from_memory(buffer, len,x,y,comp,req_comp);
+         return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      }
+      #endif
+      case STBI_type_tga:  return stbi_tga_load_from_memory(buffer,len,x,y,comp,req_comp);
    }
-   #endif
    for (i=0; i < max_loaders; ++i)
       if (loaders[i]->test_memory(buffer,len))
          return loaders[i]->load_from_memory(buffer,len,x,y,comp,req_comp);
    // test tga last because it's a crappy test!
    if (stbi_tga_test_memory(buffer,len))
       return stbi_tga_load_from_memory(buffer,len,x,y,comp,req_comp);
-   return epuc("unknown image type", "Image not of any known type, or corrupt");
+   return epucc("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
+}
+
+unsigned char *stbi_load_typed_from_memory(stbi_uc const *buffer, int len, int type, int *x, int *y, int *comp, int req_comp)
+{
+   failure_code = STBI_ERROR_NONE;
+   if (type == STBI_type_unknown)
+      type = signature_type(buffer, len);
+   // jpeg and png pack as they color-convert, the rest afterwards
+   if (is_packed(req_comp) && type != STBI_type_jpeg && type != STBI_type_png) {
+      unsigned char *data = load_memory(buffer,len,type,x,y,comp,packed_comp(req_comp));
+      return data ? pack_format(data, packed_comp(req_comp), req_comp, *x, *y) : NULL;
+   }
+   return load_memory(buffer,len,type,x,y,comp,req_comp);
+}
+
+unsigned char *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_load_typed_from_memory(buffer,len,STBI_type_unknown,x,y,comp,req_comp);
 }
 
 #ifndef STBI_NO_HDR
@@ -251,11 +498,12 @@ unsigned char *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int
 #ifndef STBI_NO_STDIO
 float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = fopen(filename, "rb");
+   stbi_file m;
    float *result;
-   if (!f) return epf("can't fopen", "Unable to open file");
-   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   failure_code = STBI_ERROR_NONE;
+   if (!stbi_file_open(&m, filename)) return NULL;
+   result = stbi_loadf_from_memory(m.data,m.len,x,y,comp,req_comp);
+   stbi_file_close(&m);
    return result;
 }
 
@@ -263,27 +511,35 @@ float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *data;
    #ifndef STBI_NO_HDR
-   if (stbi_hdr_test_file(f))
+   if (file_type(f) == STBI_type_hdr)
       return stbi_hdr_load_from_file(f,x,y,comp,req_comp);
    #endif
    data = stbi_load_from_file(f, x, y, comp, req_comp);
    if (data)
       return ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return epf("unknown image type", "Image not of any known type, or corrupt");
+   return epfc("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
 }
 #endif
 
-float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+float *stbi_loadf_typed_from_memory(stbi_uc const *buffer, int len, int type, int *x, int *y, int *comp, int req_comp)
 {
    stbi_uc *data;
+   failure_code = STBI_ERROR_NONE;
+   if (type == STBI_type_unknown)
+      type = signature_type(buffer, len);
    #ifndef STBI_NO_HDR
-   if (stbi_hdr_test_memory(buffer, len))
+   if (type == STBI_type_hdr)
       return stbi_hdr_load_from_memory(buffer, len,x,y,comp,req_comp);
    #endif
-   data = stbi_load_from_memory(buffer, len, x, y, comp, req_comp);
+   data = stbi_load_typed_from_memory(buffer, len, type, x, y, comp, req_comp);
    if (data)
       return ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return epf("unknown image type", "Image not of any known type, or corrupt");
+   return epfc("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
+}
+
+float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_loadf_typed_from_memory(buffer,len,STBI_type_unknown,x,y,comp,req_comp);
 }
 #endif
 
@@ -323,12 +579,61 @@ extern int      stbi_is_hdr_from_file(FILE *f)
 
 #endif
 
-// @TODO: get image dimensions & components without fully decoding
+// get image dimensions & components without fully decoding; only the
+// header of each format is parsed, no pixel memory is allocated. *comp
+// is what the matching stbi_load would report (see dds_info for the one
+// case where that depends on the pixel data).
 #ifndef STBI_NO_STDIO
-extern int      stbi_info            (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
+int stbi_info(char const *filename, int *x, int *y, int *comp)
+{
+   FILE *f = fopen(filename, "rb");
+   int result;
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   result = stbi_info_from_file(f, x, y, comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   switch (file_type(f)) {
+      case STBI_type_jpeg: return stbi_jpeg_info_from_file(f,x,y,comp);
+      case STBI_type_png:  return stbi_png_info_from_file(f,x,y,comp);
+      case STBI_type_bmp:  return stbi_bmp_info_from_file(f,x,y,comp);
+      case STBI_type_psd:  return stbi_psd_info_from_file(f,x,y,comp);
+      #ifndef STBI_NO_DDS
+      case STBI_type_dds:  return stbi_dds_info_from_file(f,x,y,comp);
+      #endif
+      #ifndef STBI_NO_HDR
+      case STBI_type_hdr:  return stbi_hdr_info_from_file(f,x,y,comp);
+      #endif
+   }
+   // test tga last because it's a crappy test!
+   if (stbi_tga_test_file(f))
+      return stbi_tga_info_from_file(f,x,y,comp);
+   return ec("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
+}
 #endif
-extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   switch (signature_type(buffer, len)) {
+      case STBI_type_jpeg: return stbi_jpeg_info_from_memory(buffer,len,x,y,comp);
+      case STBI_type_png:  return stbi_png_info_from_memory(buffer,len,x,y,comp);
+      case STBI_type_bmp:  return stbi_bmp_info_from_memory(buffer,len,x,y,comp);
+      case STBI_type_psd:  return stbi_psd_info_from_memory(buffer,len,x,y,comp);
+      #ifndef STBI_NO_DDS
+      case STBI_type_dds:  return stbi_dds_info_from_memory(buffer,len,x,y,comp);
+      #endif
+      #ifndef STBI_NO_HDR
+      case STBI_type_hdr:  return stbi_hdr_info_from_memory(buffer,len,x,y,comp);
+      #endif
+   }
+   // test tga last because it's a crappy test!
+   if (stbi_tga_test_memory(buffer,len))
+      return stbi_tga_info_from_memory(buffer,len,x,y,comp);
+   return ec("unknown image type", "Image not of any known type, or corrupt", STBI_ERROR_UNSUPPORTED);
+}
 
 #ifndef STBI_NO_HDR
 static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
@@ -369,6 +674,7 @@ typedef struct
 static void start_file(stbi *s, FILE *f)
 {
    s->img_file = f;
+   s->img_buffer = s->img_buffer_end = NULL;
 }
 #endif
 
@@ -439,19 +745,47 @@ static int get16le(stbi *s)
 static uint32 get32le(stbi *s)
 {
    uint32 z = get16le(s);
-   return z + (get16le(s) << 16);
+   return z + ((uint32) get16le(s) << 16);
 }
 
+// reads n bytes; whatever the source doesn't have reads as 0, as with get8
 static void getn(stbi *s, stbi_uc *buffer, int n)
 {
+   int got;
+   if (n <= 0) return;
 #ifndef STBI_NO_STDIO
-   if (s->img_file) {
-      fread(buffer, 1, n, s->img_file);
-      return;
+   if (s->img_file)
+      got = (int) fread(buffer, 1, n, s->img_file);
+   else
+#endif
+   {
+      got = s->img_buffer < s->img_buffer_end ? (int) (s->img_buffer_end - s->img_buffer) : 0;
+      if (got > n) got = n;
+      memcpy(buffer, s->img_buffer, got);
+      s->img_buffer += got;
    }
+   if (got < n)
+      memset(buffer + got, 0, n - got);
+}
+
+// the next n bytes in one piece: in place when they're all in memory,
+// otherwise read into *temp for the caller to free, short as from getn
+static uint8 const *getn_block(stbi *s, int n, uint8 **temp)
+{
+   *temp = NULL;
+#ifndef STBI_NO_STDIO
+   if (s->img_file == NULL)
 #endif
-   memcpy(buffer, s->img_buffer, n);
-   s->img_buffer += n;
+   {
+      if (s->img_buffer_end - s->img_buffer >= n) {
+         s->img_buffer += n;
+         return s->img_buffer - n;
+      }
+   }
+   *temp = (uint8 *) malloc(n > 0 ? n : 1);
+   if (*temp == NULL) return NULL;
+   getn(s, *temp, n);
+   return *temp;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -470,99 +804,548 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert x pixels with img_n components to req_comp components, a pixel
+// at a time
+static void convert_pixels(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, uint x)
+{
+   int i;
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch(COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+}
+
+#ifdef STBI_SSE2
+// 4 pixels at a time: widened to RGBA, then narrowed to what's wanted,
+// which covers every combination with the same few steps. SSE2 has no
+// byte shuffle, so 3-component pixels are moved around as 2 to a 64-bit
+// lane. loads and stores touch exactly the 4*n bytes of the pixels, so
+// a row can be narrowed in place
+static __m128i load_px(unsigned char const *p, int n)
+{
+   int w;
+   switch (n) {
+      case 1:  memcpy(&w, p, 4); return _mm_cvtsi32_si128(w);
+      case 2:  return _mm_loadl_epi64((__m128i const *) p);
+      case 3:  memcpy(&w, p + 8, 4);
+               return _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i const *) p), _mm_cvtsi32_si128(w));
+      default: return _mm_loadu_si128((__m128i const *) p);
+   }
+}
+
+static void store_px(unsigned char *p, __m128i v, int n)
+{
+   int w;
+   switch (n) {
+      case 1:  w = _mm_cvtsi128_si32(v); memcpy(p, &w, 4); break;
+      case 2:  _mm_storel_epi64((__m128i *) p, v); break;
+      case 3:  _mm_storel_epi64((__m128i *) p, v);
+               w = _mm_cvtsi128_si32(_mm_srli_si128(v, 8)); memcpy(p + 8, &w, 4); break;
+      default: _mm_storeu_si128((__m128i *) p, v); break;
+   }
+}
+
+static __m128i to_rgba(__m128i v, int n)
+{
+   __m128i t, alpha = _mm_set1_epi32((int) 0xff000000);
+   switch (n) {
+      case 1:  // y -> y y y 255
+         t = _mm_unpacklo_epi8(v, v);
+         return _mm_or_si128(_mm_unpacklo_epi16(t, t), alpha);
+      case 2:  // y a -> y y a a -> y y y a
+         t = _mm_unpacklo_epi8(v, v);
+         return _mm_or_si128(_mm_and_si128(t, _mm_set1_epi32((int) 0xff00ffff)),
+                             _mm_slli_epi32(_mm_and_si128(t, _mm_set1_epi32(0xff)), 16));
+      case 3:  // pixels 0,1 in the low lane and 2,3 in the high one, the
+               // second of each moved up a byte to make room for alpha
+         t = _mm_unpacklo_epi64(v, _mm_srli_si128(v, 6));
+         t = _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0xffffff, 0, 0xffffff)),
+                          _mm_and_si128(_mm_slli_epi64(t, 8), _mm_set_epi32(0xffffff, 0, 0xffffff, 0)));
+         return _mm_or_si128(t, alpha);
+      default:
+         return v;
+   }
+}
+
+// compute_y of each pixel, one to a 32-bit lane: r and b share a madd
+static __m128i luma(__m128i c)
+{
+   __m128i rb = _mm_and_si128(c, _mm_set1_epi32(0x00ff00ff));
+   __m128i g  = _mm_and_si128(_mm_srli_epi32(c, 8), _mm_set1_epi32(0xff));
+   __m128i y  = _mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32((29 << 16) | 77)),
+                              _mm_madd_epi16(g, _mm_set1_epi32(150)));
+   return _mm_srli_epi32(y, 8);
+}
+
+static __m128i from_rgba(__m128i c, int m)
+{
+   __m128i t;
+   switch (m) {
+      case 1:
+         t = luma(c);
+         t = _mm_packs_epi32(t, t);
+         return _mm_packus_epi16(t, t);
+      case 2:  // y | a << 8, sign extended so the pack doesn't saturate
+         t = _mm_or_si128(luma(c), _mm_and_si128(_mm_srli_epi32(c, 16), _mm_set1_epi32(0xff00)));
+         t = _mm_srai_epi32(_mm_slli_epi32(t, 16), 16);
+         return _mm_packs_epi32(t, t);
+      case 3:  // drop alpha, close up each lane, then the two lanes
+         t = _mm_and_si128(c, _mm_set1_epi32(0x00ffffff));
+         t = _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0xffffff, 0, 0xffffff)),
+                          _mm_srli_epi64(_mm_and_si128(t, _mm_set_epi32(0xffffff, 0, 0xffffff, 0)), 8));
+         return _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0, -1, -1)),
+                             _mm_slli_si128(_mm_srli_si128(t, 8), 6));
+      default:
+         return c;
+   }
+}
+#endif
+
+// convert one row of x pixels with img_n components to req_comp components.
+// dest may be src itself when req_comp < img_n: every pixel is written at
+// or before where it was read from
+static void convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, uint x)
+{
+   uint i = 0;
+   #ifdef STBI_SSE2
+   #define SIMD_CASE(a,b)  case COMBO(a,b): \
+            for (; i+4 <= x; i += 4) { \
+               store_px(dest + i*b, from_rgba(to_rgba(load_px(src + i*a, a), a), b), b); \
+            } \
+            break;
+   // 1<->2 are left to convert_pixels, which the compiler vectorizes
+   // better than a trip through RGBA
+   switch (COMBO(img_n, req_comp)) {
+      SIMD_CASE(1,3) SIMD_CASE(1,4)
+      SIMD_CASE(2,3) SIMD_CASE(2,4)
+      SIMD_CASE(3,1) SIMD_CASE(3,2) SIMD_CASE(3,4)
+      SIMD_CASE(4,1) SIMD_CASE(4,2) SIMD_CASE(4,3)
+   }
+   #undef SIMD_CASE
+   #endif
+   if (i < x)
+      convert_pixels(dest + i*req_comp, src + i*img_n, img_n, req_comp, x - i);
+}
+
+// BGR(A) to RGB(A), for BMP and TGA rows: img_n and req_comp are 3 or 4.
+// opaque writes 255 over whatever the 4th source byte holds
+static void swap_rb_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, uint x, int opaque)
+{
+   uint i = 0;
+   #ifdef STBI_SSE2
+   __m128i keep = _mm_set1_epi32((int) 0xff00ff00), lo = _mm_set1_epi32(0xff);
+   __m128i alpha = _mm_set1_epi32(opaque ? (int) 0xff000000 : 0);
+   #define SWAP_CASE(a,b)  case COMBO(a,b): for (; i+4 <= x; i += 4) { \
+            __m128i c = to_rgba(load_px(src + i*a, a), a); \
+            c = _mm_or_si128(_mm_or_si128(_mm_and_si128(c, keep), alpha), \
+                             _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 16), lo), _mm_slli_epi32(_mm_and_si128(c, lo), 16))); \
+            store_px(dest + i*b, from_rgba(c, b), b); \
+         } break;
+   switch (COMBO(img_n, req_comp)) {
+      SWAP_CASE(3,3) SWAP_CASE(3,4) SWAP_CASE(4,3) SWAP_CASE(4,4)
+   }
+   #undef SWAP_CASE
+   #endif
+   for (; i < x; ++i) {
+      unsigned char const *p = src + i*img_n;
+      unsigned char *q = dest + i*req_comp;
+      q[0] = p[2], q[1] = p[1], q[2] = p[0];
+      if (req_comp == 4) q[3] = (img_n == 4 && !opaque) ? p[3] : 255;
+   }
+}
+
+static uint16 compute_y16(int r, int g, int b)
+{
+   return (uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
+}
+
+// convert_row for 16-bit components
+static void convert_row16(uint16 *dest, uint16 const *src, int img_n, int req_comp, uint x)
+{
+   int i;
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   switch(COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=0xffff; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=0xffff; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=0xffff; break;
+      CASE(3,1) dest[0]=compute_y16(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y16(src[0],src[1],src[2]), dest[1] = 0xffff; break;
+      CASE(4,1) dest[0]=compute_y16(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y16(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+}
+
+// converts in place: fewer components front to back, then the buffer is
+// shrunk; more components after one realloc, back to front, each piece of
+// a row staged on the stack first since its pixels spread over their own
+// source
 static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
-   int i,j;
+   unsigned char stage[512*4];
    unsigned char *good;
+   size_t row_in = (size_t) x * img_n, row_out = (size_t) x * req_comp;
+   uint j, i, n;
 
    if (req_comp == img_n) return data;
    assert(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) malloc(req_comp * x * y);
+   if (req_comp < img_n) {
+      for (j=0; j < y; ++j)
+         convert_row(data + j * row_out, data + j * row_in, img_n, req_comp, x);
+      good = (unsigned char *) realloc(data, row_out * y);
+      return good ? good : data;
+   }
+
+   good = (unsigned char *) realloc(data, row_out * y);
    if (good == NULL) {
       free(data);
-      return epuc("outofmem", "Out of memory");
-   }
-
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch(COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
+      return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   }
+   for (j=y; j-- > 0; ) {
+      unsigned char *row = good + j * row_in, *out = good + j * row_out;
+      for (i=x; i > 0; i -= n) {
+         n = i < 512 ? i : 512;
+         memcpy(stage, row + (i - n) * img_n, n * img_n);
+         convert_row(out + (i - n) * req_comp, stage, img_n, req_comp, n);
+      }
    }
-
-   free(data);
    return good;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+//  packed 16-bit output, for req_comp STBI_rgb565 and STBI_rgba4444
+//    jpeg and non-interlaced png pack each row as it's color-converted;
+//    everything else decodes to 3 or 4 components and is packed in place,
+//    so no second full-size buffer is ever needed
+
+static int dither_mode = STBI_dither_none;
+
+void stbi_set_dither(int mode) { dither_mode = mode; }
+
+static int is_packed(int req_comp)
+{
+   return req_comp == STBI_rgb565 || req_comp == STBI_rgba4444;
+}
+
+// the 8-bit component count a packed format is built from
+static int packed_comp(int req_comp)
+{
+   return req_comp == STBI_rgb565 ? 3 : 4;
+}
+
+typedef struct
+{
+   int fmt, dither;
+   uint y;       // next row to be packed, for the ordered pattern
+   int *err;     // error diffusion: this row's and the next row's error,
+   int *next;    // four components a pixel, in 16ths of a level
+} stbi_packer;
+
+static uint8 bayer4[4][4] =
+{
+   {  0, 8, 2,10 },
+   { 12, 4,14, 6 },
+   {  3,11, 1, 9 },
+   { 15, 7,13, 5 },
+};
+
+static int packer_init(stbi_packer *p, int fmt, uint x)
+{
+   p->fmt = fmt;
+   p->dither = dither_mode;
+   p->y = 0;
+   p->err = p->next = NULL;
+   if (p->dither == STBI_dither_diffuse) {
+      // a pixel of slack either side so the kernel never needs a bounds check
+      p->err = (int *) calloc((x + 2) * 8, sizeof(int));
+      if (!p->err) return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+      p->err += 4;
+      p->next = p->err + (x + 2) * 4;
+   }
+   return 1;
+}
+
+static void packer_free(stbi_packer *p)
+{
+   if (p->err) free((p->err < p->next ? p->err : p->next) - 4);
+}
+
+// pack one row of x pixels with img_n (3 or 4) components. a pixel is fully
+// read before it's written, so dest may alias src when converting in place
+static void pack_row(stbi_packer *p, uint16 *dest, uint8 const *src, int img_n, uint x)
+{
+   static uint8 const bits[2][4] = { { 5,6,5,0 }, { 4,4,4,4 } };
+   uint8 const *b = bits[p->fmt == STBI_rgba4444];
+   int n = p->fmt == STBI_rgba4444 ? 4 : 3;
+   uint8 const *row = bayer4[p->y & 3];
+   uint i;
+   int k, c[4];
+   for (i=0; i < x; ++i, src += img_n) {
+      uint16 out = 0;
+      c[0] = src[0], c[1] = src[1], c[2] = src[2];
+      c[3] = img_n == 4 ? src[3] : 255;
+      for (k=0; k < n; ++k) {
+         int max = (1 << b[k]) - 1, q;
+         if (p->dither == STBI_dither_diffuse) {
+            int *e = p->err + i*4 + k, *f = p->next + i*4 + k;
+            int v = c[k] * 16 + *e, err;
+            v = v < 0 ? 0 : (v + 8) >> 4;
+            if (v > 255) v = 255;
+            q = (v * max + 127) / 255;
+            err = v - (q * 255 + (max >> 1)) / max;
+            // Floyd-Steinberg: 7/16 right, 3/16 down-left, 5/16 down, 1/16 down-right
+            e[4]  += err * 7;
+            f[-4] += err * 3;
+            f[0]  += err * 5;
+            f[4]  += err;
+         } else if (p->dither == STBI_dither_ordered) {
+            q = (c[k] * max + row[i & 3] * 16 + 8) / 255;
+         } else {
+            q = (c[k] * max + 127) / 255;
+         }
+         out = (uint16) ((out << b[k]) | q);
+      }
+      dest[i] = out;
+   }
+   if (p->err) {
+      int *t = p->err;
+      p->err = p->next;
+      p->next = t;
+      memset(p->next - 4, 0, (x + 2) * 4 * sizeof(int));
+   }
+   ++p->y;
+}
+
+static unsigned char *pack_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+{
+   stbi_packer p;
+   unsigned char *good;
+   uint j;
+   if (!packer_init(&p, req_comp, x)) { free(data); return NULL; }
+   for (j=0; j < y; ++j)
+      pack_row(&p, (uint16 *) (data + j * x * 2), data + j * x * img_n, img_n, x);
+   packer_free(&p);
+   // the packed image is smaller, give the rest back
+   good = (unsigned char *) realloc(data, x * y * 2 + 1);
+   return good ? good : data;
+}
+
+stbi_uc *stbi_pack_image(stbi_uc *data, int x, int y, int comp, int req_comp)
+{
+   if (!is_packed(req_comp) || comp < 3 || comp > 4) {
+      free(data);
+      return epucc("bad req_comp", "Internal error", STBI_ERROR_INVALID_ARGUMENT);
+   }
+   return pack_format(data, comp, req_comp, x, y);
+}
+
 #ifndef STBI_NO_HDR
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
-   int i,k,n;
-   float *output = (float *) malloc(x * y * comp * sizeof(float));
-   if (output == NULL) { free(data); return epf("outofmem", "Out of memory"); }
+   size_t i, count = (size_t) x * y;
+   int k,n;
+   float gamma = l2h_gamma, scale = l2h_scale;
+   float lut[256], alpha[256];
+   float *output = (float *) malloc(count * comp * sizeof(float));
+   if (output == NULL) { free(data); return epfc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
+   // there are only 256 inputs, so pow runs once for each of them
+   for (k=0; k < 256; ++k) {
+      lut[k] = (float) pow(k/255.0f, gamma) * scale;
+      alpha[k] = k/255.0f;
+   }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, l2h_gamma) * l2h_scale;
-      }
-      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+   for (i=0; i < count; ++i) {
+      for (k=0; k < n; ++k)
+         output[i*comp + k] = lut[data[i*comp+k]];
+      if (k < comp) output[i*comp + k] = alpha[data[i*comp+k]];
    }
    free(data);
    return output;
 }
 
 #define float2int(x)   ((int) (x))
-static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
+
+static stbi_uc hdr_ldr(float v, float gamma_i, float scale_i)
 {
-   int i,k,n;
-   stbi_uc *output = (stbi_uc *) malloc(x * y * comp);
-   if (output == NULL) { free(data); return epuc("outofmem", "Out of memory"); }
-   // compute number of non-alpha components
-   if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = float2int(z);
-      }
-      if (k < comp) {
-         float z = data[i*comp+k] * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = float2int(z);
+   float z = (float) pow(v*scale_i, gamma_i) * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return z == z ? float2int(z) : 0;
+}
+
+static float float_from_bits(uint32 b)
+{
+   float f;
+   memcpy(&f, &b, 4);
+   return f;
+}
+
+static uint32 float_bits(float f)
+{
+   uint32 b;
+   memcpy(&b, &f, 4);
+   return b;
+}
+
+// A colour channel's byte only goes up with its value, so instead of a pow
+// per channel the conversion is 255 thresholds: above[k] is the bit pattern
+// of the least float that comes out as k or more (past infinity if none
+// does), found by bisection, and comparing bit patterns orders non-negative
+// floats. start[] has the byte for the bottom of each range of 2^16
+// patterns, which is at most a step or two short of the answer.
+#define HDR_LDR_TOP      0x7f800000u   // +infinity; larger is NaN
+#define HDR_LDR_BUCKETS  ((HDR_LDR_TOP >> 16) + 1)
+
+typedef struct
+{
+   uint32 above[256];
+   stbi_uc start[HDR_LDR_BUCKETS];
+   float gamma_i, scale_i;
+} hdr_ldr_table;
+
+static void hdr_ldr_build(hdr_ldr_table *t, float gamma_i, float scale_i)
+{
+   uint32 b;
+   int k;
+   t->gamma_i = gamma_i;
+   t->scale_i = scale_i;
+   t->above[0] = 0;
+   for (k=1; k < 256; ++k) {
+      uint32 lo = t->above[k-1], hi = HDR_LDR_TOP + 1;
+      while (lo < hi) {
+         uint32 mid = lo + (hi - lo) / 2;
+         if (hdr_ldr(float_from_bits(mid), gamma_i, scale_i) >= k) hi = mid;
+         else lo = mid + 1;
       }
+      t->above[k] = lo;
+   }
+   k = 0;
+   for (b=0; b < HDR_LDR_BUCKETS; ++b) {
+      while (k < 255 && t->above[k+1] <= b << 16) ++k;
+      t->start[b] = (stbi_uc) k;
    }
-   free(data);
-   return output;
 }
-#endif
 
-//////////////////////////////////////////////////////////////////////////////
-//
-//  "baseline" JPEG/JFIF decoder (not actually fully baseline implementation)
-//
+// negative and NaN values don't follow the order, so they take the long way
+static stbi_uc hdr_ldr_lookup(hdr_ldr_table const *t, float v)
+{
+   uint32 b = float_bits(v);
+   int k;
+   if (b > HDR_LDR_TOP) return hdr_ldr(v, t->gamma_i, t->scale_i);
+   k = t->start[b >> 16];
+   while (k < 255 && b >= t->above[k+1]) ++k;
+   return (stbi_uc) k;
+}
+
+static stbi_uc hdr_ldr_alpha(float v)
+{
+   float z = v * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return z == z ? float2int(z) : 0;
+}
+
+// the values first..first+count-1, four at a time where SSE2 is around;
+// with 1, 2 or 4 components the alpha channel sits in the same lanes of
+// every four
+static void hdr_ldr_run(stbi_uc *out, float const *in, size_t count, int comp, hdr_ldr_table const *t)
+{
+   size_t i = 0;
+   int k, alpha = comp & 1 ? 0 : comp == 2 ? 0xa : 0x8;
+#ifdef STBI_SSE2
+   __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255);
+   __m128i inf = _mm_set1_epi32(HDR_LDR_TOP);
+   for (; i + 4 <= count; i += 4) {
+      __m128 v = _mm_loadu_ps(in + i);
+      __m128i b = _mm_castps_si128(v);
+      // read unsigned, negatives and NaNs are the patterns above +infinity;
+      // SSE2 only compares signed, so that's both ends
+      int odd = _mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi32(b, inf), _mm_cmplt_epi32(b, _mm_setzero_si128())));
+      int32 bucket[4], a[4];
+      __m128 z = _mm_add_ps(_mm_mul_ps(v, top), _mm_set1_ps(0.5f));
+      _mm_storeu_si128((__m128i *) a, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z, zero), top)));
+      _mm_storeu_si128((__m128i *) bucket, _mm_srli_epi32(b, 16));
+      for (k=0; k < 4; ++k) {
+         if (alpha >> k & 1)
+            out[i+k] = (stbi_uc) a[k];
+         else if (odd >> (k*4) & 1)
+            out[i+k] = hdr_ldr(in[i+k], t->gamma_i, t->scale_i);
+         else {
+            uint32 u = float_bits(in[i+k]);
+            int o = t->start[bucket[k]];
+            while (o < 255 && u >= t->above[o+1]) ++o;
+            out[i+k] = (stbi_uc) o;
+         }
+      }
+   }
+#endif
+   for (; i < count; ++i)
+      out[i] = alpha >> (i & 3) & 1 ? hdr_ldr_alpha(in[i]) : hdr_ldr_lookup(t, in[i]);
+}
+
+static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
+{
+   size_t i, count = (size_t) x * y;
+   int k,n;
+   float gamma_i = h2l_gamma_i, scale_i = h2l_scale_i;
+   hdr_ldr_table *t = NULL;
+   stbi_uc *output;
+   if (data == NULL) return NULL;
+   output = (stbi_uc *) malloc(count * comp);
+   if (output == NULL) { free(data); return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
+   // the table costs a few thousand pow calls, so it only pays on images
+   // bigger than that, and it needs the curve to go up
+   if (count * comp >= (1 << 14) && gamma_i > 0 && gamma_i <= FLT_MAX && scale_i > 0 && scale_i <= FLT_MAX)
+      t = (hdr_ldr_table *) malloc(sizeof(*t));
+   if (t) {
+      hdr_ldr_build(t, gamma_i, scale_i);
+      hdr_ldr_run(output, data, count * comp, comp, t);
+      free(t);
+      free(data);
+      return output;
+   }
+   // compute number of non-alpha components
+   if (comp & 1) n = comp; else n = comp-1;
+   for (i=0; i < count; ++i) {
+      for (k=0; k < n; ++k)
+         output[i*comp + k] = hdr_ldr(data[i*comp+k], gamma_i, scale_i);
+      if (k < comp)
+         output[i*comp + k] = hdr_ldr_alpha(data[i*comp+k]);
+   }
+   free(data);
+   return output;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  "baseline" JPEG/JFIF decoder (not actually fully baseline implementation)
+//
 //    simple implementation
 //      - channel subsampling of at most 2 in each dimension
 //      - doesn't support delayed output of y-dimension
@@ -604,6 +1387,8 @@ typedef struct
 {
    #if STBI_SIMD
    unsigned short dequant2[4][64];
+   stbi_idct_8x8 idct;              // the hooks installed when the load started
+   stbi_YCbCr_to_RGB_run YCbCr;
    #endif
    stbi s;
    huffman huff_dc[4];
@@ -1040,7 +1825,7 @@ static int parse_entropy_coded_data(jpeg *z)
          for (i=0; i < w; ++i) {
             if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
             #if STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+            z->idct(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
             #else
             idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #endif
@@ -1070,7 +1855,7 @@ static int parse_entropy_coded_data(jpeg *z)
                      int y2 = (j*z->img_comp[n].v + y)*8;
                      if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
                      #if STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+                     z->idct(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
                      #else
                      idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                      #endif
@@ -1100,7 +1885,7 @@ static int process_marker(jpeg *z, int m)
          return e("expected marker","Corrupt JPEG");
 
       case 0xC2: // SOF - progressive
-         return e("progressive jpeg","JPEG format not supported (progressive)");
+         return ec("progressive jpeg", "JPEG format not supported (progressive)", STBI_ERROR_UNSUPPORTED);
 
       case 0xDD: // DRI - specify restart interval
          if (get16(&z->s) != 4) return e("bad DRI len","Corrupt JPEG");
@@ -1191,8 +1976,8 @@ static int process_frame_header(jpeg *z, int scan)
    stbi *s = &z->s;
    int Lf,p,i,q, h_max=1,v_max=1,c;
    Lf = get16(s);         if (Lf < 11) return e("bad SOF len","Corrupt JPEG"); // JPEG
-   p  = get8(s);          if (p != 8) return e("only 8-bit","JPEG format not supported: 8-bit only"); // JPEG baseline
-   s->img_y = get16(s);   if (s->img_y == 0) return e("no header height", "JPEG format not supported: delayed height"); // Legal, but we don't handle it--but neither does IJG
+   p  = get8(s);          if (p != 8) return ec("only 8-bit", "JPEG format not supported: 8-bit only", STBI_ERROR_UNSUPPORTED); // JPEG baseline
+   s->img_y = get16(s);   if (s->img_y == 0) return ec("no header height", "JPEG format not supported: delayed height", STBI_ERROR_UNSUPPORTED); // Legal, but we don't handle it--but neither does IJG
    s->img_x = get16(s);   if (s->img_x == 0) return e("0 width","Corrupt JPEG"); // JPEG requires
    c = get8(s);
    if (c != 3 && c != 1) return e("bad component count","Corrupt JPEG");    // JFIF requires
@@ -1217,7 +2002,7 @@ static int process_frame_header(jpeg *z, int scan)
 
    if (scan != SCAN_load) return 1;
 
-   if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
+   if ((1 << 30) / s->img_x / s->img_n < s->img_y) return ec("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
 
    for (i=0; i < s->img_n; ++i) {
       if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
@@ -1248,7 +2033,7 @@ static int process_frame_header(jpeg *z, int scan)
             free(z->img_comp[i].raw_data);
             z->img_comp[i].data = NULL;
          }
-         return e("outofmem", "Out of memory");
+         return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
       }
       // align blocks for installable-idct using mmx/sse
       z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
@@ -1448,16 +2233,20 @@ typedef struct
 
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
-   int n, decode_n;
+   int n, decode_n, packed = is_packed(req_comp);
    // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
+   if (req_comp < 0 || req_comp > STBI_rgba4444) return epucc("bad req_comp", "Internal error", STBI_ERROR_INVALID_ARGUMENT);
    z->s.img_n = 0;
+   #if STBI_SIMD
+   z->idct = stbi_idct_installed;
+   z->YCbCr = stbi_YCbCr_installed;
+   #endif
 
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s.img_n;
+   n = packed ? packed_comp(req_comp) : req_comp ? req_comp : z->s.img_n;
 
    if (z->s.img_n == 3 && n < 3)
       decode_n = 1;
@@ -1468,8 +2257,9 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
    {
       int k;
       uint i,j;
-      uint8 *output;
+      uint8 *output, *line = NULL;
       uint8 *coutput[4];
+      stbi_packer pk;
 
       stbi_resample res_comp[4];
 
@@ -1479,7 +2269,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
          // allocate line buffer big enough for upsampling off the edges
          // with upsample factor of 4
          z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
-         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
 
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
@@ -1495,13 +2285,25 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
          else                               r->resample = resample_row_generic;
       }
 
+      // packed output is color-converted a row at a time into 'line', then
+      // packed straight into the final half-size image
+      if (packed) {
+         if (!packer_init(&pk, req_comp, z->s.img_x)) { cleanup_jpeg(z); return NULL; }
+         line = (uint8 *) malloc(n * z->s.img_x + 1);
+         if (!line) { packer_free(&pk); cleanup_jpeg(z); return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
+      }
+
       // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+      output = (uint8 *) malloc((packed ? 2 : n) * z->s.img_x * z->s.img_y + 1);
+      if (!output) {
+         if (packed) { free(line); packer_free(&pk); }
+         cleanup_jpeg(z);
+         return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+      }
 
       // now go ahead and resample
       for (j=0; j < z->s.img_y; ++j) {
-         uint8 *out = output + n * z->s.img_x * j;
+         uint8 *out = packed ? line : output + n * z->s.img_x * j;
          for (k=0; k < decode_n; ++k) {
             stbi_resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -1520,7 +2322,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
             uint8 *y = coutput[0];
             if (z->s.img_n == 3) {
                #if STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
+               z->YCbCr(out, y, coutput[1], coutput[2], z->s.img_x, n);
                #else
                YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
                #endif
@@ -1537,7 +2339,10 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
             else
                for (i=0; i < z->s.img_x; ++i) *out++ = y[i], *out++ = 255;
          }
+         if (packed)
+            pack_row(&pk, (uint16 *) (output + 2 * z->s.img_x * j), line, n, z->s.img_x);
       }
+      if (packed) { free(line); packer_free(&pk); }
       cleanup_jpeg(z);
       *out_x = z->s.img_x;
       *out_y = z->s.img_y;
@@ -1592,34 +2397,85 @@ int stbi_jpeg_test_memory(stbi_uc const *buffer, int len)
    return decode_jpeg_header(&j, SCAN_type);
 }
 
-// @TODO:
+// header-only: stops at the SOF marker, so no component buffers are allocated
+static int jpeg_info(jpeg *j, int *x, int *y, int *comp)
+{
+   if (!decode_jpeg_header(j, SCAN_header)) return 0;
+   if (x) *x = j->s.img_x;
+   if (y) *y = j->s.img_y;
+   if (comp) *comp = j->s.img_n;
+   return 1;
+}
+
 #ifndef STBI_NO_STDIO
-extern int      stbi_jpeg_info            (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_jpeg_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
+int stbi_jpeg_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_jpeg_info_from_file(f,x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_jpeg_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   int n,r;
+   jpeg j;
+   n = ftell(f);
+   start_file(&j.s, f);
+   r = jpeg_info(&j,x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
 #endif
-extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   jpeg j;
+   start_mem(&j.s, buffer,len);
+   return jpeg_info(&j,x,y,comp);
+}
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, with length/distance extra bits folded into the table
+//      - 64-bit bit buffer refilled with one unaligned load
+//      - word-at-a-time match copies
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  10 // accelerate all cases in default tables
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
+// what a code stands for; fast[] entries and the slow path both decode to
+//    bits  0-7   bits to consume (code length, plus extra bits if folded)
+//    bits  8-11  extra bits still to be read with zreceive
+//    bits 12-15  ZSYM_* kind
+//    bits 16-31  literal byte, or length/distance base (+ folded extra)
+// a zero fast[] entry means the code is longer than ZFAST_BITS
+#define ZSYM_LITERAL   1
+#define ZSYM_COPY      2
+#define ZSYM_END       3
+#define ZSYM_BAD       4
+
+#define ZTABLE_CODELENGTH  0
+#define ZTABLE_LENGTH      1
+#define ZTABLE_DISTANCE    2
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint32 fast[1 << ZFAST_BITS];
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
    uint8  size[288];
    uint16 value[288];
+   int    table;
 } zhuffman;
 
 __forceinline static int bitreverse16(int n)
@@ -1639,14 +2495,46 @@ __forceinline static int bit_reverse(int v, int bits)
    return bitreverse16(v) >> (16-bits);
 }
 
-static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
+static int length_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static int length_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static int dist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+#define ZENTRY(bits,extra,kind,value)  ((uint32) (bits) | ((extra) << 8) | ((kind) << 12) | ((uint32) (value) << 16))
+
+static uint32 zsymbol_entry(int table, int sym, int bits)
+{
+   if (table == ZTABLE_LENGTH) {
+      if (sym < 256)  return ZENTRY(bits, 0, ZSYM_LITERAL, sym);
+      if (sym == 256) return ZENTRY(bits, 0, ZSYM_END, 0);
+      if (sym > 285)  return ZENTRY(bits, 0, ZSYM_BAD, 0);
+      return ZENTRY(bits, length_extra[sym-257], ZSYM_COPY, length_base[sym-257]);
+   }
+   if (table == ZTABLE_DISTANCE) {
+      if (sym > 29)   return ZENTRY(bits, 0, ZSYM_BAD, 0);
+      return ZENTRY(bits, dist_extra[sym], ZSYM_COPY, dist_base[sym]);
+   }
+   return ZENTRY(bits, 0, ZSYM_LITERAL, sym);
+}
+
+static int zbuild_huffman(zhuffman *z, uint8 const *sizelist, int num, int table)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
+   z->table = table;
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -1673,8 +2561,16 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          z->value[c] = (uint16)i;
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
+            uint32 f = zsymbol_entry(table, i, s);
+            int extra = (f >> 8) & 15;
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               if (extra && s + extra <= ZFAST_BITS) {
+                  // the extra bits sit right above the code in the lookup
+                  // index, so resolve them here too
+                  int x = (k >> s) & ((1 << extra) - 1);
+                  z->fast[k] = f + extra - (extra << 8) + ((uint32) x << 16);
+               } else
+                  z->fast[k] = f;
                k += (1 << s);
             }
          }
@@ -1690,17 +2586,26 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
+// windowed output: handed the bytes produced since the last call, returns
+// how many of them it consumed, or -1 to abort the decode
+typedef int (*zflush_func)(void *user, uint8 *data, int len);
+
 typedef struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   int num_pad;      // zero bytes fed in past zbuffer_end
+   uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
+   zflush_func zflush;  // if set, zout is a sliding window, see slide_window
+   void *zuser;
+   char *zout_flushed;  // first byte not consumed by zflush yet
+
    zhuffman z_length, z_distance;
 } zbuf;
 
@@ -1710,107 +2615,188 @@ __forceinline static int zget8(zbuf *z)
    return *z->zbuffer++;
 }
 
+__forceinline static uint64 zload64le(uint8 const *p)
+{
+   // compilers turn this into a single load on little-endian targets
+   return  (uint64) p[0]        | ((uint64) p[1] <<  8) |
+          ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+          ((uint64) p[4] << 32) | ((uint64) p[5] << 40) |
+          ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+// tops the bit buffer up to at least 56 bits. bits above num_bits are
+// either zero or the true upcoming stream bits, so OR-ing in a fresh
+// 8-byte load at num_bits is always consistent
 static void fill_bits(zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      z->code_buffer |= zload64le(z->zbuffer) << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      return;
+   }
+   // near the end: byte at a time, padding with zeros past the end
+   z->code_buffer &= ((uint64) 1 << z->num_bits) - 1;
    do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+      if (z->zbuffer >= z->zbuffer_end)
+         ++z->num_pad;
+      else
+         z->code_buffer |= (uint64) *z->zbuffer++ << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 __forceinline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) z->code_buffer & ((1 << n) - 1);
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-__forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
+// not resolved by fast table, so compute it the slow way
+// use jpeg approach, which requires MSbits at top
+static uint32 zhuffman_decode_slow(zbuf *a, zhuffman *z)
 {
    int b,s,k;
-   if (a->num_bits < 16) fill_bits(a);
-   b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return z->value[b];
-   }
-
-   // not resolved by fast table, so compute it the slow way
-   // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
-   if (s == 16) return -1; // invalid code!
+   if (s == 16) return 0; // invalid code!
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    assert(z->size[b] == s);
-   a->code_buffer >>= s;
-   a->num_bits -= s;
-   return z->value[b];
+   return zsymbol_entry(z->table, z->value[b], s);
+}
+
+// decodes one code and consumes its bits; caller guarantees 15+ bits
+__forceinline static uint32 zhuffman_entry(zbuf *a, zhuffman *z)
+{
+   uint32 f = z->fast[a->code_buffer & ZFAST_MASK];
+   if (f == 0) {
+      f = zhuffman_decode_slow(a, z);
+      if (f == 0) return 0;
+   }
+   a->code_buffer >>= f & 255;
+   a->num_bits -= f & 255;
+   return f;
+}
+
+__forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
+{
+   uint32 f;
+   if (a->num_bits < 16) fill_bits(a);
+   f = zhuffman_entry(a, z);
+   if (f == 0) return -1;
+   return f >> 16;
+}
+
+static int zflush_window(zbuf *z)
+{
+   int n = z->zflush(z->zuser, (uint8 *) z->zout_flushed, (int) (z->zout - z->zout_flushed));
+   if (n < 0) return 0;
+   z->zout_flushed += n;
+   return 1;
+}
+
+// let the consumer take what it can, then move the part of the window
+// still needed (unconsumed bytes, and at least the 32K that back-references
+// may reach) down to the start
+static int slide_window(zbuf *z, int n)
+{
+   int keep, drop;
+   if (!zflush_window(z)) return 0;
+   keep = (int) (z->zout - z->zout_flushed);
+   if (keep < 32768) keep = 32768;
+   if (keep > z->zout - z->zout_start) keep = (int) (z->zout - z->zout_start);
+   drop = (int) (z->zout - z->zout_start) - keep;
+   if ((z->zout_end - z->zout) + drop < n) return e("output buffer limit","Corrupt PNG");
+   memmove(z->zout_start, z->zout - keep, keep);
+   z->zout -= drop;
+   z->zout_flushed -= drop;
+   return 1;
 }
 
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
    int cur, limit;
+   if (z->zflush) return slide_window(z, n);
    if (!z->z_expandable) return e("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
    q = (char *) realloc(z->zout_start, limit);
-   if (q == NULL) return e("outofmem", "Out of memory");
+   if (q == NULL) return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
    return 1;
 }
 
-static int length_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static int length_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static int dist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
-
 static int parse_huffman_block(zbuf *a)
 {
+   uint8 *zout = (uint8 *) a->zout;
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+      uint32 f;
+      int len,dist;
+      uint8 *p;
+      // longest symbol pair: 15+5 bit length, then 15+13 bit distance
+      if (a->num_bits < 48) {
+         // eating into the zero padding means the stream was truncated
+         if (a->num_bits < a->num_pad * 8) return e("unexpected end","Corrupt PNG");
+         fill_bits(a);
+      }
+      f = zhuffman_entry(a, &a->z_length);
+      if (((f >> 12) & 15) == ZSYM_LITERAL) {
+         if (zout >= (uint8 *) a->zout_end) {
+            a->zout = (char *) zout;
+            if (!expand(a, 1)) return 0;
+            zout = (uint8 *) a->zout;
+         }
+         *zout++ = (uint8) (f >> 16);
+         continue;
+      }
+      if (((f >> 12) & 15) == ZSYM_END) {
+         a->zout = (char *) zout;
+         return 1;
+      }
+      if (((f >> 12) & 15) != ZSYM_COPY) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+      len = f >> 16;
+      if (f & 0xf00) len += zreceive(a, (f >> 8) & 15);
+      f = zhuffman_entry(a, &a->z_distance);
+      if (((f >> 12) & 15) != ZSYM_COPY) return e("bad huffman code","Corrupt PNG");
+      dist = f >> 16;
+      if (f & 0xf00) dist += zreceive(a, (f >> 8) & 15);
+      if (zout - (uint8 *) a->zout_start < dist) return e("bad dist","Corrupt PNG");
+      if (zout + len > (uint8 *) a->zout_end) {
+         a->zout = (char *) zout;
+         if (!expand(a, len)) return 0;
+         zout = (uint8 *) a->zout;
+      }
+      p = zout - dist;
+      if (dist == 1) {
+         // run of a single byte
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8 && (uint8 *) a->zout_end - zout >= len + 16) {
+         // whole words may overrun len, which is harmless while there is
+         // slack at the end of the buffer; each source word is already
+         // written before it is read because dist >= the word size
+         uint8 *end = zout + len;
+         if (dist >= 16) {
+            do { memcpy(zout, p, 16); zout += 16; p += 16; } while (zout < end);
+         } else {
+            do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+         }
+         zout = end;
       } else {
-         uint8 *p;
-         int len,dist;
-         if (z == 256) return 1;
-         z -= 257;
-         len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
-         dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
          while (len--)
-            *a->zout++ = *p++;
+            *zout++ = *p++;
       }
    }
 }
@@ -1818,7 +2804,7 @@ static int parse_huffman_block(zbuf *a)
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   static zhuffman z_codelength; // static just to save stack space
+   zhuffman z_codelength;
    uint8 lencodes[286+32+137];//padding for maximum single op
    uint8 codelength_sizes[19];
    int i,n;
@@ -1832,15 +2818,16 @@ static int compute_huffman_codes(zbuf *a)
       int s = zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (uint8) s;
    }
-   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19, ZTABLE_CODELENGTH)) return 0;
 
    n = 0;
    while (n < hlit + hdist) {
       int c = zhuffman_decode(a, &z_codelength);
-      assert(c >= 0 && c < 19);
+      if (c < 0 || c >= 19) return e("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (uint8) c;
       else if (c == 16) {
+         if (n == 0) return e("bad codelengths", "Corrupt PNG");
          c = zreceive(a,2)+3;
          memset(lencodes+n, lencodes[n-1], c);
          n += c;
@@ -1856,8 +2843,8 @@ static int compute_huffman_codes(zbuf *a)
       }
    }
    if (n != hlit+hdist) return e("bad codelengths","Corrupt PNG");
-   if (!zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!zbuild_huffman(&a->z_length, lencodes, hlit, ZTABLE_LENGTH)) return 0;
+   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, ZTABLE_DISTANCE)) return 0;
    return 1;
 }
 
@@ -1867,26 +2854,35 @@ static int parse_uncompressed_block(zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   assert(a->num_bits == 0);
+   // hand the whole bytes still in the bit buffer back to the input
+   k = (a->num_bits >> 3) - a->num_pad;
+   if (k < 0) return e("read past buffer","Corrupt PNG");
+   a->zbuffer -= k;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   a->num_pad = 0;
    // now fill header the normal way
-   while (k < 4)
-      header[k++] = (uint8) zget8(a);
+   for (k=0; k < 4; ++k)
+      header[k] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
    if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
+   if (a->zout + len > a->zout_end && !a->zflush)
       if (!expand(a, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // a window may be smaller than the block, so copy what fits each time
+   while (len > 0) {
+      k = (int) (a->zout_end - a->zout);
+      if (k == 0) {
+         if (!expand(a, 1)) return 0;
+         continue;
+      }
+      if (k > len) k = len;
+      memcpy(a->zout, a->zbuffer, k);
+      a->zbuffer += k;
+      a->zout += k;
+      len -= k;
+   }
    return 1;
 }
 
@@ -1903,18 +2899,28 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// the fixed Huffman code lengths from the spec: 0-143 are 8 bits, 144-255
+// 9 bits, 256-279 7 bits, 280-287 8 bits, and every distance code 5 bits
+static uint8 const default_length[288] =
+{
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8,
+};
+static uint8 const default_distance[32] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+   5,5,5,5,5,5,5,5,
+};
 
 static int parse_zlib(zbuf *a, int parse_header)
 {
@@ -1922,6 +2928,7 @@ static int parse_zlib(zbuf *a, int parse_header)
    if (parse_header)
       if (!parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->num_pad = 0;
    a->code_buffer = 0;
    do {
       final = zreceive(a,1);
@@ -1933,9 +2940,8 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
-            if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
-            if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
+            if (!zbuild_huffman(&a->z_length  , default_length  , 288, ZTABLE_LENGTH  )) return 0;
+            if (!zbuild_huffman(&a->z_distance, default_distance,  32, ZTABLE_DISTANCE)) return 0;
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
@@ -1951,10 +2957,28 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zflush = NULL;
 
    return parse_zlib(a, parse_header);
 }
 
+// inflate through a fixed-size window instead of one buffer for the whole
+// output; flush sees every byte once, in order, and must consume all of
+// it by the end
+static int do_zlib_windowed(zbuf *a, char *window, int wlen, zflush_func flush, void *user)
+{
+   a->zout_start   = window;
+   a->zout         = window;
+   a->zout_end     = window + wlen;
+   a->z_expandable = 0;
+   a->zflush       = flush;
+   a->zuser        = user;
+   a->zout_flushed = window;
+
+   if (!parse_zlib(a, 1)) return 0;
+   return zflush_window(a);
+}
+
 char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    zbuf a;
@@ -2016,8 +3040,8 @@ int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffe
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
-//      - only 8-bit samples
-//      - no CRC checking
+//      - 1/2/4/8/16-bit samples, Adam7 interlacing
+//      - CRCs only checked if asked for with stbi_png_verify_crc
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
 //        - avoids explicit window management
@@ -2041,12 +3065,43 @@ static chunk get_chunk_header(stbi *s)
    return c;
 }
 
+static int png_crc_check = 0;
+
+void stbi_png_verify_crc(int verify) { png_crc_check = verify; }
+
+// checks the CRC that follows a chunk's data, which is either already in
+// memory or (reading from a file) gets read again starting at 'pos'
+static int png_check_crc(stbi *s, uint32 type, uint8 const *data, uint32 len, long pos)
+{
+   uint8 tag[4];
+   uint32 crc;
+   tag[0] = (uint8) (type >> 24);
+   tag[1] = (uint8) (type >> 16);
+   tag[2] = (uint8) (type >>  8);
+   tag[3] = (uint8) type;
+   crc = image_crc32(0, tag, 4);
+   #ifndef STBI_NO_STDIO
+   if (!data) {
+      uint8 buf[4096];
+      if (fseek(s->img_file, pos, SEEK_SET)) return 0;
+      while (len) {
+         uint32 n = len < sizeof(buf) ? len : sizeof(buf);
+         if (fread(buf, 1, n, s->img_file) != n) return 0;
+         crc = image_crc32(crc, buf, n);
+         len -= n;
+      }
+   } else
+   #endif
+      crc = image_crc32(crc, data, len);
+   return get32(s) == crc;
+}
+
 static int check_png_header(stbi *s)
 {
    static uint8 png_sig[8] = { 137,80,78,71,13,10,26,10 };
    int i;
    for (i=0; i < 8; ++i)
-      if (get8(s) != png_sig[i]) return e("bad png sig","Not a PNG");
+      if (get8(s) != png_sig[i]) return ec("bad png sig", "Not a PNG", STBI_ERROR_UNSUPPORTED);
    return 1;
 }
 
@@ -2054,17 +3109,23 @@ typedef struct
 {
    stbi s;
    uint8 *idata, *expanded, *out;
+   int depth, interlace;
+   int out16;           // keep 16-bit samples instead of reducing to 8 bits
+   int verify_crc;      // stbi_png_verify_crc when the load started
 } png;
 
 
+// PNG filter types; the _first variants are what the filters reduce to on
+// the first row, where the prior row is all zeros (Up becomes None and
+// Paeth becomes Sub, so only Avg needs its own version)
 enum {
    F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4,
-   F_avg_first, F_paeth_first,
+   F_avg_first
 };
 
 static uint8 first_row_filter[5] =
 {
-   F_none, F_sub, F_none, F_avg_first, F_paeth_first
+   F_none, F_sub, F_none, F_avg_first, F_sub
 };
 
 static int paeth(int a, int b, int c)
@@ -2078,169 +3139,535 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
-// create the png data from post-deflated data
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
+#ifdef STBI_SSE2
+// pixels travel through the low 32 bits of a register, or the low 64 bits
+// for 16-bit RGB/RGBA; a 3- or 6-byte pixel drags part of its neighbour
+// along, which is harmless because every lane is independent and the next
+// store overwrites it
+__forceinline static __m128i png_load_pixel(uint8 const *p, int wide)
 {
-   stbi *s = &a->s;
-   uint32 i,j,stride = s->img_x*out_n;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
-   assert(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (uint8 *) malloc(s->img_x * s->img_y * out_n);
-   if (!a->out) return e("outofmem", "Out of memory");
-   if (raw_len != (img_n * s->img_x + 1) * s->img_y) return e("not enough pixels","Corrupt PNG");
-   for (j=0; j < s->img_y; ++j) {
-      uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
-      int filter = *raw++;
-      if (filter > 4) return e("invalid filter","Corrupt PNG");
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch(filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
+   int v;
+   if (wide) return _mm_loadl_epi64((__m128i const *) p);
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+__forceinline static void png_store_pixel(uint8 *p, __m128i v, int wide)
+{
+   int x;
+   if (wide) { _mm_storel_epi64((__m128i *) p, v); return; }
+   x = _mm_cvtsi128_si32(v);
+   memcpy(p, &x, 4);
+}
+
+static int png_unfilter_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, int filter, int n, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, b, c = zero, x;
+   int i = 0, wide = bpp > 4, w = wide ? 8 : 4;
+   if (filter != F_up && bpp != 3 && bpp != 4 && bpp != 6 && bpp != 8) return 0;
+   switch (filter) {
+      case F_up:
+         for (; i+16 <= n; i += 16) {
+            x = _mm_loadu_si128((__m128i const *) (raw+i));
+            b = _mm_loadu_si128((__m128i const *) (prior+i));
+            _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(x, b));
+         }
+         return i;
+      case F_sub:
+         for (; i+w <= n; i += bpp) {
+            a = _mm_add_epi8(png_load_pixel(raw+i, wide), a);
+            png_store_pixel(cur+i, a, wide);
          }
+         return i;
+      case F_avg: {
+         // SSE2 only has a rounding-up average, so take the carry back off
+         __m128i one = _mm_set1_epi8(1);
+         for (; i+w <= n; i += bpp) {
+            b = png_load_pixel(prior+i, wide);
+            x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(png_load_pixel(raw+i, wide), x);
+            png_store_pixel(cur+i, a, wide);
+         }
+         return i;
       }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=s->img_x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch(filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
+      case F_paeth: {
+         // same predictor choice as paeth(), on 16-bit lanes:
+         // pa = |b-c|, pb = |a-c|, pc = |a+b-2c|
+         __m128i mask = _mm_set1_epi16(255);
+         for (; i+w <= n; i += bpp) {
+            __m128i pa,pb,pc,smallest,pred;
+            b  = _mm_unpacklo_epi8(png_load_pixel(prior+i, wide), zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            x    = _mm_cmpeq_epi16(smallest, pb);
+            pred = _mm_or_si128(_mm_and_si128(x, b), _mm_andnot_si128(x, c));
+            x    = _mm_cmpeq_epi16(smallest, pa);
+            pred = _mm_or_si128(_mm_and_si128(x, a), _mm_andnot_si128(x, pred));
+            x = _mm_unpacklo_epi8(png_load_pixel(raw+i, wide), zero);
+            a = _mm_and_si128(_mm_add_epi16(x, pred), mask);
+            png_store_pixel(cur+i, _mm_packus_epi16(a, a), wide);
+            c = b;
          }
-         #undef CASE
+         return i;
+      }
+   }
+   return 0;
+}
+#endif
+
+// undo one row's filter; cur, prior and raw are tightly packed rows of n
+// bytes with bpp bytes per pixel. prior is unused for the _first filters
+static void png_unfilter_row(uint8 *cur, uint8 const *prior, uint8 const *raw, int filter, int n, int bpp)
+{
+   int i = 0;
+   if (filter == F_none) {
+      memcpy(cur, raw, n);
+      return;
+   }
+   #ifdef STBI_SSE2
+   i = png_unfilter_sse2(cur, prior, raw, filter, n, bpp);
+   #endif
+   // the first pixel has no left neighbour
+   if (i == 0) {
+      switch (filter) {
+         case F_sub      : for (; i < bpp; ++i) cur[i] = raw[i]; break;
+         case F_avg_first: for (; i < bpp; ++i) cur[i] = raw[i]; break;
+         case F_avg      : for (; i < bpp; ++i) cur[i] = raw[i] + (prior[i] >> 1); break;
+         case F_paeth    : for (; i < bpp; ++i) cur[i] = raw[i] + prior[i]; break;
+      }
+   }
+   switch (filter) {
+      case F_sub      : for (; i < n; ++i) cur[i] = raw[i] + cur[i-bpp]; break;
+      case F_up       : for (; i < n; ++i) cur[i] = raw[i] + prior[i]; break;
+      case F_avg      : for (; i < n; ++i) cur[i] = raw[i] + ((prior[i] + cur[i-bpp]) >> 1); break;
+      case F_avg_first: for (; i < n; ++i) cur[i] = raw[i] + (cur[i-bpp] >> 1); break;
+      case F_paeth    : for (; i < n; ++i) cur[i] = (uint8) (raw[i] + paeth(cur[i-bpp], prior[i], prior[i-bpp])); break;
+   }
+}
+
+// Adam7 pass origins and spacing; a non-interlaced image is decoded as a
+// single pass starting at 0,0 with spacing 1
+static uint8 adam7_x0[7] = { 0,4,0,2,0,1,0 };
+static uint8 adam7_y0[7] = { 0,0,4,0,2,0,1 };
+static uint8 adam7_dx[7] = { 8,8,4,4,2,2,1 };
+static uint8 adam7_dy[7] = { 8,8,8,4,4,2,2 };
+
+// multiplier taking a 1/2/4-bit grey sample to the full 0..255 range
+static uint8 depth_scale[5] = { 0, 0xff, 0x55, 0, 0x11 };
+
+// rows are unfiltered as soon as inflate completes them and go straight
+// into the final output format, so the inflated stream never exists in
+// full; only a window of it and two packed rows do. each row then runs
+// through whichever of these stages the image needs:
+//    sample   - unpack 1/2/4-bit samples, or reduce/byteswap 16-bit ones
+//    expand   - palette lookup, or tRNS alpha for 8-bit samples
+//    convert  - change component count to req_comp
+//    widen    - 8-bit samples to 16-bit output
+//    pack     - quantize to STBI_rgb565 / STBI_rgba4444
+// the last stage writes into the output row, or for interlaced images into
+// a line that is scattered to the pass's pixel positions
+typedef struct
+{
+   png *p;
+   uint32 row, n;       // rows done in this pass, filtered bytes per row
+   uint32 pass_x, pass_y;
+   int pass, passes;
+   uint8 *cur, *prior;  // packed unfiltered rows, swapped every row
+   uint8 *buf[2];       // stage outputs ping-pong between these
+   uint8 *line;         // final row of an interlaced pass
+   int direct;          // unfilter straight into the output
+   int stages;
+   int depth, bpp, out16, psize;
+   int src_n, out_n;
+   uint8 *palette;
+   int pal_img_n;
+   uint8 *tc;           // tRNS colour for 1-8 bit non-paletted images, or NULL
+   uint16 *tc16;        // tRNS colour for 16-bit images, or NULL
+   int pack;            // packed req_comp, or 0
+   stbi_packer pk;
+} png_rows;
+
+static uint32 png_pass_size(uint32 size, int origin, int spacing)
+{
+   return size > (uint32) origin ? (size - origin + spacing - 1) / spacing : 0;
+}
+
+// move on to the next pass with any pixels in it
+static void png_begin_pass(png_rows *r)
+{
+   stbi *s = &r->p->s;
+   for (; r->pass < r->passes; ++r->pass) {
+      if (r->passes == 1) {
+         r->pass_x = s->img_x;
+         r->pass_y = s->img_y;
       } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=s->img_x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch(filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
-         }
-         #undef CASE
+         r->pass_x = png_pass_size(s->img_x, adam7_x0[r->pass], adam7_dx[r->pass]);
+         r->pass_y = png_pass_size(s->img_y, adam7_y0[r->pass], adam7_dy[r->pass]);
       }
+      if (r->pass_x && r->pass_y) break;
    }
-   return 1;
+   r->row = 0;
+   r->n = (r->pass_x * s->img_n * r->depth + 7) >> 3;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+// 1/2/4-bit samples are packed MSB first; unpack them to one byte each
+static void png_unpack_row(uint8 *dest, uint8 const *src, uint32 count, int depth, int scale)
 {
-   stbi *s = &z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i;
+   int mask = (1 << depth) - 1, bit = -1;
+   uint8 v = 0;
+   for (i=0; i < count; ++i, bit -= depth) {
+      if (bit < 0) { v = *src++; bit = 8 - depth; }
+      dest[i] = (uint8) (((v >> bit) & mask) * scale);
+   }
+}
+
+// 16-bit samples are big-endian; keep the high byte for 8-bit output
+static void png_reduce16_row(uint8 *dest, uint8 const *src, uint32 count)
+{
+   uint32 i;
+   for (i=0; i < count; ++i)
+      dest[i] = src[i*2];
+}
+
+static void png_native16_row(uint16 *dest, uint8 const *src, uint32 count)
+{
+   uint32 i;
+   for (i=0; i < count; ++i)
+      dest[i] = (uint16) ((src[i*2] << 8) | src[i*2+1]);
+}
+
+static void png_widen_row(uint16 *dest, uint8 const *src, uint32 count)
+{
+   uint32 i;
+   for (i=0; i < count; ++i)
+      dest[i] = (uint16) (src[i] * 257);
+}
 
-   // compute color-based transparency, assuming we've
-   // already got 255 as the alpha value in the output
-   assert(out_n == 2 || out_n == 4);
+static void png_palette_row(uint8 *dest, uint8 const *src, uint32 x, uint8 const *palette, int pal_img_n)
+{
+   uint32 i;
+   if (pal_img_n == 3) {
+      for (i=0; i < x; ++i, dest += 3) {
+         uint8 const *c = palette + src[i]*4;
+         dest[0] = c[0];
+         dest[1] = c[1];
+         dest[2] = c[2];
+      }
+   } else {
+      for (i=0; i < x; ++i, dest += 4)
+         memcpy(dest, palette + src[i]*4, 4);
+   }
+}
 
-   if (out_n == 2) {
-      for (i=0; i < pixel_count; ++i) {
-         p[1] = (p[0] == tc[0] ? 0 : 255);
-         p += 2;
+// color-based transparency: add an alpha channel that is 0 wherever
+// the pixel matches the tRNS color
+static void png_transparency_row(uint8 *dest, uint8 const *src, uint32 x, int img_n, uint8 const *tc)
+{
+   uint32 i;
+   if (img_n == 1) {
+      for (i=0; i < x; ++i, dest += 2) {
+         dest[0] = src[i];
+         dest[1] = (src[i] == tc[0] ? 0 : 255);
       }
    } else {
-      for (i=0; i < pixel_count; ++i) {
-         if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
-            p[3] = 0;
-         p += 4;
+      for (i=0; i < x; ++i, src += 3, dest += 4) {
+         dest[0] = src[0];
+         dest[1] = src[1];
+         dest[2] = src[2];
+         dest[3] = (src[0] == tc[0] && src[1] == tc[1] && src[2] == tc[2]) ? 0 : 255;
       }
    }
-   return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+// 16-bit samples have to be matched against the tRNS color at full
+// precision, so this does the sample stage as well
+static void png_transparency_row16(uint8 *dest, uint8 const *src, uint32 x, int img_n, uint16 const *tc, int out16)
 {
-   uint32 i, pixel_count = a->s.img_x * a->s.img_y;
-   uint8 *p, *temp_out, *orig = a->out;
+   uint16 *d16 = (uint16 *) dest;
+   uint32 i;
+   int k, v, opaque;
+   for (i=0; i < x; ++i) {
+      opaque = 0;
+      for (k=0; k < img_n; ++k, src += 2) {
+         v = (src[0] << 8) | src[1];
+         if (v != tc[k]) opaque = 1;
+         if (out16) *d16++ = (uint16) v; else *dest++ = src[0];
+      }
+      if (out16) *d16++ = opaque ? 65535 : 0; else *dest++ = opaque ? 255 : 0;
+   }
+}
 
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
+// scatter an interlaced pass's row to its pixel positions
+static void png_scatter_row(png_rows *r, uint8 const *src)
+{
+   stbi *s = &r->p->s;
+   uint32 i, stride = s->img_x * r->psize;
+   uint32 step = adam7_dx[r->pass] * r->psize;
+   uint8 *dest = r->p->out + (adam7_y0[r->pass] + r->row * adam7_dy[r->pass]) * stride
+                           + adam7_x0[r->pass] * r->psize;
+   int k;
+   for (i=0; i < r->pass_x; ++i, dest += step, src += r->psize)
+      for (k=0; k < r->psize; ++k)
+         dest[k] = src[k];
+}
 
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+// where the next stage writes: the destination if it's the last stage,
+// otherwise whichever scratch buffer isn't holding its input
+static uint8 *png_stage(png_rows *r, uint8 const *src, uint8 *dest, int *left)
+{
+   if (--*left == 0) return dest;
+   return src == r->buf[0] ? r->buf[1] : r->buf[0];
+}
 
-   if (pal_img_n == 3) {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p += 3;
+static int png_emit_row(png_rows *r, uint8 *raw)
+{
+   stbi *s = &r->p->s;
+   uint32 x = r->pass_x;
+   uint32 stride = x * r->psize;
+   uint8 *dest = r->passes > 1 ? r->line : r->p->out + r->row * stride;
+   uint8 *src, *t;
+   int left = r->stages;
+   int filter = *raw++;
+   if (filter > 4) return e("invalid filter","Corrupt PNG");
+   // if first row, use special filter that doesn't sample previous row
+   if (r->row == 0) filter = first_row_filter[filter];
+   if (r->direct) {
+      png_unfilter_row(dest, dest - stride, raw, filter, r->n, r->bpp);
+      return 1;
+   }
+   png_unfilter_row(r->cur, r->prior, raw, filter, r->n, r->bpp);
+   src = r->cur;
+   if (r->depth < 8) {
+      t = png_stage(r, src, dest, &left);
+      png_unpack_row(t, src, x * s->img_n, r->depth, r->pal_img_n ? 1 : depth_scale[r->depth]);
+      src = t;
+   } else if (r->depth == 16) {
+      t = png_stage(r, src, dest, &left);
+      if (r->tc16)
+         png_transparency_row16(t, src, x, s->img_n, r->tc16, r->out16);
+      else if (r->out16)
+         png_native16_row((uint16 *) t, src, x * s->img_n);
+      else
+         png_reduce16_row(t, src, x * s->img_n);
+      src = t;
+   }
+   if (r->pal_img_n || r->tc) {
+      t = png_stage(r, src, dest, &left);
+      if (r->pal_img_n)
+         png_palette_row(t, src, x, r->palette, r->pal_img_n);
+      else
+         png_transparency_row(t, src, x, s->img_n, r->tc);
+      src = t;
+   }
+   if (r->src_n != r->out_n) {
+      t = png_stage(r, src, dest, &left);
+      if (r->out16 && r->depth == 16)
+         convert_row16((uint16 *) t, (uint16 const *) src, r->src_n, r->out_n, x);
+      else
+         convert_row(t, src, r->src_n, r->out_n, x);
+      src = t;
+   }
+   if (r->out16 && r->depth != 16) {
+      t = png_stage(r, src, dest, &left);
+      png_widen_row((uint16 *) t, src, x * r->out_n);
+      src = t;
+   }
+   if (r->pack) {
+      t = png_stage(r, src, dest, &left);
+      pack_row(&r->pk, (uint16 *) t, src, r->out_n, x);
+      src = t;
+   }
+   if (r->passes > 1)
+      png_scatter_row(r, src);
+   else if (src != dest)
+      memcpy(dest, src, stride);
+   t = r->prior;
+   r->prior = r->cur;
+   r->cur = t;
+   return 1;
+}
+
+static int png_flush_rows(void *user, uint8 *data, int len)
+{
+   png_rows *r = (png_rows *) user;
+   int used = 0;
+   while (used < len) {
+      if (r->pass == r->passes) {
+         e("too much pixel data","Corrupt PNG");
+         return -1;
       }
-   } else {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p[3] = palette[n+3];
-         p += 4;
+      if ((uint32) (len - used) < r->n + 1) break;
+      if (!png_emit_row(r, data + used)) return -1;
+      used += r->n + 1;
+      if (++r->row == r->pass_y) {
+         ++r->pass;
+         png_begin_pass(r);
+      }
+   }
+   return used;
+}
+
+static int png_decode_rows(png *z, uint32 ioff, int req_comp, uint8 *palette, int pal_img_n, uint16 *tc16)
+{
+   stbi *s = &z->s;
+   png_rows r;
+   zbuf a;
+   uint32 raw_len, wlen, max_n, scratch;
+   uint8 *lines = NULL, tc[3];
+   int ok, k;
+
+   r.p = z;
+   r.depth = z->depth;
+   r.out16 = z->out16;
+   r.bpp = (s->img_n * r.depth + 7) >> 3;
+   r.palette = pal_img_n ? palette : NULL;
+   r.pal_img_n = pal_img_n;
+   r.tc = NULL;
+   r.tc16 = NULL;
+   if (tc16) {
+      if (r.depth == 16) {
+         r.tc16 = tc16;
+      } else {
+         // only the low 'depth' bits count; scale like the samples will be
+         for (k=0; k < s->img_n; ++k)
+            tc[k] = (uint8) ((tc16[k] & ((1 << r.depth) - 1)) * (r.depth == 8 ? 1 : depth_scale[r.depth]));
+         r.tc = tc;
       }
    }
-   free(a->out);
-   a->out = temp_out;
+   // interlaced passes arrive out of order, so do_png packs those at the end
+   r.pack = 0;
+   if (is_packed(req_comp)) {
+      if (!z->interlace) r.pack = req_comp;
+      req_comp = packed_comp(req_comp);
+   }
+   r.src_n = pal_img_n ? pal_img_n : s->img_n + (tc16 ? 1 : 0);
+   r.out_n = req_comp ? req_comp : r.src_n;
+   r.psize = r.pack ? 2 : r.out_n * (r.out16 ? 2 : 1);
+   r.stages = (r.depth != 8) + ((pal_img_n || r.tc) ? 1 : 0)
+            + (r.src_n != r.out_n) + (r.out16 && r.depth != 16) + (r.pack != 0);
+   r.passes = z->interlace ? 7 : 1;
+   r.direct = (r.stages == 0 && r.passes == 1);
+
+   z->out = (uint8 *) malloc(s->img_x * s->img_y * r.psize);
+   if (!z->out) return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   if (r.pack && !packer_init(&r.pk, r.pack, s->img_x)) return 0;
+
+   // raw size of all passes; the widest pass is always the full width
+   raw_len = 0;
+   for (r.pass=0; r.pass < r.passes; ++r.pass) {
+      png_begin_pass(&r);
+      if (r.pass < r.passes) raw_len += r.pass_y * (r.n + 1);
+   }
+   r.pass = 0;
+   png_begin_pass(&r);
+   max_n = (s->img_x * s->img_n * r.depth + 7) >> 3;
+
+   if (!r.direct) {
+      // two packed rows, then the stage buffers and the interlace line,
+      // each big enough for a row of 4 16-bit components
+      scratch = (s->img_x * 8 + 15) & ~15u;
+      lines = (uint8 *) malloc(((max_n + 15) & ~15u) * 2 + scratch * 3);
+      if (!lines) { if (r.pack) packer_free(&r.pk); return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
+      r.cur    = lines;
+      r.prior  = lines + ((max_n + 15) & ~15u);
+      r.buf[0] = r.prior + ((max_n + 15) & ~15u);
+      r.buf[1] = r.buf[0] + scratch;
+      r.line   = r.buf[1] + scratch;
+   }
+
+   // the window holds the 32K back-reference history plus at least one
+   // partial row; small images just get their exact inflated size
+   wlen = 65536 + max_n + 1;
+   if (wlen > raw_len) wlen = raw_len;
+   z->expanded = (uint8 *) malloc(wlen);
+   if (!z->expanded) {
+      free(lines);
+      if (r.pack) packer_free(&r.pk);
+      return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   }
+
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + ioff;
+   ok = do_zlib_windowed(&a, (char *) z->expanded, wlen, png_flush_rows, &r);
+   if (ok && (r.pass != r.passes || a.zout != a.zout_flushed))
+      ok = e("not enough pixels","Corrupt PNG");
+   free(lines);
+   free(z->expanded); z->expanded = NULL;
+   if (r.pack) packer_free(&r.pk);
+   if (!ok) return 0;
+
+   if (pal_img_n) s->img_n = pal_img_n; // record the actual colors we had
+   s->img_out_n = r.pack ? r.pack : r.out_n;
+   return 1;
+}
+
+// the CRC check for a chunk that has just been read; cdata/cpos are where
+// its data started, in memory or in the file
+static int png_chunk_crc(png *z, chunk c, uint8 const *cdata, long cpos, uint32 ioff)
+{
+   stbi *s = &z->s;
+   uint8 const *data = cdata;
+   #ifndef STBI_NO_STDIO
+   if (s->img_file)
+      // only IDAT data is still around, the rest has to be read again
+      data = c.type == PNG_TYPE('I','D','A','T') ? z->idata + ioff - c.length : NULL;
+   else
+   #endif
+   if (c.length > (uint32) (s->img_buffer_end - cdata)) return e("outofdata","Corrupt PNG");
+   if (!png_check_crc(s, c.type, data, c.length, cpos)) return e("bad CRC","Corrupt PNG");
    return 1;
 }
 
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
-   uint8 has_trans=0, tc[3];
+   uint8 has_trans=0;
+   uint16 tc[3];
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
    int first=1,k;
    stbi *s = &z->s;
 
+   z->verify_crc = png_crc_check;
    if (!check_png_header(s)) return 0;
 
    if (scan == SCAN_type) return 1;
 
    for(;;first=0) {
       chunk c = get_chunk_header(s);
+      uint8 *cdata = s->img_buffer;
+      long cpos = 0;
+      #ifndef STBI_NO_STDIO
+      if (z->verify_crc && s->img_file) cpos = ftell(s->img_file);
+      #endif
       if (first && c.type != PNG_TYPE('I','H','D','R'))
          return e("first not IHDR","Corrupt PNG");
       switch (c.type) {
          case PNG_TYPE('I','H','D','R'): {
-            int depth,color,interlace,comp,filter;
+            int depth,color,comp,filter;
             if (!first) return e("multiple IHDR","Corrupt PNG");
             if (c.length != 13) return e("bad IHDR len","Corrupt PNG");
             s->img_x = get32(s); if (s->img_x > (1 << 24)) return e("too large","Very large image (corrupt?)");
             s->img_y = get32(s); if (s->img_y > (1 << 24)) return e("too large","Very large image (corrupt?)");
-            depth = get8(s);  if (depth != 8)        return e("8bit only","PNG not supported: 8-bit only");
+            depth = get8(s);  if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) return e("bad depth","Corrupt PNG");
             color = get8(s);  if (color > 6)         return e("bad ctype","Corrupt PNG");
             if (color == 3) pal_img_n = 3; else if (color & 1) return e("bad ctype","Corrupt PNG");
+            // only grey and palette images come in less than 8 bits, and palettes never in 16
+            if (color == 3 ? depth == 16 : (color != 0 && depth < 8)) return e("bad depth","Corrupt PNG");
             comp  = get8(s);  if (comp) return e("bad comp method","Corrupt PNG");
             filter= get8(s);  if (filter) return e("bad filter method","Corrupt PNG");
-            interlace = get8(s); if (interlace) return e("interlaced","PNG not supported: interlaced mode");
+            z->interlace = get8(s); if (z->interlace > 1) return e("bad interlace method","Corrupt PNG");
+            z->depth = depth;
             if (!s->img_x || !s->img_y) return e("0-pixel image","Corrupt PNG");
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
-               if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
+               if ((1 << 30) / s->img_x / s->img_n / (depth == 16 ? 2 : 1) < s->img_y) return ec("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
                if (scan == SCAN_header) return 1;
             } else {
                // if paletted, then pal_n is our final components, and
@@ -2279,7 +3706,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (c.length != (uint32) s->img_n*2) return e("bad tRNS len","Corrupt PNG");
                has_trans = 1;
                for (k=0; k < s->img_n; ++k)
-                  tc[k] = (uint8) get16(s); // non 8-bit images will be larger
+                  tc[k] = (uint16) get16(s); // reduced to the sample depth when decoding
             }
             break;
          }
@@ -2292,7 +3719,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
+               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return ec("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
                z->idata = p;
             }
             #ifndef STBI_NO_STDIO
@@ -2303,6 +3730,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             else
             #endif
             {
+               if (c.length > (uint32) (s->img_buffer_end - s->img_buffer)) return e("outofdata","Corrupt PNG");
                memcpy(z->idata+ioff, s->img_buffer, c.length);
                s->img_buffer += c.length;
             }
@@ -2311,28 +3739,12 @@ static int parse_png_file(png *z, int scan, int req_comp)
          }
 
          case PNG_TYPE('I','E','N','D'): {
-            uint32 raw_len;
             if (scan != SCAN_load) return 1;
+            if (z->verify_crc && !png_chunk_crc(z, c, cdata, cpos, ioff)) return 0;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc((char *) z->idata, ioff, (int *) &raw_len);
-            if (z->expanded == NULL) return 0; // zlib should set error
+            if (!png_decode_rows(z, ioff, req_comp, palette, pal_img_n, has_trans ? tc : NULL))
+               return 0;
             free(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n)) return 0;
-            if (has_trans)
-               if (!compute_transparency(z, tc, s->img_out_n)) return 0;
-            if (pal_img_n) {
-               // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
-               if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!expand_palette(z, palette, pal_len, s->img_out_n))
-                  return 0;
-            }
-            free(z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -2340,35 +3752,42 @@ static int parse_png_file(png *z, int scan, int req_comp)
             // if critical, fail
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               static IMAGE_THREAD_LOCAL char invalid_chunk[] = "XXXX chunk not known";
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
                invalid_chunk[3] = (uint8) (c.type >>  0);
                #endif
-               return e(invalid_chunk, "PNG not supported: unknown chunk type");
+               return ec(invalid_chunk, "PNG not supported: unknown chunk type", STBI_ERROR_UNSUPPORTED);
             }
             skip(s, c.length);
             break;
       }
-      // end of chunk, read and skip CRC
-      get32(s);
+      // end of chunk, check or just skip the CRC
+      if (z->verify_crc) {
+         if (!png_chunk_crc(z, c, cdata, cpos, ioff)) return 0;
+      } else
+         get32(s);
    }
 }
 
-static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
+static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp, int out16)
 {
    unsigned char *result=NULL;
    p->expanded = NULL;
    p->idata = NULL;
    p->out = NULL;
-   if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
+   p->out16 = out16;
+   if (req_comp < 0 || req_comp > STBI_rgba4444 || (out16 && is_packed(req_comp)))
+      return epucc("bad req_comp", "Internal error", STBI_ERROR_INVALID_ARGUMENT);
    if (parse_png_file(p, SCAN_load, req_comp)) {
       result = p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s.img_out_n) {
-         result = convert_format(result, p->s.img_out_n, req_comp, p->s.img_x, p->s.img_y);
+         if (is_packed(req_comp))
+            result = pack_format(result, p->s.img_out_n, req_comp, p->s.img_x, p->s.img_y);
+         else
+            result = convert_format(result, p->s.img_out_n, req_comp, p->s.img_x, p->s.img_y);
          p->s.img_out_n = req_comp;
          if (result == NULL) return result;
       }
@@ -2388,7 +3807,7 @@ unsigned char *stbi_png_load_from_file(FILE *f, int *x, int *y, int *comp, int r
 {
    png p;
    start_file(&p.s, f);
-   return do_png(&p, x,y,comp,req_comp);
+   return do_png(&p, x,y,comp,req_comp,0);
 }
 
 unsigned char *stbi_png_load(char const *filename, int *x, int *y, int *comp, int req_comp)
@@ -2406,35 +3825,98 @@ unsigned char *stbi_png_load_from_memory(stbi_uc const *buffer, int len, int *x,
 {
    png p;
    start_mem(&p.s, buffer,len);
-   return do_png(&p, x,y,comp,req_comp);
+   return do_png(&p, x,y,comp,req_comp,0);
 }
 
 #ifndef STBI_NO_STDIO
-int stbi_png_test_file(FILE *f)
+stbi_us *stbi_png_load_16_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    png p;
-   int n,r;
-   n = ftell(f);
    start_file(&p.s, f);
-   r = parse_png_file(&p, SCAN_type,STBI_default);
-   fseek(f,n,SEEK_SET);
-   return r;
+   return (stbi_us *) do_png(&p, x,y,comp,req_comp,1);
 }
-#endif
 
-int stbi_png_test_memory(stbi_uc const *buffer, int len)
+stbi_us *stbi_png_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   png p;
-   start_mem(&p.s, buffer, len);
-   return parse_png_file(&p, SCAN_type,STBI_default);
-}
+   stbi_us *data;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return NULL;
+   data = stbi_png_load_16_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return data;
+}
+#endif
+
+stbi_us *stbi_png_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   png p;
+   start_mem(&p.s, buffer,len);
+   return (stbi_us *) do_png(&p, x,y,comp,req_comp,1);
+}
 
-// TODO: load header from png
 #ifndef STBI_NO_STDIO
-extern int      stbi_png_info             (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_png_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
+int stbi_png_test_file(FILE *f)
+{
+   png p;
+   int n,r;
+   n = ftell(f);
+   start_file(&p.s, f);
+   r = parse_png_file(&p, SCAN_type,STBI_default);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+#endif
+
+int stbi_png_test_memory(stbi_uc const *buffer, int len)
+{
+   png p;
+   start_mem(&p.s, buffer, len);
+   return parse_png_file(&p, SCAN_type,STBI_default);
+}
+
+// SCAN_header returns at IHDR, or for paletted images at the first
+// tRNS/IDAT chunk, before any IDAT data is read or inflated
+static int png_info(png *p, int *x, int *y, int *comp)
+{
+   p->expanded = NULL;
+   p->idata = NULL;
+   p->out = NULL;
+   if (!parse_png_file(p, SCAN_header, 0)) return 0;
+   if (x) *x = p->s.img_x;
+   if (y) *y = p->s.img_y;
+   if (comp) *comp = p->s.img_n;
+   return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_png_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_png_info_from_file(f,x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_png_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   png p;
+   int n,r;
+   n = ftell(f);
+   start_file(&p.s, f);
+   r = png_info(&p,x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
 #endif
-extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_png_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   png p;
+   start_mem(&p.s, buffer, len);
+   return png_info(&p,x,y,comp);
+}
 
 // Microsoft/Windows BMP image
 
@@ -2511,9 +3993,36 @@ static int shiftsigned(int v, int shift, int bits)
    return result;
 }
 
+// one bit-field channel of a 16/32-bit BMP, as a table: shiftsigned only
+// ever sees the 8 bits of the field from max(lowest bit, shift) up
+typedef struct
+{
+   uint32 mask;
+   int low;
+   uint8 table[256];
+} bmp_field;
+
+static void bmp_field_init(bmp_field *f, uint32 mask, int count)
+{
+   int i, shift = high_bit(mask)-7;
+   f->mask = mask;
+   f->low = high_bit(mask & (~mask + 1));
+   if (f->low < shift) f->low = shift;
+   for (i=0; i < 256; ++i)
+      f->table[i] = (uint8) shiftsigned((int) (((uint32) i << f->low) & mask), shift, count);
+}
+
+__forceinline static void bmp_fields(uint8 *o, uint32 v, bmp_field const *f, int target, int alpha)
+{
+   o[0] = f[0].table[(v & f[0].mask) >> f[0].low];
+   o[1] = f[1].table[(v & f[1].mask) >> f[1].low];
+   o[2] = f[2].table[(v & f[2].mask) >> f[2].low];
+   if (target == 4) o[3] = alpha ? f[3].table[(v & f[3].mask) >> f[3].low] : 255;
+}
+
 static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
-   uint8 *out;
+   uint8 *out, *row;
    unsigned int mr=0,mg=0,mb=0,ma=0;
    stbi_uc pal[256][4];
    int psize=0,i,j,compress=0,width;
@@ -2524,7 +4033,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    get16le(s); // discard reserved
    offset = get32le(s);
    hsz = get32le(s);
-   if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return epuc("unknown BMP", "BMP type not supported: unknown");
+   if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return epucc("unknown BMP", "BMP type not supported: unknown", STBI_ERROR_UNSUPPORTED);
    failure_reason = "bad BMP";
    if (hsz == 12) {
       s->img_x = get16le(s);
@@ -2535,7 +4044,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    }
    if (get16le(s) != 1) return 0;
    bpp = get16le(s);
-   if (bpp == 1) return epuc("monochrome", "BMP type not supported: 1-bit");
+   if (bpp == 1) return epucc("monochrome", "BMP type not supported: 1-bit", STBI_ERROR_UNSUPPORTED);
    flip_vertically = ((int) s->img_y) > 0;
    s->img_y = abs((int) s->img_y);
    if (hsz == 12) {
@@ -2543,7 +4052,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
          psize = (offset - 14 - 24) / 3;
    } else {
       compress = get32le(s);
-      if (compress == 1 || compress == 2) return epuc("BMP RLE", "BMP type not supported: RLE");
+      if (compress == 1 || compress == 2) return epucc("BMP RLE", "BMP type not supported: RLE", STBI_ERROR_UNSUPPORTED);
       get32le(s); // discard sizeof
       get32le(s); // discard hres
       get32le(s); // discard vres
@@ -2598,11 +4107,15 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       target = req_comp;
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
-   out = (stbi_uc *) malloc(target * s->img_x * s->img_y);
-   if (!out) return epuc("outofmem", "Out of memory");
+   out = (stbi_uc *) malloc((size_t) target * s->img_x * s->img_y);
+   if (!out) return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   // rows are read whole and land directly where the flip puts them
+   #define BMP_ROW(j)  (out + (size_t) (flip_vertically ? s->img_y-1-(j) : (uint) (j)) * s->img_x * target)
    if (bpp < 16) {
-      int z=0;
       if (psize == 0 || psize > 256) { free(out); return epuc("invalid", "Corrupt BMP"); }
+      // indices past the palette read as opaque black
+      for (i=0; i < 256; ++i)
+         pal[i][0] = pal[i][1] = pal[i][2] = 0, pal[i][3] = 255;
       for (i=0; i < psize; ++i) {
          pal[i][2] = get8(s);
          pal[i][1] = get8(s);
@@ -2615,29 +4128,19 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       else if (bpp == 8) width = s->img_x;
       else { free(out); return epuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
+      row = (uint8 *) malloc(width + pad);
+      if (!row) { free(out); return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
       for (j=0; j < (int) s->img_y; ++j) {
-         for (i=0; i < (int) s->img_x; i += 2) {
-            int v=get8(s),v2=0;
-            if (bpp == 4) {
-               v2 = v & 15;
-               v >>= 4;
-            }
-            out[z++] = pal[v][0];
-            out[z++] = pal[v][1];
-            out[z++] = pal[v][2];
-            if (target == 4) out[z++] = 255;
-            if (i+1 == (int) s->img_x) break;
-            v = (bpp == 8) ? get8(s) : v2;
-            out[z++] = pal[v][0];
-            out[z++] = pal[v][1];
-            out[z++] = pal[v][2];
-            if (target == 4) out[z++] = 255;
+         uint8 *o = BMP_ROW(j);
+         getn(s, row, width + pad);
+         for (i=0; i < (int) s->img_x; ++i, o += target) {
+            stbi_uc const *c = pal[bpp == 8 ? row[i] : i & 1 ? row[i>>1] & 15 : row[i>>1] >> 4];
+            o[0] = c[0], o[1] = c[1], o[2] = c[2];
+            if (target == 4) o[3] = c[3];
          }
-         skip(s, pad);
       }
    } else {
-      int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
-      int z = 0;
+      bmp_field f[4];
       int easy=0;
       skip(s, offset - 14 - hsz);
       if (bpp == 24) width = 3 * s->img_x;
@@ -2649,50 +4152,39 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       } else if (bpp == 32) {
          if (mb == 0xff && mg == 0xff00 && mr == 0xff000000 && ma == 0xff000000)
             easy = 2;
+         // the usual BGRA/BGRX layout: the fields are whole bytes
+         else if (mb == 0xff && mg == 0xff00 && mr == 0xff0000)
+            easy = ma == 0xff000000 ? 2 : ma == 0 ? 3 : 0;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) return epuc("bad masks", "Corrupt BMP");
-         // right shift amt to put high bit in position #7
-         rshift = high_bit(mr)-7; rcount = bitcount(mr);
-         gshift = high_bit(mg)-7; gcount = bitcount(mr);
-         bshift = high_bit(mb)-7; bcount = bitcount(mr);
-         ashift = high_bit(ma)-7; acount = bitcount(mr);
+         if (!mr || !mg || !mb) { free(out); return epuc("bad masks", "Corrupt BMP"); }
+         bmp_field_init(&f[0], mr, bitcount(mr));
+         bmp_field_init(&f[1], mg, bitcount(mr));
+         bmp_field_init(&f[2], mb, bitcount(mr));
+         if (ma) bmp_field_init(&f[3], ma, bitcount(mr));
       }
+      if (bpp == 24) width += pad;
+      else width = (bpp == 16 ? 2 : 4) * s->img_x + pad;
+      row = (uint8 *) malloc(width);
+      if (!row) { free(out); return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY); }
       for (j=0; j < (int) s->img_y; ++j) {
+         uint8 *o = BMP_ROW(j);
+         getn(s, row, width);
          if (easy) {
-            for (i=0; i < (int) s->img_x; ++i) {
-               int a;
-               out[z+2] = get8(s);
-               out[z+1] = get8(s);
-               out[z+0] = get8(s);
-               z += 3;
-               a = (easy == 2 ? get8(s) : 255);
-               if (target == 4) out[z++] = a;
-            }
+            swap_rb_row(o, row, easy == 1 ? 3 : 4, target, s->img_x, easy == 3);
+         } else if (bpp == 16) {
+            for (i=0; i < (int) s->img_x; ++i, o += target)
+               bmp_fields(o, row[2*i] + (row[2*i+1] << 8), f, target, ma != 0);
          } else {
-            for (i=0; i < (int) s->img_x; ++i) {
-               uint32 v = (bpp == 16 ? get16le(s) : get32le(s));
-               int a;
-               out[z++] = shiftsigned(v & mr, rshift, rcount);
-               out[z++] = shiftsigned(v & mg, gshift, gcount);
-               out[z++] = shiftsigned(v & mb, bshift, bcount);
-               a = (ma ? shiftsigned(v & ma, ashift, acount) : 255);
-               if (target == 4) out[z++] = a;
+            for (i=0; i < (int) s->img_x; ++i, o += target) {
+               uint8 const *p = row + 4*i;
+               bmp_fields(o, p[0] + (p[1] << 8) + (p[2] << 16) + ((uint32) p[3] << 24), f, target, ma != 0);
             }
          }
-         skip(s, pad);
-      }
-   }
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i], p1[i] = p2[i], p2[i] = t;
-         }
       }
    }
+   #undef BMP_ROW
+   free(row);
 
    if (req_comp && req_comp != target) {
       out = convert_format(out, target, req_comp, s->img_x, s->img_y);
@@ -2731,6 +4223,68 @@ stbi_uc *stbi_bmp_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return bmp_load(&s, x,y,comp,req_comp);
 }
 
+// header-only: mirrors the header parse in bmp_load and stops before the palette
+static int bmp_info(stbi *s, int *x, int *y, int *comp)
+{
+   int bpp, hsz, compress=0, ma=0;
+   if (get8(s) != 'B' || get8(s) != 'M') return e("not BMP", "Corrupt BMP");
+   skip(s, 8); // discard filesize, reserved
+   get32le(s); // discard offset
+   hsz = get32le(s);
+   if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return ec("unknown BMP", "BMP type not supported: unknown", STBI_ERROR_UNSUPPORTED);
+   if (hsz == 12) {
+      s->img_x = get16le(s);
+      s->img_y = get16le(s);
+   } else {
+      s->img_x = get32le(s);
+      s->img_y = get32le(s);
+   }
+   if (get16le(s) != 1) return e("bad BMP", "bad BMP");
+   bpp = get16le(s);
+   if (bpp == 1) return ec("monochrome", "BMP type not supported: 1-bit", STBI_ERROR_UNSUPPORTED);
+   if (hsz != 12) {
+      compress = get32le(s);
+      if (compress == 1 || compress == 2) return ec("BMP RLE", "BMP type not supported: RLE", STBI_ERROR_UNSUPPORTED);
+      if (hsz == 108) {
+         skip(s, 20 + 12); // discard sizeof, res, colors, r/g/b masks
+         ma = get32le(s);
+      }
+   }
+   if (x) *x = s->img_x;
+   if (y) *y = abs((int) s->img_y);
+   if (comp) *comp = ma ? 4 : 3;
+   return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int      stbi_bmp_info             (char const *filename,           int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_bmp_info_from_file(f, x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int      stbi_bmp_info_from_file   (FILE *f,                  int *x, int *y, int *comp)
+{
+   stbi s;
+   int r,n = ftell(f);
+   start_file(&s, f);
+   r = bmp_info(&s, x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+#endif
+
+int      stbi_bmp_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   start_mem(&s, buffer, len);
+   return bmp_info(&s, x,y,comp);
+}
+
 // Targa Truevision - TGA
 // by Jonathan Dummer
 
@@ -2773,6 +4327,39 @@ int      stbi_tga_test_memory      (stbi_uc const *buffer, int len)
    return tga_test(&s);
 }
 
+//	raw TGA pixels to req_comp components: grey and grey,alpha go through
+//	convert_row, BGR(A) through swap_rb_row, and indices are copies out of
+//	a palette that was converted to req_comp already
+static void tga_pixels(unsigned char *dest, unsigned char const *src, int n, int req_comp, int count, unsigned char const *palette, int palette_len)
+{
+	unsigned char stage[128*4];
+	int i, k;
+	if( palette )
+	{
+		for( i = 0; i < count; ++i )
+		{
+			//	invalid indices read the first entry
+			k = src[i] < palette_len ? src[i] : 0;
+			memcpy( dest + i*req_comp, palette + k*req_comp, req_comp );
+		}
+	} else if( n <= 2 )
+	{
+		if( n == req_comp ) memcpy( dest, src, count*n );
+		else convert_row( dest, src, n, req_comp, count );
+	} else if( req_comp >= 3 )
+	{
+		swap_rb_row( dest, src, n, req_comp, count, 0 );
+	} else
+	{
+		for( i = 0; i < count; i += k )
+		{
+			k = count - i < 128 ? count - i : 128;
+			swap_rb_row( stage, src + i*n, n, n, k, 0 );
+			convert_row( dest + i*req_comp, stage, n, req_comp, k );
+		}
+	}
+}
+
 static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
 	//	read in the TGA header stuff
@@ -2792,12 +4379,10 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	//	image data
 	unsigned char *tga_data;
 	unsigned char *tga_palette = NULL;
-	int i, j;
+	unsigned char *tga_row;
+	int i, j, n, pixel_size, run;
+	int total = tga_width * tga_height;
 	unsigned char raw_data[4];
-	unsigned char trans_data[] = { 0,0,0,0 };
-	int RLE_count = 0;
-	int RLE_repeating = 0;
-	int read_next_pixel = 1;
 	//	do a tiny bit of precessing
 	if( tga_image_type >= 8 )
 	{
@@ -2822,7 +4407,15 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	if( tga_indexed )
 	{
 		tga_bits_per_pixel = tga_palette_bits;
+		if( (tga_bits_per_pixel != 8) && (tga_bits_per_pixel != 16) &&
+			(tga_bits_per_pixel != 24) && (tga_bits_per_pixel != 32) )
+		{
+			return epuc("bad TGA", "Corrupt TGA");
+		}
 	}
+	n = tga_bits_per_pixel / 8;
+	//	each pixel in the file is an index byte, or the colour itself
+	pixel_size = tga_indexed ? 1 : n;
 
 	//	tga info
 	*x = tga_width;
@@ -2830,151 +4423,101 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	if( (req_comp < 1) || (req_comp > 4) )
 	{
 		//	just use whatever the file was
-		req_comp = tga_bits_per_pixel / 8;
+		req_comp = n;
 		*comp = req_comp;
 	} else
 	{
 		//	force a new number of components
-		*comp = tga_bits_per_pixel/8;
+		*comp = n;
+	}
+	tga_data = (unsigned char*)malloc( (size_t)total * req_comp );
+	//	a row, or the longest RLE packet
+	tga_row = (unsigned char*)malloc( (tga_width > 128 ? tga_width : 128) * pixel_size );
+	if( (tga_data == NULL) || (tga_row == NULL) )
+	{
+		free( tga_data );
+		free( tga_row );
+		return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
 	}
-	tga_data = (unsigned char*)malloc( tga_width * tga_height * req_comp );
 
 	//	skip to the data's starting position (offset usually = 0)
 	skip(s, tga_offset );
 	//	do I need to load a palette?
 	if( tga_indexed )
 	{
+		unsigned char *raw_palette = (unsigned char*)malloc( tga_palette_len * n + 1 );
 		//	any data to skip? (offset usually = 0)
 		skip(s, tga_palette_start );
-		//	load the palette
-		tga_palette = (unsigned char*)malloc( tga_palette_len * tga_palette_bits / 8 );
-		getn(s, tga_palette, tga_palette_len * tga_palette_bits / 8 );
+		//	load the palette, and take it to req_comp once rather than
+		//	once per pixel (an empty one gets a single black entry)
+		tga_palette = (unsigned char*)calloc( tga_palette_len + 1, req_comp );
+		if( (raw_palette == NULL) || (tga_palette == NULL) )
+		{
+			free( raw_palette );
+			free( tga_palette );
+			free( tga_row );
+			free( tga_data );
+			return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+		}
+		getn(s, raw_palette, tga_palette_len * n );
+		tga_pixels( tga_palette, raw_palette, n, req_comp, tga_palette_len, NULL, 0 );
+		free( raw_palette );
 	}
 	//	load the data
-	for( i = 0; i < tga_width * tga_height; ++i )
+	if( !tga_is_RLE )
 	{
-		//	if I'm in RLE mode, do I need to get a RLE chunk?
-		if( tga_is_RLE )
-		{
-			if( RLE_count == 0 )
-			{
-				//	yep, get the next byte as a RLE command
-				int RLE_cmd = get8u(s);
-				RLE_count = 1 + (RLE_cmd & 127);
-				RLE_repeating = RLE_cmd >> 7;
-				read_next_pixel = 1;
-			} else if( !RLE_repeating )
-			{
-				read_next_pixel = 1;
-			}
-		} else
+		//	a row at a time, straight to where the flip would put it
+		for( j = 0; j < tga_height; ++j )
 		{
-			read_next_pixel = 1;
+			getn( s, tga_row, tga_width * pixel_size );
+			tga_pixels( tga_data + (size_t)(tga_inverted ? tga_height - 1 - j : j) * tga_width * req_comp,
+				tga_row, n, req_comp, tga_width, tga_palette, tga_palette_len );
 		}
-		//	OK, if I need to read a pixel, do it now
-		if( read_next_pixel )
+	} else
+	{
+		//	packets run across rows, so this fills the image front to back
+		for( i = 0; i < total; i += run )
 		{
-			//	load however much data we did have
-			if( tga_indexed )
+			int RLE_cmd = get8u(s);
+			run = 1 + (RLE_cmd & 127);
+			if( run > total - i ) run = total - i;
+			if( RLE_cmd >> 7 )
 			{
-				//	read in 1 byte, then perform the lookup
-				int pal_idx = get8u(s);
-				if( pal_idx >= tga_palette_len )
+				//	one pixel, repeated: convert it once then fill
+				unsigned char *p = tga_data + (size_t)i * req_comp;
+				getn( s, raw_data, pixel_size );
+				tga_pixels( p, raw_data, n, req_comp, 1, tga_palette, tga_palette_len );
+				if( req_comp == 1 )
 				{
-					//	invalid index
-					pal_idx = 0;
-				}
-				pal_idx *= tga_bits_per_pixel / 8;
-				for( j = 0; j*8 < tga_bits_per_pixel; ++j )
+					memset( p + 1, p[0], run - 1 );
+				} else
 				{
-					raw_data[j] = tga_palette[pal_idx+j];
+					for( j = 1; j < run; j *= 2 )
+					{
+						memcpy( p + j*req_comp, p, (j*2 <= run ? j : run - j) * req_comp );
+					}
 				}
 			} else
 			{
-				//	read in the data raw
-				for( j = 0; j*8 < tga_bits_per_pixel; ++j )
-				{
-					raw_data[j] = get8u(s);
-				}
-			}
-			//	convert raw to the intermediate format
-			switch( tga_bits_per_pixel )
-			{
-			case 8:
-				//	Luminous => RGBA
-				trans_data[0] = raw_data[0];
-				trans_data[1] = raw_data[0];
-				trans_data[2] = raw_data[0];
-				trans_data[3] = 255;
-				break;
-			case 16:
-				//	Luminous,Alpha => RGBA
-				trans_data[0] = raw_data[0];
-				trans_data[1] = raw_data[0];
-				trans_data[2] = raw_data[0];
-				trans_data[3] = raw_data[1];
-				break;
-			case 24:
-				//	BGR => RGBA
-				trans_data[0] = raw_data[2];
-				trans_data[1] = raw_data[1];
-				trans_data[2] = raw_data[0];
-				trans_data[3] = 255;
-				break;
-			case 32:
-				//	BGRA => RGBA
-				trans_data[0] = raw_data[2];
-				trans_data[1] = raw_data[1];
-				trans_data[2] = raw_data[0];
-				trans_data[3] = raw_data[3];
-				break;
+				getn( s, tga_row, run * pixel_size );
+				tga_pixels( tga_data + (size_t)i * req_comp, tga_row, n, req_comp, run, tga_palette, tga_palette_len );
 			}
-			//	clear the reading flag for the next pixel
-			read_next_pixel = 0;
-		} // end of reading a pixel
-		//	convert to final format
-		switch( req_comp )
-		{
-		case 1:
-			//	RGBA => Luminance
-			tga_data[i*req_comp+0] = compute_y(trans_data[0],trans_data[1],trans_data[2]);
-			break;
-		case 2:
-			//	RGBA => Luminance,Alpha
-			tga_data[i*req_comp+0] = compute_y(trans_data[0],trans_data[1],trans_data[2]);
-			tga_data[i*req_comp+1] = trans_data[3];
-			break;
-		case 3:
-			//	RGBA => RGB
-			tga_data[i*req_comp+0] = trans_data[0];
-			tga_data[i*req_comp+1] = trans_data[1];
-			tga_data[i*req_comp+2] = trans_data[2];
-			break;
-		case 4:
-			//	RGBA => RGBA
-			tga_data[i*req_comp+0] = trans_data[0];
-			tga_data[i*req_comp+1] = trans_data[1];
-			tga_data[i*req_comp+2] = trans_data[2];
-			tga_data[i*req_comp+3] = trans_data[3];
-			break;
 		}
-		//	in case we're in RLE mode, keep counting down
-		--RLE_count;
-	}
-	//	do I need to invert the image?
-	if( tga_inverted )
-	{
-		for( j = 0; j*2 < tga_height; ++j )
+		//	do I need to invert the image?
+		if( tga_inverted )
 		{
-			int index1 = j * tga_width * req_comp;
-			int index2 = (tga_height - 1 - j) * tga_width * req_comp;
-			for( i = tga_width * req_comp; i > 0; --i )
+			for( j = 0; j*2 < tga_height; ++j )
 			{
-				unsigned char temp = tga_data[index1];
-				tga_data[index1] = tga_data[index2];
-				tga_data[index2] = temp;
-				++index1;
-				++index2;
+				size_t index1 = (size_t)j * tga_width * req_comp;
+				size_t index2 = (size_t)(tga_height - 1 - j) * tga_width * req_comp;
+				for( i = tga_width * req_comp; i > 0; --i )
+				{
+					unsigned char temp = tga_data[index1];
+					tga_data[index1] = tga_data[index2];
+					tga_data[index2] = temp;
+					++index1;
+					++index2;
+				}
 			}
 		}
 	}
@@ -2983,6 +4526,7 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	{
 		free( tga_palette );
 	}
+	free( tga_row );
 	//	the things I do to get rid of an error message, and yet keep
 	//	Microsoft's C compilers happy... [8^(
 	tga_palette_start = tga_palette_len = tga_palette_bits =
@@ -3017,6 +4561,64 @@ stbi_uc *stbi_tga_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return tga_load(&s, x,y,comp,req_comp);
 }
 
+static int tga_info(stbi *s, int *x, int *y, int *comp)
+{
+	int tga_w, tga_h, tga_bits;
+	int tga_indexed, tga_image_type, tga_palette_bits;
+	get8u(s);						//	discard Offset
+	tga_indexed = get8u(s);			//	color type
+	tga_image_type = get8u(s);		//	image type
+	if( tga_image_type >= 8 ) tga_image_type -= 8;	//	RLE flag doesn't matter here
+	skip(s, 4);						//	discard palette start, length
+	tga_palette_bits = get8u(s);
+	skip(s, 4);						//	discard x, y origin
+	tga_w = get16le(s);
+	tga_h = get16le(s);
+	tga_bits = get8u(s);
+	if( (tga_w < 1) || (tga_h < 1) ||
+		(tga_image_type < 1) || (tga_image_type > 3) ||
+		((tga_bits != 8) && (tga_bits != 16) &&
+		(tga_bits != 24) && (tga_bits != 32)) )
+	{
+		return e("bad TGA", "Corrupt TGA");
+	}
+	//	same rule as tga_load: paletted images report the palette depth
+	if( tga_indexed ) tga_bits = tga_palette_bits;
+	if (x) *x = tga_w;
+	if (y) *y = tga_h;
+	if (comp) *comp = tga_bits / 8;
+	return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int      stbi_tga_info             (char const *filename,           int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_tga_info_from_file(f, x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int      stbi_tga_info_from_file   (FILE *f,                  int *x, int *y, int *comp)
+{
+   stbi s;
+   int r,n = ftell(f);
+   start_file(&s, f);
+   r = tga_info(&s, x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+#endif
+
+int      stbi_tga_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   start_mem(&s, buffer, len);
+   return tga_info(&s, x,y,comp);
+}
+
 
 // *************************************************************************************************
 // Photoshop PSD loader -- PD by Thatcher Ulrich, integration by Nicholas Schulz, tweaked by STB
@@ -3046,13 +4648,161 @@ int stbi_psd_test_memory(stbi_uc const *buffer, int len)
    return psd_test(&s);
 }
 
+// RLE as used by .PSD and .TIFF
+// Loop until you get the number of unpacked bytes you are expecting:
+//     Read the next source byte into n.
+//     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
+//     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
+//     Else if n is 128, noop.
+// Endloop
+// whatever the input doesn't cover is left 0, as reading past the end did
+static void psd_unpack(uint8 *out, int out_len, uint8 const *in, int in_len)
+{
+	uint8 const *end = in + in_len;
+	int count = 0, len, n, got;
+	while (count < out_len && in < end) {
+		len = *in++;
+		if (len == 128) {
+			// No-op.
+			continue;
+		}
+		n = len < 128 ? len + 1 : 257 - len;
+		if (n > out_len - count) n = out_len - count;
+		if (len < 128) {
+			// Copy next len+1 bytes literally.
+			got = n < end - in ? n : (int) (end - in);
+			memcpy(out + count, in, got);
+			memset(out + count + got, 0, n - got);
+			in += got;
+		} else {
+			// Next -len+1 bytes in the dest are replicated from next source byte.
+			// (Interpret len as a negative 8-bit int.)
+			memset(out + count, in < end ? *in++ : 0, n);
+		}
+		count += n;
+	}
+	if (count < out_len)
+		memset(out + count, 0, out_len - count);
+}
+
+#ifdef STBI_SSE2
+// 16 samples of a channel as bytes: 16-bit samples are big-endian, so the
+// high byte is the first of each pair
+static __m128i psd_samples(uint8 const *p, int depth)
+{
+	__m128i lo = _mm_set1_epi16(0xff);
+	if (depth == 8) return _mm_loadu_si128((__m128i const *) p);
+	return _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((__m128i const *) p), lo),
+	                        _mm_and_si128(_mm_loadu_si128((__m128i const *) (p + 16)), lo));
+}
+#endif
+
+typedef struct
+{
+	uint8 *out;
+	uint8 const *plane[4];	// NULL for channels the file doesn't have
+	int depth, first, count;
+} psd_merge_job;
+
+// planar channels to interleaved RGBA for pixels first..first+count-1;
+// missing colour channels are 0 and a missing alpha 255
+static void psd_merge(void *job)
+{
+	psd_merge_job *j = (psd_merge_job *) job;
+	int bytes = j->depth / 8, c, i = 0;
+	uint8 *out = j->out + (size_t) j->first * 4;
+	uint8 const *plane[4];
+	for (c = 0; c < 4; c++)
+		plane[c] = j->plane[c] ? j->plane[c] + (size_t) j->first * bytes : NULL;
+#ifdef STBI_SSE2
+	for (; i + 16 <= j->count; i += 16) {
+		__m128i v[4], rg, ba;
+		for (c = 0; c < 4; c++)
+			v[c] = plane[c] ? psd_samples(plane[c] + i * bytes, j->depth) : _mm_set1_epi8(c == 3 ? -1 : 0);
+		rg = _mm_unpacklo_epi8(v[0], v[1]);
+		ba = _mm_unpacklo_epi8(v[2], v[3]);
+		_mm_storeu_si128((__m128i *) (out + i*4),      _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i *) (out + i*4 + 16), _mm_unpackhi_epi16(rg, ba));
+		rg = _mm_unpackhi_epi8(v[0], v[1]);
+		ba = _mm_unpackhi_epi8(v[2], v[3]);
+		_mm_storeu_si128((__m128i *) (out + i*4 + 32), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i *) (out + i*4 + 48), _mm_unpackhi_epi16(rg, ba));
+	}
+#endif
+	for (; i < j->count; i++)
+		for (c = 0; c < 4; c++)
+			out[i*4 + c] = plane[c] ? plane[c][i * bytes] : (c == 3 ? 255 : 0);
+}
+
+typedef struct
+{
+	uint8 *out;
+	uint8 const *data;
+	int const *offset;	// where each row of each channel starts in data
+	int w, h, used, depth, first, rows;
+	int failed;
+} psd_rle_job;
+
+// rows first..first+rows-1: a few rows of every channel are unpacked at a
+// time into a small buffer and merged while they're still in cache, so a
+// whole planar copy of the image never exists
+static void psd_run_rle(void *job)
+{
+	psd_rle_job *j = (psd_rle_job *) job;
+	int row = j->w * (j->depth / 8), used = j->used ? j->used : 1;
+	int chunk = 65536 / (row * used), r, n, c, first;
+	uint8 *scratch;
+	psd_merge_job m;
+	if (chunk < 1) chunk = 1;
+	if (chunk > j->rows) chunk = j->rows;
+	scratch = (uint8 *) malloc((size_t) chunk * row * used);
+	if (!scratch) {
+		j->failed = 1;
+		return;
+	}
+	m.depth = j->depth;
+	m.first = 0;
+	for (r = j->first; r < j->first + j->rows; r += n) {
+		n = j->first + j->rows - r < chunk ? j->first + j->rows - r : chunk;
+		for (c = 0; c < 4; c++) {
+			m.plane[c] = NULL;
+			if (c < j->used) {
+				uint8 *plane = scratch + (size_t) c * chunk * row;
+				first = c * j->h + r;
+				psd_unpack(plane, n * row, j->data + j->offset[first], j->offset[first + n] - j->offset[first]);
+				m.plane[c] = plane;
+			}
+		}
+		m.out = j->out + (size_t) r * j->w * 4;
+		m.count = n * j->w;
+		psd_merge(&m);
+	}
+	free(scratch);
+}
+
+// smaller images aren't worth starting threads for
+#define PSD_PARALLEL_MIN	(256*256)
+#define PSD_MAX_JOBS		64
+
+static void psd_run(stbi_job_func func, void *jobs, int job_size, int num_jobs, int pixelCount)
+{
+	int i;
+	if (stbi_parallel && pixelCount >= PSD_PARALLEL_MIN)
+		stbi_parallel(func, jobs, job_size, num_jobs);
+	else
+		for (i = 0; i < num_jobs; i++)
+			func((char *) jobs + i * job_size);
+}
+
 static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
 	int	pixelCount;
-	int channelCount, compression;
-	int channel, i, count, len;
-   int w,h;
-   uint8 *out;
+	int channelCount, compression, depth, bytes, used;
+	int channel, i, j, band;
+	int w,h;
+	uint8 *out, *temp = NULL;
+	uint8 const *data;
+	psd_merge_job merge[PSD_MAX_JOBS];
 
 	// Check identifier
 	if (get32(s) != 0x38425053)	// "8BPS"
@@ -3060,7 +4810,7 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 
 	// Check file type version.
 	if (get16(s) != 1)
-		return epuc("wrong version", "Unsupported version of PSD image");
+		return epucc("wrong version", "Unsupported version of PSD image", STBI_ERROR_UNSUPPORTED);
 
 	// Skip 6 reserved bytes.
 	skip(s, 6 );
@@ -3068,15 +4818,24 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	// Read the number of channels (R, G, B, A, etc).
 	channelCount = get16(s);
 	if (channelCount < 0 || channelCount > 16)
-		return epuc("wrong channel count", "Unsupported number of channels in PSD image");
+		return epucc("wrong channel count", "Unsupported number of channels in PSD image", STBI_ERROR_UNSUPPORTED);
 
 	// Read the rows and columns of the image.
-   h = get32(s);
-   w = get32(s);
-
-	// Make sure the depth is 8 bits.
-	if (get16(s) != 8)
-		return epuc("unsupported bit depth", "PSD bit depth is not 8 bit");
+	h = get32(s);
+	w = get32(s);
+	if (w < 1 || h < 1)
+		return epuc("bad size", "Corrupt PSD image");
+
+	// Make sure the depth is 8 or 16 bits; 16-bit channels are brought
+	// down to 8 as they're merged.
+	depth = get16(s);
+	if (depth != 8 && depth != 16)
+		return epucc("unsupported bit depth", "PSD bit depth is not 8 or 16 bit", STBI_ERROR_UNSUPPORTED);
+	bytes = depth / 8;
+	// every channel has to fit in one piece, and so does the RLE input
+	// for them, which is taken to be at most twice as long
+	if ((uint64) w * h * 8 * bytes + (uint64) h * 8 > INT_MAX)
+		return epucc("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
 
 	// Make sure the color mode is RGB.
 	// Valid options are:
@@ -3089,7 +4848,7 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	//   8: Duotone
 	//   9: Lab color
 	if (get16(s) != 3)
-		return epuc("wrong color format", "PSD is not in RGB color format");
+		return epucc("wrong color format", "PSD is not in RGB color format", STBI_ERROR_UNSUPPORTED);
 
 	// Skip the Mode Data.  (It's the palette for indexed color; other info for other modes.)
 	skip(s,get32(s) );
@@ -3106,91 +4865,92 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	//   1: RLE compressed
 	compression = get16(s);
 	if (compression > 1)
-		return epuc("bad compression", "PSD has an unknown compression format");
+		return epucc("bad compression", "PSD has an unknown compression format", STBI_ERROR_UNSUPPORTED);
 
 	// Create the destination image.
-	out = (stbi_uc *) malloc(4 * w*h);
-	if (!out) return epuc("outofmem", "Out of memory");
-   pixelCount = w*h;
+	out = (stbi_uc *) malloc((size_t) 4 * w*h);
+	if (!out) return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+	pixelCount = w*h;
 
-	// Initialize the data to zero.
-	//memset( out, 0, pixelCount * 4 );
+	// Only the first four channels make the composite; the rest go unread.
+	used = channelCount < 4 ? channelCount : 4;
 
 	// Finally, the image data.
 	if (compression) {
-		// RLE as used by .PSD and .TIFF
-		// Loop until you get the number of unpacked bytes you are expecting:
-		//     Read the next source byte into n.
-		//     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
-		//     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
-		//     Else if n is 128, noop.
-		// Endloop
-
-		// The RLE-compressed data is preceeded by a 2-byte data count for each row in the data,
-		// which we're going to just skip.
-		skip(s, h * channelCount * 2 );
-
-		// Read the RLE data by channel.
-		for (channel = 0; channel < 4; channel++) {
-			uint8 *p;
-
-         p = out+channel;
-			if (channel >= channelCount) {
-				// Fill this channel with default data.
-				for (i = 0; i < pixelCount; i++) *p = (channel == 3 ? 255 : 0), p += 4;
-			} else {
-				// Read the RLE data.
-				count = 0;
-				while (count < pixelCount) {
-					len = get8(s);
-					if (len == 128) {
-						// No-op.
-					} else if (len < 128) {
-						// Copy next len+1 bytes literally.
-						len++;
-						count += len;
-						while (len) {
-							*p = get8(s);
-                     p += 4;
-							len--;
-						}
-					} else if (len > 128) {
-						uint32	val;
-						// Next -len+1 bytes in the dest are replicated from next source byte.
-						// (Interpret len as a negative 8-bit int.)
-						len ^= 0x0FF;
-						len += 2;
-                  val = get8(s);
-						count += len;
-						while (len) {
-							*p = val;
-                     p += 4;
-							len--;
-						}
-					}
-				}
-			}
+		psd_rle_job rle[PSD_MAX_JOBS];
+		int row = w * bytes, n, total = 0, failed = 0;
+		int *offset = (int *) malloc(sizeof(int) * (h * used + 1));
+		uint8 *counts = (uint8 *) malloc(h * channelCount * 2 + 1);
+		if (!offset || !counts) {
+			free(offset); free(counts); free(out);
+			return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
 		}
 
+		// The RLE-compressed data is preceeded by a 2-byte data count for
+		// each row in the data. Those say where every row of every channel
+		// starts, so any band of rows can be unpacked on its own; a count
+		// over twice the row is corrupt and is cut down to that.
+		getn(s, counts, h * channelCount * 2);
+		for (i = 0; i < h * used; i++) {
+			n = (counts[i*2] << 8) + counts[i*2 + 1];
+			offset[i] = total;
+			total += n < 2*row + 2 ? n : 2*row + 2;
+		}
+		offset[h * used] = total;
+		free(counts);
+		data = getn_block(s, total, &temp);
+		if (!data) {
+			free(offset); free(out);
+			return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+		}
+
+		// bands of at least 16 rows
+		j = (h + 15) / 16;
+		if (j > PSD_MAX_JOBS) j = PSD_MAX_JOBS;
+		band = (h + j - 1) / j;
+		for (i = 0; i < j && i * band < h; i++) {
+			rle[i].out = out;
+			rle[i].data = data;
+			rle[i].offset = offset;
+			rle[i].w = w;
+			rle[i].h = h;
+			rle[i].used = used;
+			rle[i].depth = depth;
+			rle[i].first = i * band;
+			rle[i].rows = h - i * band < band ? h - i * band : band;
+			rle[i].failed = 0;
+		}
+		psd_run(psd_run_rle, rle, sizeof(psd_rle_job), i, pixelCount);
+		while (i--) failed |= rle[i].failed;
+		free(offset);
+		free(temp);
+		if (failed) {
+			free(out);
+			return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+		}
 	} else {
 		// We're at the raw image data.  It's each channel in order (Red, Green, Blue, Alpha, ...)
-		// where each channel consists of an 8-bit value for each pixel in the image.
-
-		// Read the data by channel.
-		for (channel = 0; channel < 4; channel++) {
-			uint8 *p;
-
-         p = out + channel;
-			if (channel > channelCount) {
-				// Fill this channel with default data.
-				for (i = 0; i < pixelCount; i++) *p = channel == 3 ? 255 : 0, p += 4;
-			} else {
-				// Read the data.
-				count = 0;
-				for (i = 0; i < pixelCount; i++)
-					*p = get8(s), p += 4;
-			}
+		// where each channel consists of an 8 or 16-bit value for each pixel in the image.
+		data = getn_block(s, pixelCount * bytes * used, &temp);
+		if (!data) {
+			free(out);
+			return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
 		}
+
+		// Interleave, in bands of pixels.
+		j = (pixelCount + 65535) / 65536;
+		if (j > PSD_MAX_JOBS) j = PSD_MAX_JOBS;
+		band = (pixelCount + j - 1) / j;
+		for (i = 0; i < j; i++) {
+			for (channel = 0; channel < 4; channel++)
+				merge[i].plane[channel] = channel < used ? data + (size_t) channel * pixelCount * bytes : NULL;
+			merge[i].out = out;
+			merge[i].depth = depth;
+			merge[i].first = i * band;
+			merge[i].count = pixelCount - i * band < band ? pixelCount - i * band : band;
+		}
+		psd_run(psd_merge, merge, sizeof(psd_merge_job), j, pixelCount);
+		free(temp);
 	}
 
 	if (req_comp && req_comp != 4) {
@@ -3198,7 +4958,8 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 		if (out == NULL) return out; // convert_format frees input on failure
 	}
 
-	if (comp) *comp = channelCount;
+	// the composite is always RGBA, whatever else the file carries
+	if (comp) *comp = 4;
 	*y = h;
 	*x = w;
 
@@ -3231,6 +4992,58 @@ stbi_uc *stbi_psd_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return psd_load(&s, x,y,comp,req_comp);
 }
 
+static int psd_info(stbi *s, int *x, int *y, int *comp)
+{
+	int channelCount, depth;
+	if (get32(s) != 0x38425053)	// "8BPS"
+		return e("not PSD", "Corrupt PSD image");
+	if (get16(s) != 1)
+		return ec("wrong version", "Unsupported version of PSD image", STBI_ERROR_UNSUPPORTED);
+	skip(s, 6 );
+	channelCount = get16(s);
+	if (channelCount < 0 || channelCount > 16)
+		return ec("wrong channel count", "Unsupported number of channels in PSD image", STBI_ERROR_UNSUPPORTED);
+   if (y) *y = get32(s); else get32(s);
+   if (x) *x = get32(s); else get32(s);
+	depth = get16(s);
+	if (depth != 8 && depth != 16)
+		return ec("unsupported bit depth", "PSD bit depth is not 8 or 16 bit", STBI_ERROR_UNSUPPORTED);
+	if (get16(s) != 3)
+		return ec("wrong color format", "PSD is not in RGB color format", STBI_ERROR_UNSUPPORTED);
+	// psd_load always hands back the RGBA composite
+	if (comp) *comp = 4;
+	return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_psd_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_psd_info_from_file(f, x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_psd_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   stbi s;
+   int r,n = ftell(f);
+   start_file(&s, f);
+   r = psd_info(&s, x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+#endif
+
+int stbi_psd_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   start_mem(&s, buffer, len);
+   return psd_info(&s, x,y,comp);
+}
+
 
 // *************************************************************************************************
 // Radiance RGBE HDR loader
@@ -3289,18 +5102,67 @@ static char *hdr_gettoken(stbi *z, char *buffer)
 	return buffer;
 }
 
+// the signature, the header lines and the resolution line, which leaves
+// s at the first scanline
+static int hdr_header(stbi *s, int *x, int *y)
+{
+   char buffer[HDR_BUFLEN];
+	char *token;
+	int valid = 0;
+	long width, height;
+
+	// Check identifier
+	if (strcmp(hdr_gettoken(s,buffer), "#?RADIANCE") != 0)
+		return e("not HDR", "Corrupt HDR image");
+
+	// Parse header
+	while(1) {
+		token = hdr_gettoken(s,buffer);
+      if (token[0] == 0) break;
+		if (strcmp(token, "FORMAT=32-bit_rle_rgbe") == 0) valid = 1;
+   }
+
+	if (!valid)    return ec("unsupported format", "Unsupported HDR format", STBI_ERROR_UNSUPPORTED);
+
+   // Parse width and height
+   // can't use sscanf() if we're not using stdio!
+   token = hdr_gettoken(s,buffer);
+   if (strncmp(token, "-Y ", 3))  return ec("unsupported data layout", "Unsupported HDR format", STBI_ERROR_UNSUPPORTED);
+   token += 3;
+   height = strtol(token, &token, 10);
+   while (*token == ' ') ++token;
+   if (strncmp(token, "+X ", 3))  return ec("unsupported data layout", "Unsupported HDR format", STBI_ERROR_UNSUPPORTED);
+   token += 3;
+   width = strtol(token, NULL, 10);
+   if (width < 1 || height < 1) return e("bad size", "Corrupt HDR image");
+   if (width > (1 << 24) || height > (1 << 24)) return e("too large","Very large image (corrupt?)");
+
+	*x = (int) width;
+	*y = (int) height;
+   return 1;
+}
+
+// 2^(e-136), what an RGBE mantissa is scaled by, as two floats built
+// straight from exponent bits in place of ldexp; both are normal and
+// mantissa*a*b is exact, as mantissa*2^(e-136) always fits in a float
+static void hdr_factors(int e, float *a, float *b)
+{
+   *a = float_from_bits((uint32) ((e >> 1) + 59) << 23);
+   *b = float_from_bits((uint32) (e - (e >> 1) + 59) << 23);
+}
+
 static void hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
 	if( input[3] != 0 ) {
-      float f1;
+      float a, b;
 		// Exponent
-		f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+		hdr_factors(input[3], &a, &b);
       if (req_comp <= 2)
-         output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
+         output[0] = (input[0] + input[1] + input[2]) * a * b / 3;
       else {
-         output[0] = input[0] * f1;
-         output[1] = input[1] * f1;
-         output[2] = input[2] * f1;
+         output[0] = input[0] * a * b;
+         output[1] = input[1] * a * b;
+         output[2] = input[2] * a * b;
       }
       if (req_comp == 2) output[1] = 1;
       if (req_comp == 4) output[3] = 1;
@@ -3316,218 +5178,192 @@ static void hdr_convert(float *output, stbi_uc *input, int req_comp)
 	}
 }
 
-
-static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+#ifdef STBI_SSE2
+static __m128i hdr_bytes(stbi_uc const *p)
 {
-   char buffer[HDR_BUFLEN];
-	char *token;
-	int valid = 0;
-	int width, height;
-   stbi_uc *scanline;
-	float *hdr_data;
-	int len;
-	unsigned char count, value;
-	int i, j, k, c1,c2, z;
-
+   int w;
+   memcpy(&w, p, 4);
+   return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(w), _mm_setzero_si128()), _mm_setzero_si128());
+}
+#endif
 
-	// Check identifier
-	if (strcmp(hdr_gettoken(s,buffer), "#?RADIANCE") != 0)
-		return epf("not HDR", "Corrupt HDR image");
+// one scanline to floats, from four planes width apart (a run-length
+// encoded scanline) or from RGBE pixels
+static void hdr_convert_row(float *output, stbi_uc const *row, int width, int planar, int req_comp)
+{
+   int i = 0, k;
+#ifdef STBI_SSE2
+   __m128 one = _mm_set1_ps(1);
+   __m128i bias = _mm_set1_epi32(59), low = _mm_set1_epi32(0xff);
+   // with three components each pixel's store runs one float into the next
+   // pixel, which the next store then writes over
+   int last = req_comp == 3 ? width - 1 : width;
+   for (; i + 4 <= last; i += 4) {
+      __m128i c[4], half;
+      __m128 r, g, b, a, f, zero;
+      if (planar) {
+         for (k=0; k < 4; ++k)
+            c[k] = hdr_bytes(row + k*width + i);
+      } else {
+         __m128i v = _mm_loadu_si128((__m128i const *) (row + i*4));
+         c[0] = _mm_and_si128(v, low);
+         c[1] = _mm_and_si128(_mm_srli_epi32(v, 8), low);
+         c[2] = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+         c[3] = _mm_srli_epi32(v, 24);
+      }
+      half = _mm_srli_epi32(c[3], 1);
+      a = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(half, bias), 23));
+      f = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_sub_epi32(c[3], half), bias), 23));
+      zero = _mm_castsi128_ps(_mm_cmpeq_epi32(c[3], _mm_setzero_si128()));
+      if (req_comp <= 2) {
+         r = _mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(c[0], c[1]), c[2]));
+         r = _mm_andnot_ps(zero, _mm_div_ps(_mm_mul_ps(_mm_mul_ps(r, a), f), _mm_set1_ps(3)));
+         if (req_comp == 1)
+            _mm_storeu_ps(output + i, r);
+         else {
+            _mm_storeu_ps(output + i*2,     _mm_unpacklo_ps(r, one));
+            _mm_storeu_ps(output + i*2 + 4, _mm_unpackhi_ps(r, one));
+         }
+         continue;
+      }
+      r = _mm_andnot_ps(zero, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(c[0]), a), f));
+      g = _mm_andnot_ps(zero, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(c[1]), a), f));
+      b = _mm_andnot_ps(zero, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(c[2]), a), f));
+      a = one;
+      _MM_TRANSPOSE4_PS(r, g, b, a);
+      _mm_storeu_ps(output + i*req_comp,               r);
+      _mm_storeu_ps(output + i*req_comp + req_comp,    g);
+      _mm_storeu_ps(output + i*req_comp + req_comp*2,  b);
+      _mm_storeu_ps(output + i*req_comp + req_comp*3,  a);
+   }
+#endif
+   for (; i < width; ++i) {
+      stbi_uc rgbe[4];
+      for (k=0; k < 4; ++k)
+         rgbe[k] = planar ? row[k*width + i] : row[i*4 + k];
+      hdr_convert(output + i*req_comp, rgbe, req_comp);
+   }
+}
 
-	// Parse header
-	while(1) {
-		token = hdr_gettoken(s,buffer);
-      if (token[0] == 0) break;
-		if (strcmp(token, "FORMAT=32-bit_rle_rgbe") == 0) valid = 1;
+// each channel of a run-length encoded scanline in turn, into its plane
+static int hdr_rle_planes(stbi *s, stbi_uc *row, int width)
+{
+   int i, k, count;
+   for (k = 0; k < 4; ++k) {
+      stbi_uc *plane = row + k*width;
+      for (i = 0; i < width; i += count) {
+         count = get8(s);
+         if (count > 128) {
+            // Run
+            count -= 128;
+            if (count > width - i) return e("bad RLE data", "Corrupt HDR image");
+            memset(plane + i, get8(s), count);
+         } else {
+            // Dump
+            if (count == 0 || count > width - i) return e("bad RLE data", "Corrupt HDR image");
+            getn(s, plane + i, count);
+         }
+      }
    }
+   return 1;
+}
 
-	if (!valid)    return epf("unsupported format", "Unsupported HDR format");
+// the next scanline into row: as four planes if it's run-length encoded,
+// otherwise as width RGBE pixels. *rle says whether it may be; a flat
+// scanline clears it, as from there on the rest of the image is flat too
+static int hdr_scanline(stbi *s, stbi_uc *row, int width, int *rle)
+{
+   if (*rle) {
+      getn(s, row, 4);
+      if (row[0] == 2 && row[1] == 2 && !(row[2] & 0x80)) {
+         if (((row[2] << 8) | row[3]) != width) return e("invalid decoded scanline length", "corrupt HDR");
+         return hdr_rle_planes(s, row, width);
+      }
+      // not run-length encoded, so we have to actually use THIS data as a decoded
+      // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
+      *rle = 0;
+      getn(s, row + 4, width*4 - 4);
+      return 1;
+   }
+   getn(s, row, width*4);
+   return 1;
+}
 
-   // Parse width and height
-   // can't use sscanf() if we're not using stdio!
-   token = hdr_gettoken(s,buffer);
-   if (strncmp(token, "-Y ", 3))  return epf("unsupported data layout", "Unsupported HDR format");
-   token += 3;
-   height = strtol(token, &token, 10);
-   while (*token == ' ') ++token;
-   if (strncmp(token, "+X ", 3))  return epf("unsupported data layout", "Unsupported HDR format");
-   token += 3;
-   width = strtol(token, NULL, 10);
+// image data is stored as some number of scanlines; each is expanded into a
+// buffer small enough to still be in cache when it's converted
+static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+	int width, height, j, rle;
+   stbi_uc *scanline;
+	float *hdr_data;
 
+   if (!hdr_header(s, &width, &height)) return NULL;
 	*x = width;
 	*y = height;
 
    *comp = 3;
 	if (req_comp == 0) req_comp = 3;
+   if ((uint64) width * height * req_comp * sizeof(float) > (size_t) -1)
+      return epfc("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
+
+	hdr_data = (float *) malloc((size_t) width * height * req_comp * sizeof(float));
+   scanline = (stbi_uc *) malloc(width * 4);
+   if (hdr_data == NULL || scanline == NULL) {
+      free(hdr_data); free(scanline);
+      return epfc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   }
 
-	// Read data
-	hdr_data = (float *) malloc(height * width * req_comp * sizeof(float));
-
-	// Load image data
-   // image data is stored as some number of sca
-	if( width < 8 || width >= 32768) {
-		// Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-            stbi_uc rgbe[4];
-           main_decode_loop:
-            getn(s, rgbe, 4);
-            hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-         }
+   rle = width >= 8 && width < 32768;
+	for (j=0; j < height; ++j) {
+      if (!hdr_scanline(s, scanline, width, &rle)) {
+         free(hdr_data); free(scanline);
+         return NULL;
       }
-	} else {
-		// Read RLE-encoded data
-		scanline = NULL;
-
-		for (j = 0; j < height; ++j) {
-         c1 = get8(s);
-         c2 = get8(s);
-         len = get8(s);
-         if (c1 != 2 || c2 != 2 || (len & 0x80)) {
-            // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            stbi_uc rgbe[4] = { c1,c2,len, get8(s) };
-            hdr_convert(hdr_data, rgbe, req_comp);
-            i = 1;
-            j = 0;
-            free(scanline);
-            goto main_decode_loop; // yes, this is fucking insane; blame the fucking insane format
-         }
-         len <<= 8;
-         len |= get8(s);
-         if (len != width) { free(hdr_data); free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) scanline = (stbi_uc *) malloc(width * 4);
-
-			for (k = 0; k < 4; ++k) {
-				i = 0;
-				while (i < width) {
-					count = get8(s);
-					if (count > 128) {
-						// Run
-						value = get8(s);
-                  count -= 128;
-						for (z = 0; z < count; ++z)
-							scanline[i++ * 4 + k] = value;
-					} else {
-						// Dump
-						for (z = 0; z < count; ++z)
-							scanline[i++ * 4 + k] = get8(s);
-					}
-				}
-			}
-         for (i=0; i < width; ++i)
-            hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
-		}
-      free(scanline);
+      hdr_convert_row(hdr_data + (size_t) j*width*req_comp, scanline, width, rle, req_comp);
 	}
-
+   free(scanline);
    return hdr_data;
 }
 
 static stbi_uc *hdr_load_rgbe(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
-   char buffer[HDR_BUFLEN];
-	char *token;
-	int valid = 0;
-	int width, height;
+	int width, height, i, j, k, rle;
    stbi_uc *scanline;
 	stbi_uc *rgbe_data;
-	int len;
-	unsigned char count, value;
-	int i, j, k, c1,c2, z;
-
-
-	// Check identifier
-	if (strcmp(hdr_gettoken(s,buffer), "#?RADIANCE") != 0)
-		return epuc("not HDR", "Corrupt HDR image");
-
-	// Parse header
-	while(1) {
-		token = hdr_gettoken(s,buffer);
-      if (token[0] == 0) break;
-		if (strcmp(token, "FORMAT=32-bit_rle_rgbe") == 0) valid = 1;
-   }
-
-	if (!valid)    return epuc("unsupported format", "Unsupported HDR format");
-
-   // Parse width and height
-   // can't use sscanf() if we're not using stdio!
-   token = hdr_gettoken(s,buffer);
-   if (strncmp(token, "-Y ", 3))  return epuc("unsupported data layout", "Unsupported HDR format");
-   token += 3;
-   height = strtol(token, &token, 10);
-   while (*token == ' ') ++token;
-   if (strncmp(token, "+X ", 3))  return epuc("unsupported data layout", "Unsupported HDR format");
-   token += 3;
-   width = strtol(token, NULL, 10);
 
+   if (!hdr_header(s, &width, &height)) return NULL;
 	*x = width;
 	*y = height;
 
 	// RGBE _MUST_ come out as 4 components
    *comp = 4;
 	req_comp = 4;
+   if ((uint64) width * height * req_comp > (size_t) -1)
+      return epucc("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
+
+	rgbe_data = (stbi_uc *) malloc((size_t) width * height * req_comp);
+   scanline = (stbi_uc *) malloc(width * 4);
+   if (rgbe_data == NULL || scanline == NULL) {
+      free(rgbe_data); free(scanline);
+      return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
+   }
 
-	// Read data
-	rgbe_data = (stbi_uc *) malloc(height * width * req_comp * sizeof(stbi_uc));
-	//	point to the beginning
-	scanline = rgbe_data;
-
-	// Load image data
-   // image data is stored as some number of scan lines
-	if( width < 8 || width >= 32768) {
-		// Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-           main_decode_loop:
-            //getn(rgbe, 4);
-            getn(s,scanline, 4);
-			scanline += 4;
-         }
+   rle = width >= 8 && width < 32768;
+	for (j=0; j < height; ++j) {
+      stbi_uc *out = rgbe_data + (size_t) j*width*4;
+      stbi_uc *row = rle ? scanline : out;
+      if (!hdr_scanline(s, row, width, &rle)) {
+         free(rgbe_data); free(scanline);
+         return NULL;
       }
-	} else {
-		// Read RLE-encoded data
-		for (j = 0; j < height; ++j) {
-         c1 = get8(s);
-         c2 = get8(s);
-         len = get8(s);
-         if (c1 != 2 || c2 != 2 || (len & 0x80)) {
-            // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            scanline[0] = c1;
-            scanline[1] = c2;
-            scanline[2] = len;
-            scanline[3] = get8(s);
-            scanline += 4;
-            i = 1;
-            j = 0;
-            goto main_decode_loop; // yes, this is insane; blame the insane format
-         }
-         len <<= 8;
-         len |= get8(s);
-         if (len != width) { free(rgbe_data); return epuc("invalid decoded scanline length", "corrupt HDR"); }
-			for (k = 0; k < 4; ++k) {
-				i = 0;
-				while (i < width) {
-					count = get8(s);
-					if (count > 128) {
-						// Run
-						value = get8(s);
-                  count -= 128;
-						for (z = 0; z < count; ++z)
-							scanline[i++ * 4 + k] = value;
-					} else {
-						// Dump
-						for (z = 0; z < count; ++z)
-							scanline[i++ * 4 + k] = get8(s);
-					}
-				}
-			}
-			//	move the scanline on
-			scanline += 4 * width;
-		}
+      if (rle) {
+         for (i=0; i < width; ++i)
+            for (k=0; k < 4; ++k)
+               out[i*4 + k] = scanline[k*width + i];
+      } else if (row != out)
+         memcpy(out, row, width*4);
 	}
-
+   free(scanline);
    return rgbe_data;
 }
 
@@ -3550,7 +5386,7 @@ stbi_uc *stbi_hdr_load_rgbe        (char const *filename,           int *x, int
 {
    FILE *f = fopen(filename, "rb");
    unsigned char *result;
-   if (!f) return epuc("can't fopen", "Unable to open file");
+   if (!f) return epucc("can't fopen", "Unable to open file", STBI_ERROR_IO);
    result = stbi_hdr_load_rgbe_file(f,x,y,comp,req_comp);
    fclose(f);
    return result;
@@ -3571,6 +5407,46 @@ stbi_uc *stbi_hdr_load_rgbe_memory(stbi_uc *buffer, int len, int *x, int *y, int
    return hdr_load_rgbe(&s,x,y,comp,req_comp);
 }
 
+// header-only: stops after the resolution line, before any scanline
+static int hdr_info(stbi *s, int *x, int *y, int *comp)
+{
+   int width, height;
+   if (!hdr_header(s, &width, &height)) return 0;
+   if (x) *x = width;
+   if (y) *y = height;
+   if (comp) *comp = 3;
+   return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_hdr_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_hdr_info_from_file(f, x,y,comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_hdr_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   stbi s;
+   int r,n = ftell(f);
+   start_file(&s,f);
+   r = hdr_info(&s,x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+#endif
+
+int stbi_hdr_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   start_mem(&s,buffer, len);
+   return hdr_info(&s,x,y,comp);
+}
+
 #endif // STBI_NO_HDR
 
 /////////////////////// write image ///////////////////////
@@ -6,18 +6,15 @@
           avoid problematic images and only need the trivial interface
 
       JPEG baseline (no JPEG progressive, no oddball channel decimations)
-      PNG non-interlaced
+      PNG 1/2/4/8/16-bit, interlaced or not
       BMP non-1bpp, non-RLE
       TGA (not sure what subset, if a subset)
-      PSD (composited view only, no extra channels)
+      PSD (composited view only, no extra channels; 8/16-bit, always RGBA)
       HDR (radiance rgbE format)
       writes BMP,TGA (define STBI_NO_WRITE to remove code)
       decoded from memory or through stdio FILE (define STBI_NO_STDIO to remove code)
       supports installable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
         
-   TODO:
-      stbi_info_*
-  
    history:
       1.16   major bugfix - convert_format converted one too many pixels
       1.15   initialize some fields for thread safety
@@ -69,8 +66,9 @@
 ////   begin header file  ////////////////////////////////////////////////////
 //
 // Limitations:
-//    - no progressive/interlaced support (jpeg, png)
-//    - 8-bit samples only (jpeg, png)
+//    - no progressive support (jpeg)
+//    - 8-bit samples only (jpeg); 16-bit png samples are reduced to 8 bits
+//      unless loaded with stbi_png_load_16
 //    - not threadsafe
 //    - channel subsampling of at most 2 in each dimension (jpeg)
 //    - no delayed line count (jpeg) -- IJG doesn't support either
@@ -111,12 +109,24 @@
 // If image loading fails for any reason, the return value will be NULL,
 // and *x, *y, *comp will be unchanged. The function stbi_failure_reason()
 // can be queried for an extremely brief, end-user unfriendly explanation
-// of why the load failed. Define STBI_NO_FAILURE_STRINGS to avoid
-// compiling these strings at all, and STBI_FAILURE_USERMSG to get slightly
-// more user-friendly ones.
+// of why the load failed, and stbi_failure_code() for which STBI_ERROR_xxx
+// category it falls in. Both are kept per thread. Define
+// STBI_NO_FAILURE_STRINGS to leave the reason NULL (the code still works),
+// and STBI_FAILURE_USERMSG to get slightly more user-friendly ones.
 //
 // Paletted PNG and BMP images are automatically depalettized.
 //
+// req_comp can also be STBI_rgb565 or STBI_rgba4444, which returns one
+// native-endian 16-bit value per pixel instead, packed the same way as
+// GL_UNSIGNED_SHORT_5_6_5 / GL_UNSIGNED_SHORT_4_4_4_4. *comp still reports
+// the components in the file. The quantization can be dithered:
+//
+//     stbi_set_dither(STBI_dither_ordered);   // 4x4 Bayer pattern
+//     stbi_set_dither(STBI_dither_diffuse);   // Floyd-Steinberg
+//
+// Only the stbi_load* functions and the jpeg and png loaders take these;
+// stbi_png_load_16 doesn't.
+//
 //
 // ===========================================================================
 //
@@ -168,9 +178,43 @@ enum
    STBI_grey_alpha = 2,
    STBI_rgb        = 3,
    STBI_rgb_alpha  = 4,
+
+   STBI_rgb565     = 5, // packed 16-bit, only used for req_comp
+   STBI_rgba4444   = 6,
+};
+
+enum
+{
+   STBI_ERROR_NONE = 0,
+   STBI_ERROR_CORRUPT,           // malformed or truncated data
+   STBI_ERROR_UNSUPPORTED,       // not an image type or feature that can be decoded
+   STBI_ERROR_OUT_OF_MEMORY,
+   STBI_ERROR_IO,                // the file couldn't be opened or read
+   STBI_ERROR_INVALID_ARGUMENT,
+};
+
+enum
+{
+   STBI_dither_none    = 0,
+   STBI_dither_ordered = 1,
+   STBI_dither_diffuse = 2,
+};
+
+// what stbi_detect_type finds, and the hint for stbi_load_typed_from_memory
+enum
+{
+   STBI_type_unknown = 0,
+   STBI_type_jpeg,
+   STBI_type_png,
+   STBI_type_bmp,
+   STBI_type_psd,
+   STBI_type_dds,
+   STBI_type_hdr,
+   STBI_type_tga,
 };
 
 typedef unsigned char stbi_uc;
+typedef unsigned short stbi_us;
 
 #ifdef __cplusplus
 extern "C" {
@@ -196,6 +240,45 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 #endif
 extern stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
+// stbi_load and stbi_loadf decode from memory: the file is mapped when it
+// is a large regular one, and otherwise read in whole with large reads, so
+// pipes work too. define STBI_NO_MMAP to always read it
+
+#ifndef STBI_NO_STDIO
+// a whole file in memory, the way stbi_load holds it, for the _from_memory
+// functions; stbi_file_open fails like stbi_load. data stays valid until
+// stbi_file_close
+typedef struct
+{
+   stbi_uc *data;
+   int len;
+   int mapped;
+} stbi_file;
+extern int      stbi_file_open       (stbi_file *file, char const *filename);
+extern void     stbi_file_close      (stbi_file *file);
+#endif
+
+// the STBI_type_xxx of an image from its first bytes (32 are enough);
+// TGA, having no signature, is a best guess
+extern int      stbi_detect_type     (stbi_uc const *header, int len);
+// stbi_load_from_memory for a buffer already known to hold a 'type'
+// image, which skips detection; STBI_type_unknown detects as usual
+extern stbi_uc *stbi_load_typed_from_memory(stbi_uc const *buffer, int len, int type, int *x, int *y, int *comp, int req_comp);
+
+// decoding work that splits into independent jobs (DXT block rows) goes
+// through this: it must call func on each of the num_jobs jobs (job_size
+// bytes apart) and return once all of them are done. defaults to
+// image_thread_run unless STBI_PARALLEL is defined; NULL runs them in turn
+typedef void (*stbi_job_func)(void *job);
+typedef void (*stbi_parallel_func)(stbi_job_func func, void *jobs, int job_size, int num_jobs);
+extern stbi_parallel_func stbi_parallel;
+
+// how STBI_rgb565 and STBI_rgba4444 results are quantized, STBI_dither_xxx
+extern void     stbi_set_dither      (int mode);
+// packs a loaded 3 or 4 component image in place into STBI_rgb565 or
+// STBI_rgba4444; returns the (possibly moved) buffer, or frees it and
+// returns NULL
+extern stbi_uc *stbi_pack_image      (stbi_uc *data, int x, int y, int comp, int req_comp);
 
 #ifndef STBI_NO_HDR
 #ifndef STBI_NO_STDIO
@@ -203,6 +286,8 @@ extern float *stbi_loadf            (char const *filename,     int *x, int *y, i
 extern float *stbi_loadf_from_file  (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
 extern float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+// stbi_loadf_from_memory for a buffer already known to hold a 'type' image
+extern float *stbi_loadf_typed_from_memory(stbi_uc const *buffer, int len, int type, int *x, int *y, int *comp, int req_comp);
 
 extern void   stbi_hdr_to_ldr_gamma(float gamma);
 extern void   stbi_hdr_to_ldr_scale(float scale);
@@ -212,14 +297,16 @@ extern void   stbi_ldr_to_hdr_scale(float scale);
 
 #endif // STBI_NO_HDR
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for failure, and its category; both describe
+// the last failed load on the calling thread
 extern char    *stbi_failure_reason  (void); 
+extern int      stbi_failure_code    (void);
 
 // free the loaded image -- this is just free()
 extern void     stbi_image_free      (void *retval_from_stbi_load);
 
-// get image dimensions & components without fully decoding
+// get image dimensions & components without fully decoding; only the header
+// is read. for stbi_info_from_file the file position is left unchanged
 extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 extern int      stbi_is_hdr_from_memory(stbi_uc const *buffer, int len);
 #ifndef STBI_NO_STDIO
@@ -266,38 +353,60 @@ extern stbi_uc *stbi_png_load_from_file   (FILE *f,                  int *x, int
 extern int      stbi_png_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 #endif
 
+// off by default: when on, every chunk's CRC is checked and a mismatch
+// fails the load with "bad CRC"
+extern void     stbi_png_verify_crc       (int verify);
+
+// same as the loaders above, but every component is a native-endian 16-bit
+// value; 1-8 bit images are widened so that 255 becomes 65535
+extern stbi_us *stbi_png_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+#ifndef STBI_NO_STDIO
+extern stbi_us *stbi_png_load_16          (char const *filename,     int *x, int *y, int *comp, int req_comp);
+extern stbi_us *stbi_png_load_16_from_file(FILE *f,                  int *x, int *y, int *comp, int req_comp);
+#endif
+
 // is it a bmp?
 extern int      stbi_bmp_test_memory      (stbi_uc const *buffer, int len);
+extern int      stbi_bmp_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 extern stbi_uc *stbi_bmp_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_bmp_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_bmp_test_file        (FILE *f);
+extern int      stbi_bmp_info             (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_bmp_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 extern stbi_uc *stbi_bmp_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
 
 // is it a tga?
 extern int      stbi_tga_test_memory      (stbi_uc const *buffer, int len);
+extern int      stbi_tga_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 extern stbi_uc *stbi_tga_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_tga_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_tga_test_file        (FILE *f);
+extern int      stbi_tga_info             (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_tga_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 extern stbi_uc *stbi_tga_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
 
 // is it a psd?
 extern int      stbi_psd_test_memory      (stbi_uc const *buffer, int len);
+extern int      stbi_psd_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 extern stbi_uc *stbi_psd_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_psd_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_psd_test_file        (FILE *f);
+extern int      stbi_psd_info             (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_psd_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 extern stbi_uc *stbi_psd_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
 
 // is it an hdr?
 extern int      stbi_hdr_test_memory      (stbi_uc const *buffer, int len);
+extern int      stbi_hdr_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 extern float *  stbi_hdr_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern float *  stbi_hdr_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
@@ -305,6 +414,8 @@ extern stbi_uc *stbi_hdr_load_rgbe        (char const *filename,           int *
 extern float *  stbi_hdr_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_hdr_test_file        (FILE *f);
+extern int      stbi_hdr_info             (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_hdr_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 extern float *  stbi_hdr_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_hdr_load_rgbe_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
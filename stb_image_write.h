@@ -12,13 +12,12 @@ in the file that you want to have the implementation.
 
 ABOUT:
 
-   This header file is a library for writing images to C stdio. It could be
-   adapted to write to memory or a general streaming interface; let me know.
+   This header file is a library for writing images to C stdio. PNGs can
+   also be written to memory or streamed out through a callback.
 
-   The PNG output is not optimal; it is 20-50% larger than the file
-   written by a decent optimizing implementation. This library is designed
-   for source code compactness and simplicitly, not optimal image file size
-   or run-time performance.
+   PNG data is compressed with a deflate encoder that follows zlib's
+   levels: set stbi_write_png_compression_level to 0 (stored, fastest) up
+   to 9 (smallest); the default is 8.
 
 USAGE:
 
@@ -29,6 +28,20 @@ USAGE:
      int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
 
    Each function returns 0 on failure and non-0 on success.
+
+   Each format can also be written through a callback, from memory or from
+   rows supplied one at a time by another callback, and PNGs to a malloc'd
+   buffer:
+
+     int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+     int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data);
+     int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data);
+     int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, int level);
+     int stbi_write_bmp_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context);
+     int stbi_write_tga_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, int rle);
+     unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_in_bytes, int w, int h, int comp, int *out_len);
+
+   TGAs are written run-length encoded if stbi_write_tga_with_rle is set.
    
    The functions create an image file defined by the parameters. The image
    is a rectangle of pixels stored from left-to-right, top-to-bottom.
@@ -62,6 +75,52 @@ extern int stbi_write_png(char const *filename, int w, int h, int comp, const vo
 extern int stbi_write_bmp(char const *filename, int w, int h, int comp, const void *data);
 extern int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
 
+// writing through a callback instead of to a file: func is handed the
+// file's bytes a piece at a time, in order, as soon as they're ready, so
+// only a bounded batch of rows is ever held in memory
+typedef void stbi_write_func(void *context, void *data, int size);
+extern int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+extern int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data);
+extern int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data);
+
+// same again, but the pixels come from a callback too: it fills 'row' with
+// row y's w*comp bytes, and returns 0 to give up (anything already passed
+// to func is then an incomplete file). PNG asks for rows 0 to h-1 in order,
+// BMP and TGA from h-1 down to 0. level and rle override the globals below
+// for this call, unless they're negative
+typedef int stbi_write_row_func(void *context, int y, unsigned char *row);
+extern int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, int level);
+extern int stbi_write_bmp_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context);
+extern int stbi_write_tga_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, int rle);
+
+// the whole file in one malloc'd buffer, or NULL on failure
+extern unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_in_bytes, int w, int h, int comp, int *out_len);
+
+extern int stbi_write_png_compression_level;
+
+// non-zero: TGAs are written run-length encoded (image type 10)
+extern int stbi_write_tga_with_rle;
+
+// how the PNG writer picks each row's filter: 0-4 always uses that filter;
+// STBIW_PNG_FILTER_MSAD (the default) tries all five and keeps the one with
+// the smallest sum of absolute filtered values; STBIW_PNG_FILTER_SAMPLED
+// makes the same choice from a quarter of each row, then filters once.
+// any other value is taken as STBIW_PNG_FILTER_MSAD
+enum
+{
+   STBIW_PNG_FILTER_MSAD    = -1,
+   STBIW_PNG_FILTER_SAMPLED = -2
+};
+extern int stbi_write_png_filter;
+
+// optional: lets the PNG writer encode row bands in parallel. when set, it
+// must call func on each of the num_jobs jobs (job_size bytes apart) and
+// return once all of them are done; jobs don't depend on each other. NULL
+// (the default, unless STBIW_PARALLEL is defined) runs them one by one
+typedef void (*stbiw_job_func)(void *job);
+typedef void (*stbiw_parallel_func)(stbiw_job_func func, void *jobs, int job_size, int num_jobs);
+extern stbiw_parallel_func stbi_write_parallel;
+
 #ifdef __cplusplus
 }
 #endif
@@ -76,145 +135,337 @@ extern int stbi_write_tga(char const *filename, int w, int h, int comp, const vo
 #include <string.h>
 #include <assert.h>
 
+#if !defined(STBIW_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
 typedef unsigned int stbiw_uint32;
 typedef int stb_image_write_test[sizeof(stbiw_uint32)==4 ? 1 : -1];
 
-static void writefv(FILE *f, const char *fmt, va_list v)
+#ifndef STBIW_PARALLEL
+#define STBIW_PARALLEL NULL
+#endif
+
+static void stbi__stdio_write(void *context, void *data, int size)
 {
+   fwrite(data, 1, size, (FILE *) context);
+}
+
+// runs 'call' with the file opened as f; ok ends up 0 if the call or
+// any of the file operations failed
+#define stbi__write_file(ok, filename, call) \
+   do { FILE *f = fopen(filename, "wb"); (ok) = 0; \
+        if (f) { (ok) = (call); if (ferror(f)) (ok) = 0; if (fclose(f)) (ok) = 0; } } while (0)
+
+// packs little-endian header fields into out, returns the byte count
+static int writefv(unsigned char *out, const char *fmt, va_list v)
+{
+   unsigned char *o = out;
    while (*fmt) {
       switch (*fmt++) {
          case ' ': break;
-         case '1': { unsigned char x = (unsigned char) va_arg(v, int); fputc(x,f); break; }
-         case '2': { int x = va_arg(v,int); unsigned char b[2];
-                     b[0] = (unsigned char) x; b[1] = (unsigned char) (x>>8);
-                     fwrite(b,2,1,f); break; }
-         case '4': { stbiw_uint32 x = va_arg(v,int); unsigned char b[4];
-                     b[0]=(unsigned char)x; b[1]=(unsigned char)(x>>8);
-                     b[2]=(unsigned char)(x>>16); b[3]=(unsigned char)(x>>24);
-                     fwrite(b,4,1,f); break; }
+         case '1': { *o++ = (unsigned char) va_arg(v, int); break; }
+         case '2': { int x = va_arg(v,int);
+                     *o++ = (unsigned char) x; *o++ = (unsigned char) (x>>8);
+                     break; }
+         case '4': { stbiw_uint32 x = va_arg(v,int);
+                     *o++ = (unsigned char) x; *o++ = (unsigned char) (x>>8);
+                     *o++ = (unsigned char) (x>>16); *o++ = (unsigned char) (x>>24);
+                     break; }
          default:
             assert(0);
-            return;
+            return (int) (o - out);
       }
    }
+   return (int) (o - out);
 }
 
-static void write3(FILE *f, unsigned char a, unsigned char b, unsigned char c)
+// one row of pixels as the file stores them: BGR, or BGRA with 'alpha'.
+// grey is spread over all three, and RGBA without alpha is composited
+// against a pink background
+static void stbi__bgr_row(unsigned char *out, const unsigned char *d, int x, int comp, int alpha)
 {
-   unsigned char arr[3];
-   arr[0] = a, arr[1] = b, arr[2] = c;
-   fwrite(arr, 3, 1, f);
+   static const unsigned char bg[3] = { 255, 0, 255 };
+   int i=0, k;
+   if (comp == 3) {
+      #ifdef STBIW_SSE2
+      // five pixels per step: each byte comes from two ahead, in place, or
+      // two behind; the 16th byte is junk that the next step overwrites
+      const __m128i m0 = _mm_setr_epi8(-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,0);
+      const __m128i m1 = _mm_setr_epi8(0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0);
+      const __m128i m2 = _mm_setr_epi8(0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0);
+      for (; i+6 <= x; i += 5) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (d + i*3));
+         __m128i r = _mm_or_si128(_mm_and_si128(_mm_srli_si128(v, 2), m0),
+                     _mm_or_si128(_mm_and_si128(v, m1), _mm_and_si128(_mm_slli_si128(v, 2), m2)));
+         _mm_storeu_si128((__m128i *) (out + i*3), r);
+      }
+      #endif
+      for (; i < x; ++i) {
+         out[i*3+0] = d[i*3+2];
+         out[i*3+1] = d[i*3+1];
+         out[i*3+2] = d[i*3+0];
+      }
+   } else if (comp == 4 && alpha) {
+      #ifdef STBIW_SSE2
+      const __m128i ga = _mm_set1_epi32((int) 0xff00ff00), lo = _mm_set1_epi32(0xff);
+      for (; i+4 <= x; i += 4) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (d + i*4));
+         __m128i r = _mm_or_si128(_mm_and_si128(v, ga),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo), _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+         _mm_storeu_si128((__m128i *) (out + i*4), r);
+      }
+      #endif
+      for (; i < x; ++i) {
+         out[i*4+0] = d[i*4+2];
+         out[i*4+1] = d[i*4+1];
+         out[i*4+2] = d[i*4+0];
+         out[i*4+3] = d[i*4+3];
+      }
+   } else if (comp == 4) {
+      for (; i < x; ++i, out += 3, d += 4)
+         for (k=0; k < 3; ++k)
+            out[2-k] = (unsigned char) (bg[k] + ((d[k] - bg[k]) * d[3])/255);
+   } else {
+      for (; i < x; ++i, d += comp) {
+         *out++ = d[0];
+         *out++ = d[0];
+         *out++ = d[0];
+         if (alpha) *out++ = d[1];
+      }
+   }
 }
 
-static void write_pixels(FILE *f, int rgb_dir, int vdir, int x, int y, int comp, void *data, int write_alpha, int scanline_pad)
+// TGA run-length packets for one converted row of ps-byte pixels: a run of
+// up to 128 repeats of one pixel, or up to 128 pixels sent as they are
+static int stbi__tga_rle_row(unsigned char *out, const unsigned char *row, int x, int ps)
 {
-   unsigned char bg[3] = { 255, 0, 255}, px[3];
-   stbiw_uint32 zero = 0;
-   int i,j,k, j_end;
-
-   if (y <= 0)
-      return;
-
-   if (vdir < 0) 
-      j_end = -1, j = y-1;
-   else
-      j_end =  y, j = 0;
-
-   for (; j != j_end; j += vdir) {
-      for (i=0; i < x; ++i) {
-         unsigned char *d = (unsigned char *) data + (j*x+i)*comp;
-         if (write_alpha < 0)
-            fwrite(&d[comp-1], 1, 1, f);
-         switch (comp) {
-            case 1:
-            case 2: write3(f, d[0],d[0],d[0]);
-                    break;
-            case 4:
-               if (!write_alpha) {
-                  // composite against pink background
-                  for (k=0; k < 3; ++k)
-                     px[k] = bg[k] + ((d[k] - bg[k]) * d[3])/255;
-                  write3(f, px[1-rgb_dir],px[1],px[1+rgb_dir]);
+   unsigned char *o = out;
+   int i, len;
+   for (i=0; i < x; i += len) {
+      const unsigned char *begin = row + i*ps;
+      int diff = 1, k;
+      len = 1;
+      if (i < x-1) {
+         ++len;
+         diff = memcmp(begin, begin + ps, ps);
+         if (diff) {
+            const unsigned char *prev = begin;
+            for (k = i+2; k < x && len < 128; ++k) {
+               if (memcmp(prev + ps, row + k*ps, ps)) {
+                  prev += ps;
+                  ++len;
+               } else {
+                  // leave the repeated pixel to start the next run
+                  --len;
                   break;
                }
-               /* FALLTHROUGH */
-            case 3:
-               write3(f, d[1-rgb_dir],d[1],d[1+rgb_dir]);
-               break;
+            }
+         } else {
+            for (k = i+2; k < x && len < 128; ++k) {
+               if (!memcmp(begin, row + k*ps, ps))
+                  ++len;
+               else
+                  break;
+            }
          }
-         if (write_alpha > 0)
-            fwrite(&d[comp-1], 1, 1, f);
       }
-      fwrite(&zero,scanline_pad,1,f);
+      if (diff) {
+         *o++ = (unsigned char) (len - 1);
+         memcpy(o, begin, len*ps);
+         o += len*ps;
+      } else {
+         *o++ = (unsigned char) (0x80 | (len - 1));
+         memcpy(o, begin, ps);
+         o += ps;
+      }
    }
+   return (int) (o - out);
 }
 
-static int outfile(char const *filename, int rgb_dir, int vdir, int x, int y, int comp, void *data, int alpha, int pad, const char *fmt, ...)
+#define stbi__WRITE_BLOCK  65536
+
+// the header described by fmt, then the rows bottom to top, converted into
+// a block buffer that is passed to func whenever the next row might not fit.
+// rows come from data, or if that's NULL from the row callback
+static int outfunc(stbi_write_func *func, void *context, int x, int y, int comp, const void *data,
+                   stbi_write_row_func *rows, void *row_context, int alpha, int pad, int rle, const char *fmt, ...)
 {
-   FILE *f;
-   if (y < 0 || x < 0) return 0;
-   f = fopen(filename, "wb");
-   if (f) {
-      va_list v;
-      va_start(v, fmt);
-      writefv(f, fmt, v);
-      va_end(v);
-      write_pixels(f,rgb_dir,vdir,x,y,comp,data,alpha,pad);
-      fclose(f);
+   va_list v;
+   unsigned char *buf, *row = NULL, *src = NULL;
+   int ps = 3 + alpha, row_max, cap, len, j;
+
+   if (y < 0 || x < 0 || comp < 1 || comp > 4 || (!data && !rows)) return 0;
+   row_max = x*ps + pad + (rle ? x/128 + 1 : 0);
+   cap = row_max > stbi__WRITE_BLOCK ? row_max : stbi__WRITE_BLOCK;
+   buf = (unsigned char *) malloc(cap);
+   if (rle) row = (unsigned char *) malloc(x*ps + 1);
+   if (!data) src = (unsigned char *) malloc(x*comp + 1);
+   if (!buf || (rle && !row) || (!data && !src)) {
+      free(buf); free(row); free(src);
+      return 0;
    }
-   return f != NULL;
+
+   va_start(v, fmt);
+   len = writefv(buf, fmt, v);
+   va_end(v);
+
+   for (j=y-1; j >= 0; --j) {
+      const unsigned char *d = (const unsigned char *) data + (size_t) j*x*comp;
+      if (!data) {
+         if (!rows(row_context, j, src)) break;
+         d = src;
+      }
+      if (cap - len < row_max) {
+         func(context, buf, len);
+         len = 0;
+      }
+      if (rle) {
+         stbi__bgr_row(row, d, x, comp, alpha);
+         len += stbi__tga_rle_row(buf + len, row, x, ps);
+      } else {
+         stbi__bgr_row(buf + len, d, x, comp, alpha);
+         len += x*ps;
+         memset(buf + len, 0, pad);
+         len += pad;
+      }
+   }
+   if (len) func(context, buf, len);
+   free(src);
+   free(row);
+   free(buf);
+   return j < 0;
 }
 
-int stbi_write_bmp(char const *filename, int x, int y, int comp, const void *data)
+static int stbi__write_bmp_core(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, stbi_write_row_func *rows, void *row_context)
 {
    int pad = (-x*3) & 3;
-   return outfile(filename,-1,-1,x,y,comp,(void *) data,0,pad,
+   return outfunc(func, context, x, y, comp, data, rows, row_context, 0, pad, 0,
            "11 4 22 4" "4 44 22 444444",
            'B', 'M', 14+40+(x*3+pad)*y, 0,0, 14+40,  // file header
             40, x,y, 1,24, 0,0,0,0,0,0);             // bitmap header
 }
 
-int stbi_write_tga(char const *filename, int x, int y, int comp, const void *data)
+int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
 {
-   int has_alpha = !(comp & 1);
-   return outfile(filename, -1,-1, x, y, comp, (void *) data, has_alpha, 0,
-                  "111 221 2222 11", 0,0,2, 0,0,0, 0,0,x,y, 24+8*has_alpha, 8*has_alpha);
+   if (!data) return 0;
+   return stbi__write_bmp_core(func, context, x, y, comp, data, NULL, NULL);
 }
 
-// stretchy buffer; stbi__sbpush() == vector<>::push_back() -- stbi__sbcount() == vector<>::size()
-#define stbi__sbraw(a) ((int *) (a) - 2)
-#define stbi__sbm(a)   stbi__sbraw(a)[0]
-#define stbi__sbn(a)   stbi__sbraw(a)[1]
+int stbi_write_bmp_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *rows, void *row_context)
+{
+   if (!rows) return 0;
+   return stbi__write_bmp_core(func, context, x, y, comp, NULL, rows, row_context);
+}
 
-#define stbi__sbneedgrow(a,n)  ((a)==0 || stbi__sbn(a)+n >= stbi__sbm(a))
-#define stbi__sbmaybegrow(a,n) (stbi__sbneedgrow(a,(n)) ? stbi__sbgrow(a,n) : 0)
-#define stbi__sbgrow(a,n)  stbi__sbgrowf((void **) &(a), (n), sizeof(*(a)))
+int stbi_write_bmp(char const *filename, int x, int y, int comp, const void *data)
+{
+   int ok;
+   stbi__write_file(ok, filename, stbi_write_bmp_to_func(stbi__stdio_write, f, x, y, comp, data));
+   return ok;
+}
 
-#define stbi__sbpush(a, v)      (stbi__sbmaybegrow(a,1), (a)[stbi__sbn(a)++] = (v))
-#define stbi__sbcount(a)        ((a) ? stbi__sbn(a) : 0)
-#define stbi__sbfree(a)         ((a) ? free(stbi__sbraw(a)),0 : 0)
+int stbi_write_tga_with_rle = 0;
 
-static void *stbi__sbgrowf(void **arr, int increment, int itemsize)
+static int stbi__write_tga_core(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, stbi_write_row_func *rows, void *row_context, int rle)
 {
-   int m = *arr ? 2*stbi__sbm(*arr)+increment : increment+1;
-   void *p = realloc(*arr ? stbi__sbraw(*arr) : 0, itemsize * m + sizeof(int)*2);
-   assert(p);
-   if (p) {
-      if (!*arr) ((int *) p)[1] = 0;
-      *arr = (void *) ((int *) p + 2);
-      stbi__sbm(*arr) = m;
-   }
-   return *arr;
+   int has_alpha = !(comp & 1);
+   return outfunc(func, context, x, y, comp, data, rows, row_context, has_alpha, 0, rle,
+                  "111 221 2222 11", 0,0,rle ? 10 : 2, 0,0,0, 0,0,x,y, 24+8*has_alpha, 8*has_alpha);
 }
 
-static unsigned char *stbi__zlib_flushf(unsigned char *data, unsigned int *bitbuffer, int *bitcount)
+int stbi_write_tga_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
 {
-   while (*bitcount >= 8) {
-      stbi__sbpush(data, (unsigned char) *bitbuffer);
-      *bitbuffer >>= 8;
-      *bitcount -= 8;
-   }
-   return data;
+   if (!data) return 0;
+   return stbi__write_tga_core(func, context, x, y, comp, data, NULL, NULL, stbi_write_tga_with_rle != 0);
+}
+
+int stbi_write_tga_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *rows, void *row_context, int rle)
+{
+   if (!rows) return 0;
+   if (rle < 0) rle = stbi_write_tga_with_rle;
+   return stbi__write_tga_core(func, context, x, y, comp, NULL, rows, row_context, rle != 0);
+}
+
+int stbi_write_tga(char const *filename, int x, int y, int comp, const void *data)
+{
+   int ok;
+   stbi__write_file(ok, filename, stbi_write_tga_to_func(stbi__stdio_write, f, x, y, comp, data));
+   return ok;
+}
+
+// deflate encoder: hash chains over the whole input (which is already in
+// memory, so there's no sliding), lazy matching on the higher levels, and
+// each block of symbols sent as whichever of stored/fixed/dynamic huffman
+// comes out smallest
+
+int stbi_write_png_compression_level = 8;
+
+#define stbi__ZHASH_BITS  15
+#define stbi__ZHASH       (1 << stbi__ZHASH_BITS)
+#define stbi__ZWINDOW     32768
+#define stbi__ZBLOCK      16384   // symbols per block
+#define stbi__ZMAX_BITS   15
+
+typedef struct
+{
+   unsigned short good_length; // shorten the chain search past this match length
+   unsigned short max_lazy;    // lazy: don't look for a better match past this
+                               // greedy: only insert matches up to this length
+   unsigned short nice_length; // stop searching at this match length
+   unsigned short max_chain;
+   unsigned char  lazy;
+} stbi__zlevel;
+
+// same tradeoffs as zlib's levels 1-9
+static const stbi__zlevel stbi__zlevels[10] =
+{
+   {  0,   0,   0,    0, 0 }, // stored only
+   {  4,   4,   8,    4, 0 },
+   {  4,   5,  16,    8, 0 },
+   {  4,   6,  32,   32, 0 },
+   {  4,   4,  16,   16, 1 },
+   {  8,  16,  32,   32, 1 },
+   {  8,  16, 128,  128, 1 },
+   {  8,  32, 128,  256, 1 },
+   { 32, 128, 258, 1024, 1 },
+   { 32, 258, 258, 4096, 1 },
+};
+
+static const unsigned short stbi__zlength_base[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const unsigned char  stbi__zlength_extra[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static const unsigned short stbi__zdist_base[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const unsigned char  stbi__zdist_extra[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const unsigned char  stbi__zclen_order[]  = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+typedef struct
+{
+   unsigned char *data;
+   int data_len;
+   const stbi__zlevel *level;
+
+   int *head, *prev;           // hash chains; prev is indexed by position mod window
+
+   unsigned char  *lbuf;       // literal, or match length-3
+   unsigned short *dbuf;       // match distance, 0 for a literal
+   int nsyms, block_start;
+   unsigned int lfreq[286], dfreq[30];
+
+   unsigned char len_sym[259]; // match length -> length code - 257
+   unsigned char dist_sym[512];// see stbi__zdist_code
+
+   unsigned char *out;
+   int out_len, out_cap;
+   stbiw_uint32 bitbuf;
+   int bitcount;
+   int failed;
+} stbi__zenc;
+
+static int stbi__zdist_code(stbi__zenc *z, int dist)
+{
+   --dist;
+   return dist < 256 ? z->dist_sym[dist] : z->dist_sym[256 + (dist >> 7)];
 }
 
 static int stbi__zlib_bitrev(int code, int codebits)
@@ -227,167 +478,621 @@ static int stbi__zlib_bitrev(int code, int codebits)
    return res;
 }
 
-static unsigned int stbi__zlib_countm(unsigned char *a, unsigned char *b, int limit)
+// the caller reserves room for the whole block first, so this never grows
+static void stbi__zlib_add(stbi__zenc *z, stbiw_uint32 code, int codebits)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
-      if (a[i] != b[i]) break;
-   return i;
+   z->bitbuf |= code << z->bitcount;
+   z->bitcount += codebits;
+   while (z->bitcount >= 8) {
+      z->out[z->out_len++] = (unsigned char) z->bitbuf;
+      z->bitbuf >>= 8;
+      z->bitcount -= 8;
+   }
+}
+
+static int stbi__zlib_reserve(stbi__zenc *z, int bytes)
+{
+   if (z->out_len + bytes > z->out_cap) {
+      int cap = z->out_cap * 2;
+      unsigned char *p;
+      if (cap < z->out_len + bytes) cap = z->out_len + bytes;
+      p = (unsigned char *) realloc(z->out, cap);
+      if (!p) { z->failed = 1; return 0; }
+      z->out = p;
+      z->out_cap = cap;
+   }
+   return 1;
 }
 
 static unsigned int stbi__zhash(unsigned char *data)
 {
-   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
-}
-
-#define stbi__zlib_flush() (out = stbi__zlib_flushf(out, &bitbuf, &bitcount))
-#define stbi__zlib_add(code,codebits) \
-      (bitbuf |= (code) << bitcount, bitcount += (codebits), stbi__zlib_flush())
-#define stbi__zlib_huffa(b,c)  stbi__zlib_add(stbi__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbi__zlib_huff1(n)  stbi__zlib_huffa(0x30 + (n), 8)
-#define stbi__zlib_huff2(n)  stbi__zlib_huffa(0x190 + (n)-144, 9)
-#define stbi__zlib_huff3(n)  stbi__zlib_huffa(0 + (n)-256,7)
-#define stbi__zlib_huff4(n)  stbi__zlib_huffa(0xc0 + (n)-280,8)
-#define stbi__zlib_huff(n)  ((n) <= 143 ? stbi__zlib_huff1(n) : (n) <= 255 ? stbi__zlib_huff2(n) : (n) <= 279 ? stbi__zlib_huff3(n) : stbi__zlib_huff4(n))
-#define stbi__zlib_huffb(n) ((n) <= 143 ? stbi__zlib_huff1(n) : stbi__zlib_huff2(n))
-
-#define stbi__ZHASH   16384
+   stbiw_uint32 v = data[0] | (data[1] << 8) | (data[2] << 16);
+   return (v * 2654435761u) >> (32 - stbi__ZHASH_BITS);
+}
 
-unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// optimal code lengths for weights sorted in increasing order, computed in
+// place (Moffat & Katajainen); a[i] becomes the length of the i'th code
+static void stbi__zlib_min_redundancy(unsigned int *a, int n)
 {
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char **hash_table[stbi__ZHASH]; // 64KB on the stack!
-   if (quality < 5) quality = 5;
-
-   stbi__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbi__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbi__zlib_add(1,1);  // BFINAL = 1
-   stbi__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
-
-   for (i=0; i < stbi__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed 
-      int h = stbi__zhash(data+i)&(stbi__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbi__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbi__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
-         }
+   int root, leaf, next, avbl, used, dpth;
+   if (n == 1) { a[0] = 1; return; }
+   a[0] += a[1]; root = 0; leaf = 2;
+   for (next=1; next < n-1; ++next) {
+      if (leaf >= n || a[root] < a[leaf]) { a[next] = a[root]; a[root++] = next; } else a[next] = a[leaf++];
+      if (leaf >= n || (root < next && a[root] < a[leaf])) { a[next] += a[root]; a[root++] = next; } else a[next] += a[leaf++];
+   }
+   a[n-2] = 0;
+   for (next=n-3; next >= 0; --next) a[next] = a[a[next]] + 1;
+   avbl = 1; used = dpth = 0; root = n-2; next = n-1;
+   while (avbl > 0) {
+      while (root >= 0 && (int) a[root] == dpth) { ++used; --root; }
+      while (avbl > used) { a[next--] = dpth; --avbl; }
+      avbl = 2*used; ++dpth; used = 0;
+   }
+}
+
+// huffman code lengths of at most 'limit' bits for n symbols
+static void stbi__zlib_build_lengths(const unsigned int *freq, int n, int limit, unsigned char *lengths)
+{
+   int sym[286], count[32], i, j, k, used=0;
+   unsigned int w[286], total;
+   for (i=0; i < n; ++i) {
+      lengths[i] = 0;
+      if (freq[i]) sym[used++] = i;
+   }
+   if (used == 0) return;
+   if (used == 1) {
+      // a lone code still needs a complete tree for some decoders
+      lengths[sym[0]] = 1;
+      lengths[sym[0] ? 0 : 1] = 1;
+      return;
+   }
+   // insertion sort by weight; the alphabets are tiny
+   for (i=1; i < used; ++i) {
+      int s = sym[i];
+      for (j=i; j > 0 && freq[sym[j-1]] > freq[s]; --j) sym[j] = sym[j-1];
+      sym[j] = s;
+   }
+   for (i=0; i < used; ++i) w[i] = freq[sym[i]];
+   stbi__zlib_min_redundancy(w, used);
+
+   // fold anything longer than the limit back in and fix up the Kraft sum
+   memset(count, 0, sizeof(count));
+   for (i=0; i < used; ++i) ++count[w[i] < (unsigned) limit ? w[i] : (unsigned) limit];
+   for (total=0, i=limit; i > 0; --i) total += count[i] << (limit - i);
+   while (total != (1u << limit)) {
+      --count[limit];
+      for (i=limit-1; i > 0; --i)
+         if (count[i]) { --count[i]; count[i+1] += 2; break; }
+      --total;
+   }
+   // least frequent symbols get the longest codes
+   for (k=0, i=limit; i > 0; --i)
+      for (j=count[i]; j > 0; --j)
+         lengths[sym[k++]] = (unsigned char) i;
+}
+
+// canonical codes, bit-reversed since deflate sends them LSB first
+static void stbi__zlib_build_codes(const unsigned char *lengths, int n, unsigned short *codes)
+{
+   int count[stbi__ZMAX_BITS+1], next[stbi__ZMAX_BITS+1], i, code=0;
+   memset(count, 0, sizeof(count));
+   for (i=0; i < n; ++i) ++count[lengths[i]];
+   count[0] = 0;
+   for (i=1; i <= stbi__ZMAX_BITS; ++i) {
+      code = (code + count[i-1]) << 1;
+      next[i] = code;
+   }
+   for (i=0; i < n; ++i)
+      if (lengths[i])
+         codes[i] = (unsigned short) stbi__zlib_bitrev(next[lengths[i]]++, lengths[i]);
+}
+
+static void stbi__zlib_fixed_lengths(unsigned char *llen, unsigned char *dlen)
+{
+   int i;
+   for (i=0;   i <= 143; ++i) llen[i] = 8;
+   for (     ; i <= 255; ++i) llen[i] = 9;
+   for (     ; i <= 279; ++i) llen[i] = 7;
+   for (     ; i <= 287; ++i) llen[i] = 8;
+   for (i=0;   i <  30; ++i)  dlen[i] = 5;
+}
+
+// run-length code the literal/length and distance code lengths with the
+// code length alphabet's 16 (repeat previous), 17 and 18 (repeat zero)
+static int stbi__zlib_rle_lengths(const unsigned char *lens, int n, unsigned char *rle, unsigned int *cfreq)
+{
+   int i=0, k=0, run;
+   while (i < n) {
+      int v = lens[i];
+      for (run=1; i+run < n && lens[i+run] == v; ++run);
+      if (v == 0 && run >= 3) {
+         int r = run > 138 ? 138 : run;
+         if (r <= 10) { rle[k++] = 17; rle[k++] = (unsigned char) (r-3); }
+         else         { rle[k++] = 18; rle[k++] = (unsigned char) (r-11); }
+         ++cfreq[rle[k-2]];
+         i += r;
+      } else if (v != 0 && run >= 4) {
+         int r = run-1 > 6 ? 6 : run-1;
+         rle[k++] = (unsigned char) v; ++cfreq[v];
+         rle[k++] = 16; rle[k++] = (unsigned char) (r-3); ++cfreq[16];
+         i += r+1;
+      } else {
+         rle[k++] = (unsigned char) v; ++cfreq[v];
+         ++i;
       }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbi__sbn(hash_table[h]) == 2*quality) {
-         memcpy(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbi__sbn(hash_table[h]) = quality;
+   }
+   return k;
+}
+
+static int stbi__zlib_symbol_bits(stbi__zenc *z, const unsigned char *llen, const unsigned char *dlen)
+{
+   int i, bits=0;
+   for (i=0; i < 286; ++i) bits += z->lfreq[i] * llen[i];
+   for (i=0; i < 29;  ++i) bits += z->lfreq[257+i] * stbi__zlength_extra[i];
+   for (i=0; i < 30;  ++i) bits += z->dfreq[i] * (dlen[i] + stbi__zdist_extra[i]);
+   return bits;
+}
+
+static void stbi__zlib_send_symbols(stbi__zenc *z, const unsigned char *llen, const unsigned short *lcode,
+                                    const unsigned char *dlen, const unsigned short *dcode)
+{
+   int i;
+   for (i=0; i < z->nsyms; ++i) {
+      int d = z->dbuf[i];
+      if (d == 0) {
+         int c = z->lbuf[i];
+         stbi__zlib_add(z, lcode[c], llen[c]);
+      } else {
+         int len = z->lbuf[i] + 3, j = z->len_sym[len];
+         stbi__zlib_add(z, lcode[257+j], llen[257+j]);
+         if (stbi__zlength_extra[j]) stbi__zlib_add(z, len - stbi__zlength_base[j], stbi__zlength_extra[j]);
+         j = stbi__zdist_code(z, d);
+         stbi__zlib_add(z, dcode[j], dlen[j]);
+         if (stbi__zdist_extra[j]) stbi__zlib_add(z, d - stbi__zdist_base[j], stbi__zdist_extra[j]);
       }
-      stbi__sbpush(hash_table[h],data+i);
-
-      if (bestloc) {
-         // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbi__zhash(data+i+1)&(stbi__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbi__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbi__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
+   }
+   stbi__zlib_add(z, lcode[256], llen[256]);
+}
+
+static void stbi__zlib_send_stored(stbi__zenc *z, int start, int len, int final)
+{
+   do {
+      int n = len > 65535 ? 65535 : len;
+      stbi__zlib_add(z, (final && n == len) ? 1 : 0, 1);
+      stbi__zlib_add(z, 0, 2);
+      if (z->bitcount) stbi__zlib_add(z, 0, 8 - z->bitcount);
+      stbi__zlib_add(z, n, 16);
+      stbi__zlib_add(z, n ^ 0xffff, 16);
+      memcpy(z->out + z->out_len, z->data + start, n);
+      z->out_len += n;
+      start += n;
+      len -= n;
+   } while (len > 0);
+}
+
+// send the buffered symbols (covering input from block_start to end) as
+// one block, using whichever encoding is smallest
+static void stbi__zlib_flush_block(stbi__zenc *z, int end, int final)
+{
+   unsigned char llen[288], dlen[30], clen[19], rle[286+30];
+   unsigned short lcode[288], dcode[30], ccode[19];
+   unsigned char fllen[288], fdlen[30];
+   unsigned int cfreq[19];
+   int i, nlit, ndist, nclen, nrle, dyn_bits, fixed_bits, stored_bits, len = end - z->block_start;
+
+   z->lfreq[256] = 1;
+   stbi__zlib_build_lengths(z->lfreq, 286, stbi__ZMAX_BITS, llen);
+   stbi__zlib_build_lengths(z->dfreq, 30,  stbi__ZMAX_BITS, dlen);
+   nlit = 286;
+   while (nlit > 257 && !llen[nlit-1]) --nlit;
+   ndist = 30;
+   while (ndist > 1 && !dlen[ndist-1]) --ndist;
+
+   // code lengths are sent as one run so repeats can span both tables
+   {
+      unsigned char lens[286+30];
+      memcpy(lens, llen, nlit);
+      memcpy(lens + nlit, dlen, ndist);
+      memset(cfreq, 0, sizeof(cfreq));
+      nrle = stbi__zlib_rle_lengths(lens, nlit + ndist, rle, cfreq);
+   }
+   stbi__zlib_build_lengths(cfreq, 19, 7, clen);
+   for (nclen=19; nclen > 4 && !clen[stbi__zclen_order[nclen-1]]; --nclen);
+
+   dyn_bits = 3 + 14 + 3*nclen + stbi__zlib_symbol_bits(z, llen, dlen);
+   for (i=0; i < 19; ++i)
+      dyn_bits += cfreq[i] * clen[i];
+   dyn_bits += cfreq[16]*2 + cfreq[17]*3 + cfreq[18]*7;
+
+   stbi__zlib_fixed_lengths(fllen, fdlen);
+   fixed_bits = 3 + stbi__zlib_symbol_bits(z, fllen, fdlen);
+   stored_bits = (len / 65535 + 1) * 40 + len * 8;
+
+   if (!stbi__zlib_reserve(z, len + (len / 65535 + 1) * 5 + 8)) return;
+
+   if (stored_bits <= dyn_bits && stored_bits <= fixed_bits) {
+      stbi__zlib_send_stored(z, z->block_start, len, final);
+   } else if (fixed_bits <= dyn_bits) {
+      stbi__zlib_build_codes(fllen, 288, lcode);
+      stbi__zlib_build_codes(fdlen, 30, dcode);
+      stbi__zlib_add(z, final, 1);
+      stbi__zlib_add(z, 1, 2);   // BTYPE = 1 -- fixed huffman
+      stbi__zlib_send_symbols(z, fllen, lcode, fdlen, dcode);
+   } else {
+      stbi__zlib_build_codes(llen, 286, lcode);
+      stbi__zlib_build_codes(dlen, 30, dcode);
+      stbi__zlib_build_codes(clen, 19, ccode);
+      stbi__zlib_add(z, final, 1);
+      stbi__zlib_add(z, 2, 2);   // BTYPE = 2 -- dynamic huffman
+      stbi__zlib_add(z, nlit - 257, 5);
+      stbi__zlib_add(z, ndist - 1, 5);
+      stbi__zlib_add(z, nclen - 4, 4);
+      for (i=0; i < nclen; ++i)
+         stbi__zlib_add(z, clen[stbi__zclen_order[i]], 3);
+      for (i=0; i < nrle; ++i) {
+         int c = rle[i];
+         stbi__zlib_add(z, ccode[c], clen[c]);
+         if (c == 16) stbi__zlib_add(z, rle[++i], 2);
+         if (c == 17) stbi__zlib_add(z, rle[++i], 3);
+         if (c == 18) stbi__zlib_add(z, rle[++i], 7);
+      }
+      stbi__zlib_send_symbols(z, llen, lcode, dlen, dcode);
+   }
+
+   memset(z->lfreq, 0, sizeof(z->lfreq));
+   memset(z->dfreq, 0, sizeof(z->dfreq));
+   z->nsyms = 0;
+   z->block_start = end;
+}
+
+static void stbi__zlib_literal(stbi__zenc *z, int pos)
+{
+   z->lbuf[z->nsyms] = z->data[pos];
+   z->dbuf[z->nsyms++] = 0;
+   ++z->lfreq[z->data[pos]];
+}
+
+static void stbi__zlib_match(stbi__zenc *z, int len, int dist)
+{
+   z->lbuf[z->nsyms] = (unsigned char) (len - 3);
+   z->dbuf[z->nsyms++] = (unsigned short) dist;
+   ++z->lfreq[257 + z->len_sym[len]];
+   ++z->dfreq[stbi__zdist_code(z, dist)];
+}
+
+static void stbi__zlib_insert(stbi__zenc *z, int pos)
+{
+   if (pos + 3 <= z->data_len) {
+      unsigned int h = stbi__zhash(z->data + pos);
+      z->prev[pos & (stbi__ZWINDOW-1)] = z->head[h];
+      z->head[h] = pos;
+   }
+}
+
+// longest match at pos that beats prev_len, or 0; the chain only holds
+// positions before pos, so an entry's prev link is never stale while it's
+// within the window
+static int stbi__zlib_longest_match(stbi__zenc *z, int pos, int prev_len, int *dist)
+{
+   unsigned char *data = z->data, *cur = data + pos;
+   int limit = z->data_len - pos, chain = z->level->max_chain, nice = z->level->nice_length;
+   int best = prev_len < 2 ? 2 : prev_len, found = 0, c;
+   if (limit > 258) limit = 258;
+   if (limit < 3 || best >= limit) return 0;
+   if (nice > limit) nice = limit;
+   if (prev_len >= z->level->good_length) chain >>= 2;
+   c = z->head[stbi__zhash(cur)];
+   while (c >= 0 && pos - c <= stbi__ZWINDOW && chain-- > 0) {
+      unsigned char *m = data + c;
+      if (m[best] == cur[best] && m[0] == cur[0] && m[1] == cur[1]) {
+         int n = 2;
+         // compare 8 bytes at a time, then finish off bytewise
+         while (n + 8 <= limit) {
+            stbiw_uint32 a[2], b[2];
+            memcpy(a, m + n, 8);
+            memcpy(b, cur + n, 8);
+            if (a[0] != b[0] || a[1] != b[1]) break;
+            n += 8;
+         }
+         while (n < limit && m[n] == cur[n]) ++n;
+         if (n > best) {
+            best = found = n;
+            *dist = pos - c;
+            if (n >= nice) break;
          }
       }
+      c = z->prev[c & (stbi__ZWINDOW-1)];
+   }
+   // a minimum-length match that far back costs more than the literals
+   if (found == 3 && *dist > 4096) found = 0;
+   return found;
+}
 
-      if (bestloc) {
-         int d = (int)(data+i - bestloc); // distance back
-         assert(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbi__zlib_huff(j+257);
-         if (lengtheb[j]) stbi__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbi__zlib_add(stbi__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbi__zlib_add(d - distc[j], disteb[j]);
-         i += best;
+static void stbi__zlib_deflate(stbi__zenc *z, int start)
+{
+   const stbi__zlevel *lv = z->level;
+   int pos = start, len, dist = 0, prev_len = 0, prev_dist = 0, pending = 0;
+   while (pos < z->data_len) {
+      if (z->nsyms >= stbi__ZBLOCK - 1) {
+         stbi__zlib_flush_block(z, pending ? pos-1 : pos, 0);
+         if (z->failed) return;
+      }
+      if (!lv->lazy) {
+         len = stbi__zlib_longest_match(z, pos, 0, &dist);
+         stbi__zlib_insert(z, pos);
+         if (len) {
+            stbi__zlib_match(z, len, dist);
+            if (len <= lv->max_lazy)
+               while (--len) stbi__zlib_insert(z, ++pos);
+            else
+               pos += len - 1;
+            ++pos;
+         } else {
+            stbi__zlib_literal(z, pos++);
+         }
+         continue;
+      }
+      // lazy: hold each match back one byte in case the next one is longer
+      len = prev_len < lv->max_lazy ? stbi__zlib_longest_match(z, pos, prev_len, &dist) : 0;
+      stbi__zlib_insert(z, pos);
+      if (prev_len && !len) {
+         stbi__zlib_match(z, prev_len, prev_dist);
+         // pos-1 and pos are already in the chains
+         for (pos += 1, len = prev_len - 2; len > 0; --len)
+            stbi__zlib_insert(z, pos++);
+         prev_len = pending = 0;
       } else {
-         stbi__zlib_huffb(data[i]);
-         ++i;
+         if (pending) stbi__zlib_literal(z, pos-1);
+         prev_len = len;
+         prev_dist = dist;
+         pending = 1;
+         ++pos;
       }
    }
-   // write out final bytes
-   for (;i < data_len; ++i)
-      stbi__zlib_huffb(data[i]);
-   stbi__zlib_huff(256); // end of block
+   if (pending) {
+      if (prev_len) stbi__zlib_match(z, prev_len, prev_dist);
+      else          stbi__zlib_literal(z, pos-1);
+   }
+}
+
+static void stbi__zlib_end(stbi__zenc *z)
+{
+   free(z->head);
+   free(z->prev);
+   free(z->lbuf);
+   free(z->dbuf);
+}
+
+// set up an encoder whose input stops at data_len, expecting about in_len
+// bytes to compress, with 'skip' bytes left free at the start of the
+// output for a header
+static int stbi__zlib_begin(stbi__zenc *z, unsigned char *data, int data_len, int in_len, int quality, int skip)
+{
+   int i,j;
+   memset(z, 0, sizeof(*z));
+   z->data = data;
+   z->data_len = data_len;
+   z->level = &stbi__zlevels[quality];
+   z->out_cap = in_len / 2 + 64 + skip;
+   z->out_len = skip;
+   z->out = (unsigned char *) malloc(z->out_cap);
+   z->head = (int *) malloc(sizeof(int) * stbi__ZHASH);
+   z->prev = (int *) malloc(sizeof(int) * stbi__ZWINDOW);
+   z->lbuf = (unsigned char *) malloc(stbi__ZBLOCK);
+   z->dbuf = (unsigned short *) malloc(sizeof(unsigned short) * stbi__ZBLOCK);
+   if (!z->out || !z->head || !z->prev || !z->lbuf || !z->dbuf) {
+      stbi__zlib_end(z);
+      free(z->out);
+      z->out = NULL;
+      return 0;
+   }
+   memset(z->head, 0xff, sizeof(int) * stbi__ZHASH); // -1: empty chain
+   for (j=0; j < 29; ++j)
+      for (i=stbi__zlength_base[j]; i <= (j < 28 ? stbi__zlength_base[j+1]-1 : 258); ++i)
+         z->len_sym[i] = (unsigned char) j;
+   for (j=0; j < 30; ++j)
+      for (i=stbi__zdist_base[j]-1; i < (j < 29 ? stbi__zdist_base[j+1]-1 : 32768); ++i)
+         z->dist_sym[i < 256 ? i : 256 + (i >> 7)] = (unsigned char) j;
+   return 1;
+}
+
+// raw deflate of data[start,end) into a new z->out. matches may reach back
+// into the 32K before start, so a band compresses about as well as it
+// would in one long stream; every band but the last ends with a sync flush
+// (an empty stored block) so that the bands' outputs simply concatenate
+static int stbi__zlib_band(stbi__zenc *z, unsigned char *data, int start, int end, int quality, int final, int skip)
+{
+   int p;
+   if (!stbi__zlib_begin(z, data, end, end - start, quality, skip)) return 0;
+   if (quality == 0) {
+      if (stbi__zlib_reserve(z, end - start + ((end - start) / 65535 + 1) * 5 + 8))
+         stbi__zlib_send_stored(z, start, end - start, final);
+   } else {
+      for (p = start > stbi__ZWINDOW ? start - stbi__ZWINDOW : 0; p < start; ++p)
+         stbi__zlib_insert(z, p);
+      z->block_start = start;
+      stbi__zlib_deflate(z, start);
+      if (!z->failed) stbi__zlib_flush_block(z, end, final);
+   }
+   if (!z->failed && !final && stbi__zlib_reserve(z, 8)) {
+      stbi__zlib_add(z, 0, 3);
+      if (z->bitcount) stbi__zlib_add(z, 0, 8 - z->bitcount);
+      stbi__zlib_add(z, 0, 16);
+      stbi__zlib_add(z, 0xffff, 16);
+   }
    // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbi__zlib_add(0,1);
+   if (!z->failed && z->bitcount) stbi__zlib_add(z, 0, 8 - z->bitcount);
+   stbi__zlib_end(z);
+   if (z->failed) {
+      free(z->out);
+      z->out = NULL;
+      return 0;
+   }
+   return 1;
+}
 
-   for (i=0; i < stbi__ZHASH; ++i)
-      (void) stbi__sbfree(hash_table[i]);
+// checksums: define STBIW_CRC32(crc,data,len) and STBIW_ADLER32(adler,data,len)
+// before including to supply faster ones. both continue a running value,
+// zlib-style: a new crc starts from 0, a new adler from 1
+#ifndef STBIW_ADLER32
+#define STBIW_ADLER32 stbi__adler32
+static unsigned int stbi__adler32(unsigned int adler, const unsigned char *data, size_t len)
+{
+   unsigned int i=0, s1 = adler & 0xffff, s2 = adler >> 16, blocklen = (unsigned int) (len % 5552);
+   size_t j=0;
+   while (j < len) {
+      for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
+      s1 %= 65521, s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   return (s2 << 16) | s1;
+}
+#endif
 
-   {
-      // compute adler32 on input
-      unsigned int i=0, s1=1, s2=0, blocklen = data_len % 5552;
-      int j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
-         s1 %= 65521, s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbi__sbpush(out, (unsigned char) (s2 >> 8));
-      stbi__sbpush(out, (unsigned char) s2);
-      stbi__sbpush(out, (unsigned char) (s1 >> 8));
-      stbi__sbpush(out, (unsigned char) s1);
+// adler32 of A followed by B, from the adler32s of both and B's length
+static unsigned int stbi__adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
+{
+   unsigned int rem = len2 % 65521;
+   unsigned int s1 = adler1 & 0xffff;
+   unsigned int s2 = (rem * s1) % 65521;
+   s1 += (adler2 & 0xffff) + 65521 - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 65521*2) s2 -= 65521*2;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+
+// zlib header: CMF = deflate with 32K window, FLG = FLEVEL + check bits
+static const unsigned char stbi__zlib_flg[10] = { 0x01,0x01,0x5e,0x5e,0x5e,0x5e,0x9c,0xda,0xda,0xda };
+
+unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+   stbi__zenc z;
+   unsigned int adler;
+
+   if (quality < 0) quality = 6;
+   if (quality > 9) quality = 9;
+   if (!stbi__zlib_band(&z, data, 0, data_len, quality, 1, 2)) return NULL;
+   z.out[0] = 0x78;
+   z.out[1] = stbi__zlib_flg[quality];
+   if (!stbi__zlib_reserve(&z, 4)) {
+      free(z.out);
+      return NULL;
    }
-   *out_len = stbi__sbn(out);
-   // make returned pointer freeable
-   memmove(stbi__sbraw(out), out, *out_len);
-   return (unsigned char *) stbi__sbraw(out);
+   adler = STBIW_ADLER32(1, data, data_len);
+   z.out[z.out_len++] = (unsigned char) (adler >> 24);
+   z.out[z.out_len++] = (unsigned char) (adler >> 16);
+   z.out[z.out_len++] = (unsigned char) (adler >> 8);
+   z.out[z.out_len++] = (unsigned char) adler;
+   *out_len = z.out_len;
+   return z.out;
 }
 
-unsigned int stbi__crc32(unsigned char *buffer, int len)
+#ifndef STBIW_CRC32
+#define STBIW_CRC32 stbi__crc32_update
+static const unsigned int stbi__crc_table[256] =
 {
-   static unsigned int crc_table[256];
-   unsigned int crc = ~0u;
-   int i,j;
-   if (crc_table[1] == 0)
-      for(i=0; i < 256; i++)
-         for (crc_table[i]=i, j=0; j < 8; ++j)
-            crc_table[i] = (crc_table[i] >> 1) ^ (crc_table[i] & 1 ? 0xedb88320 : 0);
+      0x00000000,0x77073096,0xee0e612c,0x990951ba,0x076dc419,0x706af48f,0xe963a535,0x9e6495a3,
+      0x0edb8832,0x79dcb8a4,0xe0d5e91e,0x97d2d988,0x09b64c2b,0x7eb17cbd,0xe7b82d07,0x90bf1d91,
+      0x1db71064,0x6ab020f2,0xf3b97148,0x84be41de,0x1adad47d,0x6ddde4eb,0xf4d4b551,0x83d385c7,
+      0x136c9856,0x646ba8c0,0xfd62f97a,0x8a65c9ec,0x14015c4f,0x63066cd9,0xfa0f3d63,0x8d080df5,
+      0x3b6e20c8,0x4c69105e,0xd56041e4,0xa2677172,0x3c03e4d1,0x4b04d447,0xd20d85fd,0xa50ab56b,
+      0x35b5a8fa,0x42b2986c,0xdbbbc9d6,0xacbcf940,0x32d86ce3,0x45df5c75,0xdcd60dcf,0xabd13d59,
+      0x26d930ac,0x51de003a,0xc8d75180,0xbfd06116,0x21b4f4b5,0x56b3c423,0xcfba9599,0xb8bda50f,
+      0x2802b89e,0x5f058808,0xc60cd9b2,0xb10be924,0x2f6f7c87,0x58684c11,0xc1611dab,0xb6662d3d,
+      0x76dc4190,0x01db7106,0x98d220bc,0xefd5102a,0x71b18589,0x06b6b51f,0x9fbfe4a5,0xe8b8d433,
+      0x7807c9a2,0x0f00f934,0x9609a88e,0xe10e9818,0x7f6a0dbb,0x086d3d2d,0x91646c97,0xe6635c01,
+      0x6b6b51f4,0x1c6c6162,0x856530d8,0xf262004e,0x6c0695ed,0x1b01a57b,0x8208f4c1,0xf50fc457,
+      0x65b0d9c6,0x12b7e950,0x8bbeb8ea,0xfcb9887c,0x62dd1ddf,0x15da2d49,0x8cd37cf3,0xfbd44c65,
+      0x4db26158,0x3ab551ce,0xa3bc0074,0xd4bb30e2,0x4adfa541,0x3dd895d7,0xa4d1c46d,0xd3d6f4fb,
+      0x4369e96a,0x346ed9fc,0xad678846,0xda60b8d0,0x44042d73,0x33031de5,0xaa0a4c5f,0xdd0d7cc9,
+      0x5005713c,0x270241aa,0xbe0b1010,0xc90c2086,0x5768b525,0x206f85b3,0xb966d409,0xce61e49f,
+      0x5edef90e,0x29d9c998,0xb0d09822,0xc7d7a8b4,0x59b33d17,0x2eb40d81,0xb7bd5c3b,0xc0ba6cad,
+      0xedb88320,0x9abfb3b6,0x03b6e20c,0x74b1d29a,0xead54739,0x9dd277af,0x04db2615,0x73dc1683,
+      0xe3630b12,0x94643b84,0x0d6d6a3e,0x7a6a5aa8,0xe40ecf0b,0x9309ff9d,0x0a00ae27,0x7d079eb1,
+      0xf00f9344,0x8708a3d2,0x1e01f268,0x6906c2fe,0xf762575d,0x806567cb,0x196c3671,0x6e6b06e7,
+      0xfed41b76,0x89d32be0,0x10da7a5a,0x67dd4acc,0xf9b9df6f,0x8ebeeff9,0x17b7be43,0x60b08ed5,
+      0xd6d6a3e8,0xa1d1937e,0x38d8c2c4,0x4fdff252,0xd1bb67f1,0xa6bc5767,0x3fb506dd,0x48b2364b,
+      0xd80d2bda,0xaf0a1b4c,0x36034af6,0x41047a60,0xdf60efc3,0xa867df55,0x316e8eef,0x4669be79,
+      0xcb61b38c,0xbc66831a,0x256fd2a0,0x5268e236,0xcc0c7795,0xbb0b4703,0x220216b9,0x5505262f,
+      0xc5ba3bbe,0xb2bd0b28,0x2bb45a92,0x5cb36a04,0xc2d7ffa7,0xb5d0cf31,0x2cd99e8b,0x5bdeae1d,
+      0x9b64c2b0,0xec63f226,0x756aa39c,0x026d930a,0x9c0906a9,0xeb0e363f,0x72076785,0x05005713,
+      0x95bf4a82,0xe2b87a14,0x7bb12bae,0x0cb61b38,0x92d28e9b,0xe5d5be0d,0x7cdcefb7,0x0bdbdf21,
+      0x86d3d2d4,0xf1d4e242,0x68ddb3f8,0x1fda836e,0x81be16cd,0xf6b9265b,0x6fb077e1,0x18b74777,
+      0x88085ae6,0xff0f6a70,0x66063bca,0x11010b5c,0x8f659eff,0xf862ae69,0x616bffd3,0x166ccf45,
+      0xa00ae278,0xd70dd2ee,0x4e048354,0x3903b3c2,0xa7672661,0xd06016f7,0x4969474d,0x3e6e77db,
+      0xaed16a4a,0xd9d65adc,0x40df0b66,0x37d83bf0,0xa9bcae53,0xdebb9ec5,0x47b2cf7f,0x30b5ffe9,
+      0xbdbdf21c,0xcabac28a,0x53b39330,0x24b4a3a6,0xbad03605,0xcdd70693,0x54de5729,0x23d967bf,
+      0xb3667a2e,0xc4614ab8,0x5d681b02,0x2a6f2b94,0xb40bbe37,0xc30c8ea1,0x5a05df1b,0x2d02ef8d
+};
+
+static unsigned int stbi__crc32_update(unsigned int crc, const unsigned char *buffer, size_t len)
+{
+   size_t i;
+   crc = ~crc;
    for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
+      crc = (crc >> 8) ^ stbi__crc_table[buffer[i] ^ (crc & 0xff)];
    return ~crc;
 }
+#endif
 
-#define stbi__wpng4(o,a,b,c,d) ((o)[0]=(unsigned char)(a),(o)[1]=(unsigned char)(b),(o)[2]=(unsigned char)(c),(o)[3]=(unsigned char)(d),(o)+=4)
-#define stbi__wp32(data,v) stbi__wpng4(data, (v)>>24,(v)>>16,(v)>>8,(v));
-#define stbi__wptag(data,s) stbi__wpng4(data, s[0],s[1],s[2],s[3])
+unsigned int stbi__crc32(unsigned char *buffer, int len)
+{
+   return STBIW_CRC32(0, buffer, len);
+}
+
+static void stbi__gf2_square(unsigned int *square, const unsigned int *mat)
+{
+   int n;
+   for (n=0; n < 32; ++n) {
+      unsigned int vec = mat[n], sum = 0;
+      const unsigned int *m = mat;
+      for (; vec; vec >>= 1, ++m)
+         if (vec & 1) sum ^= *m;
+      square[n] = sum;
+   }
+}
+
+static unsigned int stbi__gf2_times(const unsigned int *mat, unsigned int vec)
+{
+   unsigned int sum = 0;
+   for (; vec; vec >>= 1, ++mat)
+      if (vec & 1) sum ^= *mat;
+   return sum;
+}
 
-static void stbi__wpcrc(unsigned char **data, int len)
+// crc32 of A followed by B, from the crc32s of both and B's length: runs
+// len2 zero bytes through crc1 using repeatedly squared shift operators
+static unsigned int stbi__crc32_combine(unsigned int crc1, unsigned int crc2, unsigned int len2)
 {
-   unsigned int crc = stbi__crc32(*data - len - 4, len+4);
-   stbi__wp32(*data, crc);
+   unsigned int even[32], odd[32], row = 1;
+   int n;
+   if (len2 == 0) return crc1;
+   odd[0] = 0xedb88320;   // operator for one zero bit
+   for (n=1; n < 32; ++n, row <<= 1)
+      odd[n] = row;
+   stbi__gf2_square(even, odd);   // two zero bits
+   stbi__gf2_square(odd, even);   // four zero bits
+   do {
+      stbi__gf2_square(even, odd);
+      if (len2 & 1) crc1 = stbi__gf2_times(even, crc1);
+      len2 >>= 1;
+      if (!len2) break;
+      stbi__gf2_square(odd, even);
+      if (len2 & 1) crc1 = stbi__gf2_times(odd, crc1);
+      len2 >>= 1;
+   } while (len2);
+   return crc1 ^ crc2;
 }
 
+#define stbi__wpng4(o,a,b,c,d) ((o)[0]=(unsigned char)(a),(o)[1]=(unsigned char)(b),(o)[2]=(unsigned char)(c),(o)[3]=(unsigned char)(d),(o)+=4)
+#define stbi__wp32(data,v) stbi__wpng4(data, (v)>>24,(v)>>16,(v)>>8,(v));
+#define stbi__wptag(data,s) stbi__wpng4(data, s[0],s[1],s[2],s[3])
+
 static unsigned char stbi__paeth(int a, int b, int c)
 {
    int p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
@@ -396,73 +1101,271 @@ static unsigned char stbi__paeth(int a, int b, int c)
    return (unsigned char) c;
 }
 
-unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+int stbi_write_png_filter = STBIW_PNG_FILTER_MSAD;
+
+#ifdef STBIW_SSE2
+// sum of |x| over 16 signed bytes, added to the two 64-bit lanes of acc
+static __m128i stbi__sad16(__m128i acc, __m128i x)
 {
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int i,j,k,p,zlen;
+   __m128i zero = _mm_setzero_si128();
+   __m128i neg = _mm_cmplt_epi8(x, zero);
+   return _mm_add_epi64(acc, _mm_sad_epu8(_mm_sub_epi8(_mm_xor_si128(x, neg), neg), zero));
+}
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+// paeth predictor on 8 16-bit lanes; same choice as stbi__paeth
+static __m128i stbi__paeth8(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c);
+   __m128i pb = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i smallest, t, pred;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+   t    = _mm_cmpeq_epi16(smallest, pb);
+   pred = _mm_or_si128(_mm_and_si128(t, b), _mm_andnot_si128(t, c));
+   t    = _mm_cmpeq_epi16(smallest, pa);
+   return _mm_or_si128(_mm_and_si128(t, a), _mm_andnot_si128(t, pred));
+}
 
-   filt = (unsigned char *) malloc((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) malloc(x * n); if (!line_buffer) { free(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      static int mapping[] = { 0,1,2,3,4 };
-      static int firstmap[] = { 0,1,0,5,6 };
-      int *mymap = j ? mapping : firstmap;
-      int best = 0, bestval = 0x7fffffff;
-      for (p=0; p < 2; ++p) {
-         for (k= p?best:0; k < 5; ++k) {
-            int type = mymap[k],est=0;
-            unsigned char *z = pixels + stride_bytes*j;
-            for (i=0; i < n; ++i)
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - (z[i-stride_bytes]>>1); break;
-                  case 4: line_buffer[i] = (signed char) (z[i] - stbi__paeth(0,z[i-stride_bytes],0)); break;
-                  case 5: line_buffer[i] = z[i]; break;
-                  case 6: line_buffer[i] = z[i]; break;
-               }
-            for (i=n; i < x*n; ++i) {
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i] - z[i-n]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - ((z[i-n] + z[i-stride_bytes])>>1); break;
-                  case 4: line_buffer[i] = z[i] - stbi__paeth(z[i-n], z[i-stride_bytes], z[i-stride_bytes-n]); break;
-                  case 5: line_buffer[i] = z[i] - (z[i-n]>>1); break;
-                  case 6: line_buffer[i] = z[i] - stbi__paeth(z[i-n], 0,0); break;
-               }
+// 16 bytes at a time from i while they fit before end; i >= n so every
+// byte has a left neighbour. returns where it stopped
+static int stbi__png_filter_sse2(int type, const unsigned char *z, const unsigned char *b, int n, int i, int end, signed char *out, int *sum)
+{
+   __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1), acc = zero, x, pa, pb, pc, f;
+   for (; i+16 <= end; i += 16) {
+      x = _mm_loadu_si128((__m128i const *) (z+i));
+      switch (type) {
+         case 0: f = x; break;
+         case 1: f = _mm_sub_epi8(x, _mm_loadu_si128((__m128i const *) (z+i-n))); break;
+         case 2: f = _mm_sub_epi8(x, _mm_loadu_si128((__m128i const *) (b+i))); break;
+         case 3:
+            pa = _mm_loadu_si128((__m128i const *) (z+i-n));
+            pb = _mm_loadu_si128((__m128i const *) (b+i));
+            // floor((a+b)/2): the rounding-up average minus the carry
+            f = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(pa, pb), _mm_and_si128(_mm_xor_si128(pa, pb), one)));
+            break;
+         default:
+            pa = _mm_loadu_si128((__m128i const *) (z+i-n));
+            pb = _mm_loadu_si128((__m128i const *) (b+i));
+            pc = _mm_loadu_si128((__m128i const *) (b+i-n));
+            f = _mm_packus_epi16(stbi__paeth8(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero), _mm_unpacklo_epi8(pc, zero)),
+                                 stbi__paeth8(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero), _mm_unpackhi_epi8(pc, zero)));
+            f = _mm_sub_epi8(x, f);
+            break;
+      }
+      _mm_storeu_si128((__m128i *) (out+i), f);
+      acc = stbi__sad16(acc, f);
+   }
+   *sum += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+   return i;
+}
+#endif
+
+// filter bytes [i,end) of row z with filter 'type' into out, and return
+// the sum of the absolute filtered values. b is the prior row (all zeros
+// for the first row) and n the bytes per pixel
+static int stbi__png_filter_span(int type, const unsigned char *z, const unsigned char *b, int n, int i, int end, signed char *out)
+{
+   int sum = 0;
+   // the first pixel has no left neighbour
+   for (; i < n && i < end; ++i) {
+      switch (type) {
+         case 0: out[i] = (signed char) z[i]; break;
+         case 1: out[i] = (signed char) z[i]; break;
+         case 2: out[i] = (signed char) (z[i] - b[i]); break;
+         case 3: out[i] = (signed char) (z[i] - (b[i]>>1)); break;
+         case 4: out[i] = (signed char) (z[i] - b[i]); break;
+      }
+      sum += abs(out[i]);
+   }
+   #ifdef STBIW_SSE2
+   i = stbi__png_filter_sse2(type, z, b, n, i, end, out, &sum);
+   #endif
+   switch (type) {
+      case 0: for (; i < end; ++i) sum += abs(out[i] = (signed char) z[i]); break;
+      case 1: for (; i < end; ++i) sum += abs(out[i] = (signed char) (z[i] - z[i-n])); break;
+      case 2: for (; i < end; ++i) sum += abs(out[i] = (signed char) (z[i] - b[i])); break;
+      case 3: for (; i < end; ++i) sum += abs(out[i] = (signed char) (z[i] - ((z[i-n] + b[i])>>1))); break;
+      case 4: for (; i < end; ++i) sum += abs(out[i] = (signed char) (z[i] - stbi__paeth(z[i-n], b[i], b[i-n]))); break;
+   }
+   return sum;
+}
+
+// the sampled strategy scores filters on this many bytes out of every 4x as many
+#define stbi__PNG_SAMPLE_SPAN 64
+
+// filters nrows rows starting at 'pixels' into consecutive (x*n+1)-byte
+// slots of filt; 'prior' is the row above the first one, NULL for the top
+static int stbi__png_filter_rows(const unsigned char *pixels, const unsigned char *prior, int stride_bytes, int x, int n, unsigned char *filt, int nrows)
+{
+   int width = x*n, mode = stbi_write_png_filter, i, j, k;
+   // scratch: a zero prior row for row 0, and a second candidate row
+   unsigned char *zeros = (unsigned char *) calloc(width + 1, 2);
+   signed char *line, *cand, *best;
+   if (!zeros) return 0;
+   cand = (signed char *) zeros + width + 1;
+   if (mode > 4 || mode < STBIW_PNG_FILTER_SAMPLED) mode = STBIW_PNG_FILTER_MSAD;
+
+   // each row is filtered in place, in its own slot of filt
+   for (j=0; j < nrows; ++j) {
+      unsigned char *z = (unsigned char *) pixels + stride_bytes*j;
+      unsigned char *b = j ? z - stride_bytes : prior ? (unsigned char *) prior : zeros;
+      int type = mode, bestval;
+      line = (signed char *) filt + j*(width+1) + 1;
+      if (mode == STBIW_PNG_FILTER_MSAD) {
+         // keep the smallest so far in 'best', and filter into the other
+         best = line;
+         bestval = stbi__png_filter_span(0, z, b, n, 0, width, best);
+         type = 0;
+         for (k=1; k < 5; ++k) {
+            signed char *other = best == line ? cand : line;
+            int est = stbi__png_filter_span(k, z, b, n, 0, width, other);
+            if (est < bestval) { bestval = est; type = k; best = other; }
+         }
+         if (best != line) memcpy(line, best, width);
+      } else {
+         if (mode == STBIW_PNG_FILTER_SAMPLED) {
+            bestval = 0x7fffffff;
+            for (k=0; k < 5; ++k) {
+               int est = 0;
+               for (i=0; i < width; i += 4*stbi__PNG_SAMPLE_SPAN)
+                  est += stbi__png_filter_span(k, z, b, n, i, i + stbi__PNG_SAMPLE_SPAN < width ? i + stbi__PNG_SAMPLE_SPAN : width, cand);
+               if (est < bestval) { bestval = est; type = k; }
             }
-            if (p) break;
-            for (i=0; i < x*n; ++i)
-               est += abs((signed char) line_buffer[i]);
-            if (est < bestval) { bestval = est; best = k; }
          }
+         stbi__png_filter_span(type, z, b, n, 0, width, line);
       }
-      // when we get here, best contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) best;
-      memcpy(filt+j*(x*n+1)+1, line_buffer, x*n);
+      filt[j*(width+1)] = (unsigned char) type;
    }
-   free(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
-   free(filt);
-   if (!zlib) return 0;
+   free(zeros);
+   return 1;
+}
+
+stbiw_parallel_func stbi_write_parallel = STBIW_PARALLEL;
+
+// PNG data is encoded in row bands: the bands are filtered independently,
+// then deflated independently (see stbi__zlib_band), and each one goes out
+// as its own IDAT chunk. only a batch of bands is held at a time, plus the
+// 32K of filtered data before it that the first band's matches can reach
+typedef struct
+{
+   const unsigned char *pixels, *prior;
+   unsigned char *filt;
+   int stride_bytes, x, n, nrows;
+   int start, end, quality, final;
+   unsigned char *zlib;
+   int zlen;
+   unsigned int adler, crc;
+} stbi__png_band;
+
+#define stbi__PNG_BAND_BYTES  (1 << 20)
+#define stbi__PNG_BATCH_BANDS 8
+
+static void stbi__png_filter_job(void *job)
+{
+   stbi__png_band *b = (stbi__png_band *) job;
+   if (!stbi__png_filter_rows(b->pixels, b->prior, b->stride_bytes, b->x, b->n, b->filt + b->start, b->nrows))
+      b->quality = -1; // tells the deflate job to give up
+}
+
+static void stbi__png_deflate_job(void *job)
+{
+   stbi__png_band *b = (stbi__png_band *) job;
+   stbi__zenc z;
+   b->zlib = NULL;
+   if (b->quality < 0) return;
+   b->adler = STBIW_ADLER32(1, b->filt + b->start, b->end - b->start);
+   if (!stbi__zlib_band(&z, b->filt, b->start, b->end, b->quality, b->final, 0)) return;
+   b->zlib = z.out;
+   b->zlen = z.out_len;
+   b->crc = stbi__crc32(b->zlib, b->zlen);
+}
+
+static void stbi__run_jobs(stbiw_job_func func, void *jobs, int job_size, int num_jobs)
+{
+   int i;
+   if (stbi_write_parallel && num_jobs > 1) {
+      stbi_write_parallel(func, jobs, job_size, num_jobs);
+      return;
+   }
+   for (i=0; i < num_jobs; ++i)
+      func((unsigned char *) jobs + i*job_size);
+}
 
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) malloc(8 + 12+13 + 12+zlen + 12); 
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+// writes a chunk whose data (and CRC) is already in o[8..8+len)
+static void stbi__png_chunk(stbi_write_func *func, void *context, unsigned char *o, const char *tag, int len)
+{
+   unsigned char *p = o;
+   unsigned int crc;
+   stbi__wp32(p, len);
+   stbi__wptag(p, tag);
+   p += len;
+   crc = stbi__crc32(o + 4, len + 4);
+   stbi__wp32(p, crc);
+   func(context, o, len + 12);
+}
 
-   o=out;
-   memcpy(o,sig,8); o+= 8;
-   stbi__wp32(o, 13); // header length
-   stbi__wptag(o, "IHDR");
+// a band's IDAT: the zlib header goes in front of the first band, and the
+// adler32 of all the filtered data after the last
+static void stbi__png_idat(stbi_write_func *func, void *context, stbi__png_band *b, int first, unsigned int adler)
+{
+   unsigned char head[10], tail[8], *o = head;
+   int pre = first ? 2 : 0;
+   unsigned int crc;
+   stbi__wp32(o, pre + b->zlen + (b->final ? 4 : 0));
+   stbi__wptag(o, "IDAT");
+   if (first) {
+      *o++ = 0x78;
+      *o++ = stbi__zlib_flg[b->quality];
+   }
+   crc = stbi__crc32_combine(stbi__crc32(head + 4, 4 + pre), b->crc, b->zlen);
+   o = tail;
+   if (b->final) {
+      stbi__wp32(o, adler);
+      crc = stbi__crc32_combine(crc, stbi__crc32(tail, 4), 4);
+   }
+   stbi__wp32(o, crc);
+   func(context, head, 8 + pre);
+   if (b->zlen) func(context, b->zlib, b->zlen);
+   func(context, tail, (int) (o - tail));
+}
+
+// rows come either straight from 'pixels', or (if that's NULL) from the
+// row callback, which fills them into a buffer one batch at a time
+static int stbi__write_png_core(stbi_write_func *func, void *context, int x, int y, int n,
+                                const unsigned char *pixels, int stride_bytes,
+                                stbi_write_row_func *rows_func, void *rows_context, int quality)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char hdr[12+13], *o;
+   unsigned char *filt, *raw = NULL;
+   stbi__png_band bands[stbi__PNG_BATCH_BANDS];
+   int width = x*n+1, i, rows, batch_rows, row0, hist = 0, ok = 1;
+   unsigned int adler = 1;
+
+   if (x < 1 || y < 1 || n < 1 || n > 4) return 0;
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+   if (quality < 0) quality = 6;
+   if (quality > 9) quality = 9;
+
+   rows = stbi__PNG_BAND_BYTES / width;
+   if (rows < 1) rows = 1;
+   batch_rows = rows * stbi__PNG_BATCH_BANDS < y ? rows * stbi__PNG_BATCH_BANDS : y;
+
+   filt = (unsigned char *) malloc(stbi__ZWINDOW + (size_t) width * batch_rows); if (!filt) return 0;
+   if (!pixels) {
+      // the row above the batch, then the batch
+      raw = (unsigned char *) malloc((size_t) (x*n) * (batch_rows + 1)); if (!raw) { free(filt); return 0; }
+      stride_bytes = x * n;
+   }
+
+   func(context, sig, 8);
+   o = hdr + 8;
    stbi__wp32(o, x);
    stbi__wp32(o, y);
    *o++ = 8;
@@ -470,34 +1373,115 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
-   stbi__wpcrc(&o,13);
+   stbi__png_chunk(func, context, hdr, "IHDR", 13);
+
+   for (row0 = 0; row0 < y && ok; row0 += batch_rows) {
+      int nrows = y - row0 < batch_rows ? y - row0 : batch_rows;
+      int nbands = (nrows + rows - 1) / rows, len;
+      const unsigned char *src;
+      if (pixels)
+         src = pixels + (size_t) stride_bytes * row0;
+      else {
+         if (row0) memcpy(raw, raw + (size_t) stride_bytes * batch_rows, stride_bytes);
+         src = raw + stride_bytes;
+         for (i=0; i < nrows && ok; ++i)
+            ok = rows_func(rows_context, row0 + i, raw + (size_t) stride_bytes * (i+1));
+         if (!ok) break;
+      }
+      for (i=0; i < nbands; ++i) {
+         stbi__png_band *b = &bands[i];
+         b->pixels = src + (size_t) stride_bytes * (i * rows);
+         b->prior = row0 + i * rows ? b->pixels - stride_bytes : NULL;
+         b->filt = filt;
+         b->stride_bytes = stride_bytes;
+         b->x = x;
+         b->n = n;
+         b->nrows = (i+1) * rows < nrows ? rows : nrows - i * rows;
+         b->start = hist + i * rows * width;
+         b->end = b->start + b->nrows * width;
+         b->quality = quality;
+         b->final = (row0 + i * rows + b->nrows == y);
+      }
+      stbi__run_jobs(stbi__png_filter_job, bands, sizeof(*bands), nbands);
+      stbi__run_jobs(stbi__png_deflate_job, bands, sizeof(*bands), nbands);
+
+      for (i=0; i < nbands; ++i)
+         if (!bands[i].zlib) ok = 0;
+      for (i=0; i < nbands && ok; ++i) {
+         stbi__png_band *b = &bands[i];
+         adler = stbi__adler32_combine(adler, b->adler, b->end - b->start);
+         stbi__png_idat(func, context, b, row0 == 0 && i == 0, adler);
+      }
+      for (i=0; i < nbands; ++i)
+         free(bands[i].zlib);
 
-   stbi__wp32(o, zlen);
-   stbi__wptag(o, "IDAT");
-   memcpy(o, zlib, zlen); o += zlen; free(zlib);
-   stbi__wpcrc(&o, zlen);
+      // keep the last 32K for the next batch to match against
+      len = hist + nrows * width;
+      hist = len < stbi__ZWINDOW ? len : stbi__ZWINDOW;
+      memmove(filt, filt + len - hist, hist);
+   }
+   free(filt);
+   free(raw);
+   if (!ok) return 0;
 
-   stbi__wp32(o,0);
-   stbi__wptag(o, "IEND");
-   stbi__wpcrc(&o,0);
+   stbi__png_chunk(func, context, hdr, "IEND", 0);
+   return 1;
+}
 
-   assert(o == out + *out_len);
+int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   if (!data) return 0;
+   return stbi__write_png_core(func, context, x, y, comp, (const unsigned char *) data, stride_bytes, NULL, NULL, stbi_write_png_compression_level);
+}
 
-   return out;
+int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *rows, void *row_context, int level)
+{
+   if (!rows) return 0;
+   if (level < 0) level = stbi_write_png_compression_level;
+   return stbi__write_png_core(func, context, x, y, comp, NULL, 0, rows, row_context, level);
+}
+
+typedef struct
+{
+   unsigned char *data;
+   int len, cap, failed;
+} stbi__mem_context;
+
+static void stbi__mem_write(void *context, void *data, int size)
+{
+   stbi__mem_context *m = (stbi__mem_context *) context;
+   if (m->failed) return;
+   if (m->len + size > m->cap) {
+      int cap = m->cap ? m->cap : 4096;
+      unsigned char *p;
+      while (m->len + size > cap) cap *= 2;
+      p = (unsigned char *) realloc(m->data, cap);
+      if (!p) { m->failed = 1; return; }
+      m->data = p;
+      m->cap = cap;
+   }
+   memcpy(m->data + m->len, data, size);
+   m->len += size;
+}
+
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   stbi__mem_context m;
+   memset(&m, 0, sizeof(m));
+   if (!stbi__write_png_core(stbi__mem_write, &m, x, y, n, pixels, stride_bytes, NULL, NULL, stbi_write_png_compression_level) || m.failed) {
+      free(m.data);
+      return 0;
+   }
+   *out_len = m.len;
+   return m.data;
 }
 
 int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
-   FILE *f;
-   int len;
-   unsigned char *png = stbi_write_png_to_mem((unsigned char *) data, stride_bytes, x, y, comp, &len);
-   if (!png) return 0;
-   f = fopen(filename, "wb");
-   if (!f) { free(png); return 0; }
-   fwrite(png, 1, len, f);
-   fclose(f);
-   free(png);
-   return 1;
+   int ok;
+   if (!data) return 0;
+   stbi__write_file(ok, filename, stbi__write_png_core(stbi__stdio_write, f, x, y, comp, (const unsigned char *) data, stride_bytes, NULL, NULL, stbi_write_png_compression_level));
+   return ok;
 }
 #endif // STB_IMAGE_WRITE_IMPLEMENTATION
 
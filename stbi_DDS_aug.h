@@ -7,11 +7,23 @@
 
 //	is it a DDS file?
 extern int      stbi_dds_test_memory      (stbi_uc const *buffer, int len);
+extern int      stbi_dds_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 extern stbi_uc *stbi_dds_load             (char *filename,           int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_dds_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+
+//	DXT1/3/5 blocks as they are in the file: where level 0 starts inside
+//	buffer, with *dxt 1, 3 or 5 and the *levels mip levels that follow it
+extern stbi_uc const *stbi_dds_blocks_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *dxt, int *levels);
+//	bytes in one mip level of those blocks, and its size in pixels
+extern int      stbi_dds_level_size       (int x, int y, int dxt, int level, int *lx, int *ly);
+//	decodes one x by y level of such blocks into 4 component RGBA at out,
+//	large ones a band of block rows per job through stbi_parallel
+extern void     stbi_dds_decode_blocks    (stbi_uc const *blocks, int x, int y, int dxt, stbi_uc *out);
 #ifndef STBI_NO_STDIO
 extern int      stbi_dds_test_file        (FILE *f);
+extern int      stbi_dds_info             (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_dds_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 extern stbi_uc *stbi_dds_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 #endif
 
@@ -265,12 +265,254 @@ void stbi_decode_DXT_color_block(
 	}
 	//	done
 }
+/*	bytes in mip level 'level' of an x by y DXT surface, whose size
+	in pixels goes to *lx, *ly; DXT1 blocks are 8 bytes, the rest 16	*/
+int stbi_dds_level_size( int x, int y, int dxt, int level, int *lx, int *ly )
+{
+	int w = x >> level;
+	int h = y >> level;
+	if( w < 1 )
+	{
+		w = 1;
+	}
+	if( h < 1 )
+	{
+		h = 1;
+	}
+	if( lx ) *lx = w;
+	if( ly ) *ly = h;
+	return ((w+3) >> 2) * ((h+3) >> 2) * (dxt == 1 ? 8 : 16);
+}
+#ifdef STBI_SSE2
+/*	the 4 colours of a DXT colour block as RGBA words: DXT1 has its
+	3 colour + transparent mode, the others always 4 colours with
+	alpha 0, to be filled in from the alpha block	*/
+static void dxt_palette( stbi_uc const *c, int dxt1, uint32 pal[4] )
+{
+	int c0 = c[0] + (c[1] << 8);
+	int c1 = c[2] + (c[3] << 8);
+	int r0, g0, b0, r1, g1, b1;
+	uint32 a = dxt1 ? 0xff000000u : 0;
+	stbi_rgb_888_from_565( c0, &r0, &g0, &b0 );
+	stbi_rgb_888_from_565( c1, &r1, &g1, &b1 );
+	pal[0] = r0 | (g0 << 8) | (b0 << 16) | a;
+	pal[1] = r1 | (g1 << 8) | (b1 << 16) | a;
+	if( !dxt1 || (c0 > c1) )
+	{
+		pal[2] = (2*r0 + r1) / 3 | ((2*g0 + g1) / 3 << 8) | ((2*b0 + b1) / 3 << 16) | a;
+		pal[3] = (r0 + 2*r1) / 3 | ((g0 + 2*g1) / 3 << 8) | ((b0 + 2*b1) / 3 << 16) | a;
+	} else
+	{
+		pal[2] = (r0 + r1) / 2 | ((g0 + g1) / 2 << 8) | ((b0 + b1) / 2 << 16) | a;
+		pal[3] = 0;
+	}
+}
+
+/*	stbi_convert_bit_range( i, 4, 8 ) for every 4 bit alpha	*/
+static const stbi_uc dxt_alpha4[16] = {
+	0, 17, 34, 51, 68, 85, 102, 119, 136, 152, 169, 186, 203, 220, 237, 254
+};
+
+/*	the 8 alpha levels of a DXT4/5 block, as stbi_decode_DXT45_alpha_block	*/
+static void dxt_alpha_levels( int a0, int a1, stbi_uc levels[8] )
+{
+	int k;
+	levels[0] = a0;
+	levels[1] = a1;
+	if( a0 > a1 )
+	{
+		for( k = 1; k < 7; ++k )
+		{
+			levels[k + 1] = ((7 - k)*a0 + k*a1) / 7;
+		}
+	} else
+	{
+		for( k = 1; k < 5; ++k )
+		{
+			levels[k + 1] = ((5 - k)*a0 + k*a1) / 5;
+		}
+		levels[6] = 0;
+		levels[7] = 255;
+	}
+}
+
+/*	one block, each 4 pixel row selected from the palette with
+	compare masks (SSE2 has no variable shuffle) and stored straight
+	into its row of dst; bw x bh is the part inside the image	*/
+static void dxt_block( stbi_uc *dst, int stride, int bw, int bh, int dxt, stbi_uc const *block )
+{
+	stbi_uc const *color = (dxt == 1) ? block : block + 8;
+	__m128i rows[4], p0, p1, p2, p3, lanes, k1;
+	uint32 pal[4];
+	int r, k;
+	dxt_palette( color, dxt == 1, pal );
+	p0 = _mm_set1_epi32( (int)pal[0] );
+	p1 = _mm_set1_epi32( (int)pal[1] );
+	p2 = _mm_set1_epi32( (int)pal[2] );
+	p3 = _mm_set1_epi32( (int)pal[3] );
+	/*	pixel i of a row is bits 2i of its byte	*/
+	lanes = _mm_set_epi32( 3 << 6, 3 << 4, 3 << 2, 3 );
+	k1 = _mm_set_epi32( 1 << 6, 1 << 4, 1 << 2, 1 );
+	for( r = 0; r < 4; ++r )
+	{
+		__m128i idx = _mm_and_si128( _mm_set1_epi32( color[4 + r] ), lanes );
+		__m128i m0 = _mm_cmpeq_epi32( idx, _mm_setzero_si128() );
+		__m128i m1 = _mm_cmpeq_epi32( idx, k1 );
+		__m128i m2 = _mm_cmpeq_epi32( idx, _mm_add_epi32( k1, k1 ) );
+		__m128i m3 = _mm_cmpeq_epi32( idx, lanes );
+		rows[r] = _mm_or_si128(
+				_mm_or_si128( _mm_and_si128( m0, p0 ), _mm_and_si128( m1, p1 ) ),
+				_mm_or_si128( _mm_and_si128( m2, p2 ), _mm_and_si128( m3, p3 ) ) );
+	}
+	if( dxt > 1 )
+	{
+		/*	the 16 alphas as bytes, then spread into the top byte of
+			each pixel: 2 interleaves with zero put byte i at i*4+3	*/
+		stbi_uc alpha[16];
+		__m128i a, zero = _mm_setzero_si128();
+		if( dxt < 4 )
+		{
+			/*	explicit 4 bit alpha, pixel i at bits 4i	*/
+			for( k = 0; k < 16; ++k )
+			{
+				alpha[k] = dxt_alpha4[(block[k >> 1] >> ((k & 1) * 4)) & 15];
+			}
+		} else
+		{
+			/*	8 interpolated levels, pixel i at bits 3i after the
+				2 end points	*/
+			stbi_uc levels[8];
+			uint64 bits = 0;
+			dxt_alpha_levels( block[0], block[1], levels );
+			for( k = 7; k >= 2; --k )
+			{
+				bits = (bits << 8) | block[k];
+			}
+			for( k = 0; k < 16; ++k, bits >>= 3 )
+			{
+				alpha[k] = levels[bits & 7];
+			}
+		}
+		a = _mm_loadu_si128( (__m128i const *)alpha );
+		rows[0] = _mm_or_si128( rows[0], _mm_unpacklo_epi16( zero, _mm_unpacklo_epi8( zero, a ) ) );
+		rows[1] = _mm_or_si128( rows[1], _mm_unpackhi_epi16( zero, _mm_unpacklo_epi8( zero, a ) ) );
+		rows[2] = _mm_or_si128( rows[2], _mm_unpacklo_epi16( zero, _mm_unpackhi_epi8( zero, a ) ) );
+		rows[3] = _mm_or_si128( rows[3], _mm_unpackhi_epi16( zero, _mm_unpackhi_epi8( zero, a ) ) );
+	}
+	if( (bw == 4) && (bh == 4) )
+	{
+		for( r = 0; r < 4; ++r )
+		{
+			_mm_storeu_si128( (__m128i *)(dst + r*stride), rows[r] );
+		}
+	} else
+	{
+		stbi_uc row[16];
+		for( r = 0; r < bh; ++r )
+		{
+			_mm_storeu_si128( (__m128i *)row, rows[r] );
+			memcpy( dst + r*stride, row, bw*4 );
+		}
+	}
+}
+#else
+static void dxt_block( stbi_uc *dst, int stride, int bw, int bh, int dxt, stbi_uc const *block )
+{
+	stbi_uc decoded[16*4];
+	int r;
+	if( dxt == 1 )
+	{
+		stbi_decode_DXT1_block( decoded, (stbi_uc *)block );
+	} else
+	{
+		if( dxt < 4 )
+		{
+			stbi_decode_DXT23_alpha_block( decoded, (stbi_uc *)block );
+		} else
+		{
+			stbi_decode_DXT45_alpha_block( decoded, (stbi_uc *)block );
+		}
+		stbi_decode_DXT_color_block( decoded, (stbi_uc *)block + 8 );
+	}
+	for( r = 0; r < bh; ++r )
+	{
+		memcpy( dst + r*stride, decoded + r*16, bw*4 );
+	}
+}
+#endif
+
+/*	block rows [first, first + rows) of an x by y surface into the
+	RGBA image out	*/
+static void dxt_decode_rows( stbi_uc *out, int x, int y, int dxt, stbi_uc const *blocks, int first, int rows )
+{
+	int bx, by, bw, bh;
+	int blocks_x = (x+3) >> 2;
+	int block_size = (dxt == 1) ? 8 : 16;
+	for( by = first; by < first + rows; ++by )
+	{
+		stbi_uc const *block = blocks + (size_t)by * blocks_x * block_size;
+		stbi_uc *row = out + (size_t)by * 4 * x * 4;
+		bh = (y - by*4 < 4) ? y - by*4 : 4;
+		for( bx = 0; bx < blocks_x; ++bx, block += block_size )
+		{
+			bw = (x - bx*4 < 4) ? x - bx*4 : 4;
+			dxt_block( row + bx*16, x*4, bw, bh, dxt, block );
+		}
+	}
+}
+
+typedef struct
+{
+	stbi_uc *out;
+	stbi_uc const *blocks;
+	int x, y, dxt;
+	int first, rows;
+} dxt_job;
+
+static void dxt_run_job( void *job )
+{
+	dxt_job *j = (dxt_job *)job;
+	dxt_decode_rows( j->out, j->x, j->y, j->dxt, j->blocks, j->first, j->rows );
+}
+
+/*	smaller surfaces aren't worth starting threads for	*/
+#define DXT_PARALLEL_MIN	(256*256)
+#define DXT_MAX_JOBS		64
+
+void stbi_dds_decode_blocks( stbi_uc const *blocks, int x, int y, int dxt, stbi_uc *out )
+{
+	dxt_job jobs[DXT_MAX_JOBS];
+	int block_rows = (y+3) >> 2;
+	int i, n, per;
+	if( !stbi_parallel || ((x*y) < DXT_PARALLEL_MIN) )
+	{
+		dxt_decode_rows( out, x, y, dxt, blocks, 0, block_rows );
+		return;
+	}
+	/*	bands of at least 16 block rows	*/
+	n = (block_rows + 15) / 16;
+	if( n > DXT_MAX_JOBS )
+	{
+		n = DXT_MAX_JOBS;
+	}
+	per = (block_rows + n - 1) / n;
+	for( i = 0; (i < n) && (i*per < block_rows); ++i )
+	{
+		jobs[i].out = out;
+		jobs[i].blocks = blocks;
+		jobs[i].x = x;
+		jobs[i].y = y;
+		jobs[i].dxt = dxt;
+		jobs[i].first = i*per;
+		jobs[i].rows = (block_rows - i*per < per) ? block_rows - i*per : per;
+	}
+	stbi_parallel( dxt_run_job, jobs, sizeof( dxt_job ), i );
+}
+
 static stbi_uc *dds_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
 	//	all variables go up front
 	stbi_uc *dds_data = NULL;
-	stbi_uc block[16*4];
-	stbi_uc compressed[8];
 	int flags, DXT_family;
 	int has_alpha, has_mipmap;
 	int is_compressed, cubemap_faces;
@@ -327,79 +569,28 @@ static stbi_uc *dds_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 		//	passed all the tests, get the RAM for decoding
 		sz = (s->img_x)*(s->img_y)*4*cubemap_faces;
 		dds_data = (unsigned char*)malloc( sz );
+		if( dds_data == NULL ) return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
 		/*	do this once for each face	*/
 		for( cf = 0; cf < cubemap_faces; ++ cf )
 		{
-			//	now read and decode all the blocks
-			for( i = 0; i < num_blocks; ++i )
+			//	all of the face's blocks at once, decoded straight into place
+			stbi_uc *temp;
+			stbi_uc const *blocks = getn_block( s, num_blocks * (DXT_family == 1 ? 8 : 16), &temp );
+			if( blocks == NULL )
 			{
-				//	where are we?
-				int bx, by, bw=4, bh=4;
-				int ref_x = 4 * (i % block_pitch);
-				int ref_y = 4 * (i / block_pitch);
-				//	get the next block's worth of compressed data, and decompress it
-				if( DXT_family == 1 )
-				{
-					//	DXT1
-					getn( s, compressed, 8 );
-					stbi_decode_DXT1_block( block, compressed );
-				} else if( DXT_family < 4 )
-				{
-					//	DXT2/3
-					getn( s, compressed, 8 );
-					stbi_decode_DXT23_alpha_block ( block, compressed );
-					getn( s, compressed, 8 );
-					stbi_decode_DXT_color_block ( block, compressed );
-				} else
-				{
-					//	DXT4/5
-					getn( s, compressed, 8 );
-					stbi_decode_DXT45_alpha_block ( block, compressed );
-					getn( s, compressed, 8 );
-					stbi_decode_DXT_color_block ( block, compressed );
-				}
-				//	is this a partial block?
-				if( (uint)ref_x + 4 > s->img_x )
-				{
-					bw = s->img_x - ref_x;
-				}
-				if( (uint)ref_y + 4 > s->img_y )
-				{
-					bh = s->img_y - ref_y;
-				}
-				//	now drop our decompressed data into the buffer
-				for( by = 0; by < bh; ++by )
-				{
-					int idx = 4*((ref_y+by+cf*s->img_x)*s->img_x + ref_x);
-					for( bx = 0; bx < bw*4; ++bx )
-					{
-
-						dds_data[idx+bx] = block[by*16+bx];
-					}
-				}
+				free( dds_data );
+				return epucc("outofmem", "Out of memory", STBI_ERROR_OUT_OF_MEMORY);
 			}
+			stbi_dds_decode_blocks( blocks, s->img_x, s->img_y, DXT_family,
+					dds_data + (size_t)cf * s->img_x * s->img_y * 4 );
+			free( temp );
 			/*	done reading and decoding the main image...
 				skip MIPmaps if present	*/
 			if( has_mipmap )
 			{
-				int block_size = 16;
-				if( DXT_family == 1 )
-				{
-					block_size = 8;
-				}
 				for( i = 1; (uint)i < header.dwMipMapCount; ++i )
 				{
-					int mx = s->img_x >> (i + 2);
-					int my = s->img_y >> (i + 2);
-					if( mx < 1 )
-					{
-						mx = 1;
-					}
-					if( my < 1 )
-					{
-						my = 1;
-					}
-					skip( s, mx*my*block_size );
+					skip( s, stbi_dds_level_size( s->img_x, s->img_y, DXT_family, i, NULL, NULL ) );
 				}
 			}
 		}/* per cubemap face */
@@ -509,3 +700,116 @@ stbi_uc *stbi_dds_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    start_mem(&s,buffer, len);
    return dds_load(&s,x,y,comp,req_comp);
 }
+
+/*	header-only: the loader drops fully opaque images to RGB after
+	decoding, which can't be known here, so comp follows the header:
+	DXT1 without DDPF_ALPHAPIXELS and RGB without alpha report 3	*/
+static int dds_info(stbi *s, int *x, int *y, int *comp)
+{
+	DDS_header header;
+	int flags, cubemap_faces;
+	getn( s, (stbi_uc*)(&header), 128 );
+	if( header.dwMagic != (('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24)) ) return e("not DDS", "Corrupt DDS");
+	if( header.dwSize != 124 ) return e("not DDS", "Corrupt DDS");
+	flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT;
+	if( (header.dwFlags & flags) != (uint)flags ) return e("bad DDS", "Corrupt DDS");
+	if( header.sPixelFormat.dwSize != 32 ) return e("bad DDS", "Corrupt DDS");
+	flags = DDPF_FOURCC | DDPF_RGB;
+	if( (header.sPixelFormat.dwFlags & flags) == 0 ) return e("bad DDS", "Corrupt DDS");
+	if( (header.sCaps.dwCaps1 & DDSCAPS_TEXTURE) == 0 ) return e("bad DDS", "Corrupt DDS");
+	cubemap_faces = (header.sCaps.dwCaps2 & DDSCAPS2_CUBEMAP) / DDSCAPS2_CUBEMAP;
+	cubemap_faces &= (header.dwWidth == header.dwHeight);
+	cubemap_faces = cubemap_faces * 5 + 1;
+	if( x ) *x = header.dwWidth;
+	if( y ) *y = header.dwHeight * cubemap_faces;
+	if( comp )
+	{
+		if( header.sPixelFormat.dwFlags & DDPF_FOURCC )
+		{
+			int DXT_family = 1 + (header.sPixelFormat.dwFourCC >> 24) - '1';
+			if( (DXT_family < 1) || (DXT_family > 5) ) return ec("bad DXT", "DDS format not supported", STBI_ERROR_UNSUPPORTED);
+			*comp = ((DXT_family == 1) && !(header.sPixelFormat.dwFlags & DDPF_ALPHAPIXELS)) ? 3 : 4;
+		} else
+		{
+			*comp = (header.sPixelFormat.dwFlags & DDPF_ALPHAPIXELS) ? 4 : 3;
+		}
+	}
+	return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int      stbi_dds_info_from_file   (FILE *f,                  int *x, int *y, int *comp)
+{
+	stbi s;
+   int r,n = ftell(f);
+   start_file(&s,f);
+   r = dds_info(&s,x,y,comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
+
+int      stbi_dds_info             (char const *filename,     int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return ec("can't fopen", "Unable to open file", STBI_ERROR_IO);
+   r = stbi_dds_info_from_file(f,x,y,comp);
+   fclose(f);
+   return r;
+}
+#endif
+
+int      stbi_dds_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+	stbi s;
+   start_mem(&s,buffer, len);
+   return dds_info(&s,x,y,comp);
+}
+
+/*	the compressed passthrough: checks the header like dds_info, then
+	hands back where the blocks start in the caller's buffer, with
+	nothing decoded or copied. only the levels the buffer really holds
+	are counted; cubemaps and volumes are left to the decoding loader	*/
+stbi_uc const *stbi_dds_blocks_from_memory( stbi_uc const *buffer, int len, int *x, int *y, int *dxt, int *levels )
+{
+	DDS_header header;
+	int flags, family, w, h, n, i, sz, offset;
+	if( len < 128 ) return epuc("not DDS", "Corrupt DDS");
+	memcpy( &header, buffer, 128 );
+	if( header.dwMagic != (('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24)) ) return epuc("not DDS", "Corrupt DDS");
+	if( header.dwSize != 124 ) return epuc("not DDS", "Corrupt DDS");
+	flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT;
+	if( (header.dwFlags & flags) != (uint)flags ) return epuc("bad DDS", "Corrupt DDS");
+	if( header.sPixelFormat.dwSize != 32 ) return epuc("bad DDS", "Corrupt DDS");
+	if( (header.sCaps.dwCaps1 & DDSCAPS_TEXTURE) == 0 ) return epuc("bad DDS", "Corrupt DDS");
+	if( (header.sPixelFormat.dwFlags & DDPF_FOURCC) == 0 ) return epucc("not DXT", "Uncompressed DDS not supported as blocks", STBI_ERROR_UNSUPPORTED);
+	family = 1 + (header.sPixelFormat.dwFourCC >> 24) - '1';
+	if( (family != 1) && (family != 3) && (family != 5) ) return epucc("bad DXT", "DDS format not supported", STBI_ERROR_UNSUPPORTED);
+	if( header.sCaps.dwCaps2 & (DDSCAPS2_CUBEMAP | DDSCAPS2_VOLUME) ) return epucc("DDS cubemap", "DDS cubemaps and volumes not supported as blocks", STBI_ERROR_UNSUPPORTED);
+	/*	keeps every level's size well inside an int	*/
+	if( (header.dwWidth < 1) || (header.dwHeight < 1) || (header.dwWidth > 32768) || (header.dwHeight > 32768) )
+	{
+		return epucc("too large", "Image too large to decode", STBI_ERROR_UNSUPPORTED);
+	}
+	w = header.dwWidth;
+	h = header.dwHeight;
+	n = 1;
+	if( (header.sCaps.dwCaps1 & DDSCAPS_MIPMAP) && (header.dwMipMapCount > 1) )
+	{
+		n = header.dwMipMapCount > 32 ? 32 : header.dwMipMapCount;
+	}
+	for( i = 0, offset = 128; i < n; ++i )
+	{
+		sz = stbi_dds_level_size( w, h, family, i, NULL, NULL );
+		if( sz > len - offset ) break;
+		offset += sz;
+		/*	the chain ends at 1x1, whatever the header says	*/
+		if( ((w >> i) <= 1) && ((h >> i) <= 1) ) n = i + 1;
+	}
+	if( i == 0 ) return epuc("truncated DDS", "Corrupt DDS");
+	*x = w;
+	*y = h;
+	*dxt = family;
+	*levels = i;
+	return buffer + 128;
+}
@@ -0,0 +1,245 @@
+/*
+ * checks that every lazy load gives exactly what the eager one does:
+ * size, format and pixels, for each image type and requested format.
+ * the images are made in memory, so it needs no files:
+ *
+ *   gcc -std=gnu99 -I.. lazy_test.c ../gdx2d.c ../SOIL.c ../stb_image_aug.c \
+ *       ../image_helper.c ../image_DXT.c ../image_thread.c ../image_checksum.c \
+ *       -lm -lpthread -o lazy_test
+ *
+ * exits with the number of failed checks.
+ */
+#include "gdx2d.h"
+#include "SOIL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(name, c) \
+	if(!(c)) { \
+		printf("FAIL %s: %s\n", name, #c); \
+		failures++; \
+	}
+
+/* a 16x16 baseline RGB JPEG */
+static const unsigned char jpeg_image[] = {
+	0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46, 0x49, 0x46, 0x00, 0x01, 0x01, 0x01, 0x00, 0x01,
+	0x00, 0x01, 0x00, 0x00, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x03, 0x02, 0x02, 0x02, 0x02, 0x02, 0x03,
+	0x02, 0x02, 0x02, 0x03, 0x03, 0x03, 0x03, 0x04, 0x06, 0x04, 0x04, 0x04, 0x04, 0x04, 0x08, 0x06,
+	0x06, 0x05, 0x06, 0x09, 0x08, 0x0a, 0x0a, 0x09, 0x08, 0x09, 0x09, 0x0a, 0x0c, 0x0f, 0x0c, 0x0a,
+	0x0b, 0x0e, 0x0b, 0x09, 0x09, 0x0d, 0x11, 0x0d, 0x0e, 0x0f, 0x10, 0x10, 0x11, 0x10, 0x0a, 0x0c,
+	0x12, 0x13, 0x12, 0x10, 0x13, 0x0f, 0x10, 0x10, 0x10, 0xff, 0xdb, 0x00, 0x43, 0x01, 0x03, 0x03,
+	0x03, 0x04, 0x03, 0x04, 0x08, 0x04, 0x04, 0x08, 0x10, 0x0b, 0x09, 0x0b, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0xff, 0xc0,
+	0x00, 0x11, 0x08, 0x00, 0x10, 0x00, 0x10, 0x03, 0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11,
+	0x01, 0xff, 0xc4, 0x00, 0x16, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x04, 0x05, 0xff, 0xc4, 0x00, 0x24, 0x10, 0x00, 0x01,
+	0x04, 0x01, 0x04, 0x02, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+	0x03, 0x04, 0x06, 0x05, 0x07, 0x08, 0x12, 0x13, 0x11, 0x22, 0x00, 0x14, 0x09, 0x31, 0x32, 0xff,
+	0xc4, 0x00, 0x15, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0xff, 0xc4, 0x00, 0x23, 0x11, 0x00, 0x01, 0x02, 0x05, 0x03,
+	0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x11, 0x03, 0x04,
+	0x05, 0x06, 0x21, 0x00, 0x12, 0x31, 0x15, 0x16, 0x61, 0x81, 0xe1, 0xff, 0xda, 0x00, 0x0c, 0x03,
+	0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0x14, 0xa6, 0xd2, 0x6a, 0x1b, 0x73, 0xc1,
+	0xe6, 0x13, 0x12, 0xd4, 0x95, 0x1c, 0xf3, 0x11, 0x63, 0xe4, 0x25, 0x65, 0xbe, 0xba, 0x5a, 0xec,
+	0x69, 0x45, 0x40, 0xb1, 0xe5, 0x20, 0xb2, 0x54, 0xa5, 0x1f, 0xd2, 0xca, 0xb8, 0xfa, 0xf2, 0x20,
+	0xab, 0x96, 0x3d, 0x97, 0x6c, 0x93, 0x35, 0xe6, 0x9b, 0x77, 0xd7, 0xe6, 0x6d, 0xa7, 0x17, 0x81,
+	0xa5, 0x57, 0x1c, 0x7f, 0x1c, 0xea, 0x71, 0xe2, 0x4b, 0x39, 0xd7, 0xe3, 0x22, 0x53, 0xf2, 0x1a,
+	0x69, 0xde, 0xd4, 0x71, 0x4a, 0x38, 0xb4, 0x82, 0xe8, 0x4b, 0x89, 0x2a, 0x71, 0x69, 0x1e, 0xcd,
+	0x2d, 0x21, 0x3b, 0xf1, 0xef, 0xb9, 0x1a, 0x74, 0xac, 0xee, 0xa1, 0x5a, 0x75, 0x8e, 0xd5, 0x48,
+	0xac, 0x65, 0x5b, 0x85, 0x8b, 0x81, 0x85, 0x7b, 0x21, 0x29, 0x98, 0x67, 0xa9, 0x6b, 0x94, 0xb9,
+	0x49, 0x65, 0x4f, 0xb9, 0xc8, 0x85, 0x29, 0x11, 0x4b, 0x81, 0x2a, 0xf0, 0x7a, 0xd9, 0xf2, 0x3c,
+	0x80, 0x7e, 0x55, 0xbe, 0x0d, 0xf6, 0x62, 0xa1, 0x40, 0xcc, 0xe8, 0xe6, 0x9a, 0x3d, 0x5c, 0xb7,
+	0x43, 0xb3, 0xd7, 0x7a, 0x65, 0x58, 0xb1, 0xd9, 0x51, 0x21, 0x88, 0xbf, 0x64, 0xb8, 0xd3, 0xf1,
+	0xc3, 0x68, 0x04, 0x29, 0xc0, 0xd0, 0xfe, 0xbb, 0x3c, 0x02, 0xe0, 0x3c, 0x54, 0x07, 0xb4, 0xbd,
+	0xd9, 0x7b, 0x54, 0xe6, 0x27, 0xfb, 0x6e, 0xdf, 0x94, 0x60, 0x14, 0x82, 0x62, 0x13, 0x8d, 0xb8,
+	0x52, 0x98, 0x28, 0x37, 0x05, 0x89, 0x72, 0x79, 0x60, 0xe4, 0x32, 0x89, 0x6f, 0xc3, 0x82, 0x8e,
+	0xa7, 0x52, 0x8c, 0xea, 0x20, 0x8d, 0xbe, 0x78, 0x19, 0x1f, 0x07, 0xad, 0x7f, 0xff, 0xd9,
+};
+
+static void put32(unsigned char* p, unsigned int v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static void put_be(unsigned char* p, unsigned int v, int bytes) {
+	while(bytes--) {
+		p[bytes] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/* an 8x8 DDS of one DXT family, every block the same; alpha_flag
+   sets DDPF_ALPHAPIXELS, which the header probe goes by */
+static unsigned char* make_dds(int family, const unsigned char* block, int alpha_flag, int* len) {
+	int block_size = family == 1 ? 8 : 16;
+	unsigned char* dds;
+	int i;
+	*len = 128 + 4 * block_size;
+	dds = (unsigned char*)calloc(1, *len);
+	memcpy(dds, "DDS ", 4);
+	put32(dds + 4, 124);
+	put32(dds + 8, 0x1 | 0x2 | 0x4 | 0x1000);
+	put32(dds + 12, 8);
+	put32(dds + 16, 8);
+	put32(dds + 76, 32);
+	put32(dds + 80, 0x4 | (alpha_flag ? 0x1 : 0));
+	memcpy(dds + 84, family == 1 ? "DXT1" : "DXT5", 4);
+	put32(dds + 108, 0x1000);
+	for(i = 0; i < 4; i++)
+		memcpy(dds + 128 + i * block_size, block, block_size);
+	return dds;
+}
+
+/* a flat, unencoded Radiance file, width under 8 */
+static unsigned char* make_hdr(int* len) {
+	static const char header[] = "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 3 +X 5\n";
+	int size = sizeof(header) - 1;
+	unsigned char* hdr = (unsigned char*)malloc(size + 5 * 3 * 4);
+	int i;
+	memcpy(hdr, header, size);
+	for(i = 0; i < 5 * 3; i++) {
+		hdr[size + i * 4 + 0] = (unsigned char)(40 + i * 13);
+		hdr[size + i * 4 + 1] = (unsigned char)(200 - i * 7);
+		hdr[size + i * 4 + 2] = (unsigned char)(i * 17);
+		hdr[size + i * 4 + 3] = (unsigned char)(124 + i % 6);
+	}
+	*len = size + 5 * 3 * 4;
+	return hdr;
+}
+
+/* an uncompressed 8 bit RGB PSD */
+static unsigned char* make_psd(int width, int height, int* len) {
+	int planes = width * height * 3;
+	unsigned char* psd = (unsigned char*)calloc(1, 40 + planes);
+	int i;
+	memcpy(psd, "8BPS", 4);
+	put_be(psd + 4, 1, 2);
+	put_be(psd + 12, 3, 2);
+	put_be(psd + 14, height, 4);
+	put_be(psd + 18, width, 4);
+	put_be(psd + 22, 8, 2);
+	put_be(psd + 24, 3, 2);
+	for(i = 0; i < planes; i++)
+		psd[40 + i] = (unsigned char)(i * 29 + i / 7);
+	*len = 40 + planes;
+	return psd;
+}
+
+/* a gradient, with alpha if the format has it */
+static Pixmap* make_pixmap(int format) {
+	Pixmap* pixmap = pixmap_new(13, 9, format);
+	int x, y;
+	for(y = 0; y < 9; y++)
+		for(x = 0; x < 13; x++)
+			pixmap_set_pixel(pixmap, x, y, (int)((unsigned)(x * 19) << 24 | (y * 27) << 16 | ((x + y) * 11) << 8 | (255 - x * y)));
+	return pixmap;
+}
+
+static void compare(const char* name, const unsigned char* buffer, int len, int req_format) {
+	Pixmap* eager = pixmap_loadmemory(buffer, len, req_format);
+	Pixmap* lazy = pixmap_loadmemory_lazy(buffer, len, req_format);
+	const unsigned char* pixels;
+	char label[64];
+	int x, y;
+
+	snprintf(label, sizeof(label), "%s req %d", name, req_format);
+	CHECK(label, eager != NULL);
+	CHECK(label, lazy != NULL);
+	if(!eager || !lazy) {
+		if(eager) pixmap_free(eager);
+		if(lazy) pixmap_free(lazy);
+		return;
+	}
+	CHECK(label, lazy->pixels == NULL);
+	CHECK(label, lazy->width == eager->width && lazy->height == eager->height);
+
+	pixels = pixmap_lock_pixels(lazy);
+	CHECK(label, pixels != NULL);
+	CHECK(label, lazy->format == eager->format);
+	if(pixels && lazy->format == eager->format)
+		CHECK(label, !memcmp(pixels, eager->pixels, (size_t)eager->width * eager->height * pixmap_bytes_per_pixel(eager->format)));
+	pixmap_unlock_pixels(lazy);
+
+	for(y = 0; y < eager->height; y++)
+		for(x = 0; x < eager->width; x++)
+			if(pixmap_get_pixel(lazy, x, y) != pixmap_get_pixel(eager, x, y)) {
+				CHECK(label, pixmap_get_pixel(lazy, x, y) == pixmap_get_pixel(eager, x, y));
+				y = eager->height;
+				break;
+			}
+	pixmap_free(eager);
+	pixmap_free(lazy);
+}
+
+static void compare_formats(const char* name, const unsigned char* buffer, int len) {
+	static const int formats[] = {
+		0, pixmap_FORMAT_ALPHA, pixmap_FORMAT_LUMINANCE_ALPHA, pixmap_FORMAT_RGB888,
+		pixmap_FORMAT_RGBA8888, pixmap_FORMAT_RGB565, pixmap_FORMAT_RGBA4444, pixmap_FORMAT_RGBA32F
+	};
+	int i;
+	for(i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+		compare(name, buffer, len, formats[i]);
+}
+
+static void compare_saved(const char* name, int format, int save_type) {
+	Pixmap* pixmap = make_pixmap(format);
+	int len;
+	unsigned char* saved = pixmap_save_to_memory(pixmap, save_type, NULL, &len);
+	CHECK(name, saved != NULL);
+	if(saved) compare_formats(name, saved, len);
+	free(saved);
+	pixmap_free(pixmap);
+}
+
+int main(void) {
+	/* two opaque colours and index 3, transparent black, as color0 <= color1 */
+	static const unsigned char punch_through[8] = { 0x00, 0x00, 0xff, 0xff, 0x1b, 0xe4, 0xff, 0x00 };
+	static const unsigned char opaque_dxt1[8] = { 0xff, 0xff, 0x00, 0x00, 0x1b, 0xe4, 0x4e, 0xb1 };
+	static const unsigned char opaque_dxt5[16] = {
+		0xff, 0xff, 0, 0, 0, 0, 0, 0, 0x1f, 0xf8, 0xe0, 0x07, 0x1b, 0xe4, 0x4e, 0xb1
+	};
+	unsigned char* buffer;
+	int len;
+
+	compare_saved("png rgba", pixmap_FORMAT_RGBA8888, SOIL_SAVE_TYPE_PNG);
+	compare_saved("png rgb", pixmap_FORMAT_RGB888, SOIL_SAVE_TYPE_PNG);
+	compare_saved("png grey", pixmap_FORMAT_ALPHA, SOIL_SAVE_TYPE_PNG);
+	compare_saved("png grey alpha", pixmap_FORMAT_LUMINANCE_ALPHA, SOIL_SAVE_TYPE_PNG);
+	compare_saved("bmp", pixmap_FORMAT_RGB888, SOIL_SAVE_TYPE_BMP);
+	compare_saved("tga rgba", pixmap_FORMAT_RGBA8888, SOIL_SAVE_TYPE_TGA);
+	compare_saved("tga rgb", pixmap_FORMAT_RGB888, SOIL_SAVE_TYPE_TGA);
+	compare_saved("dds rgba", pixmap_FORMAT_RGBA8888, SOIL_SAVE_TYPE_DDS);
+	compare_saved("dds rgb", pixmap_FORMAT_RGB888, SOIL_SAVE_TYPE_DDS);
+
+	compare_formats("jpeg", jpeg_image, sizeof(jpeg_image));
+
+	/* the header says RGB, the blocks have alpha */
+	buffer = make_dds(1, punch_through, 0, &len);
+	compare_formats("dxt1 punch-through", buffer, len);
+	free(buffer);
+	buffer = make_dds(1, opaque_dxt1, 0, &len);
+	compare_formats("dxt1 opaque", buffer, len);
+	free(buffer);
+	/* the header says RGBA, every pixel is opaque */
+	buffer = make_dds(5, opaque_dxt5, 1, &len);
+	compare_formats("dxt5 opaque", buffer, len);
+	free(buffer);
+
+	buffer = make_hdr(&len);
+	compare_formats("hdr", buffer, len);
+	free(buffer);
+
+	buffer = make_psd(6, 5, &len);
+	compare_formats("psd", buffer, len);
+	free(buffer);
+
+	printf("%d failed\n", failures);
+	return failures;
+}